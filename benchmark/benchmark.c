@@ -0,0 +1,157 @@
+/* Pico Sequencer Synth benchmark
+** Measures the time the synth takes to render an audio buffer, in CPU
+** cycles, with the XIP cache undisturbed, flushed before every buffer,
+** and thrashed by flash reads from the other core.
+**
+** Build it with and without SYNTH_IN_RAM=0 in CMakeLists.txt to compare
+** the render path in flash with the render path in SRAM. The results
+** are printed over USB.
+**/
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/structs/systick.h"
+#include "hardware/structs/xip_ctrl.h"
+#include "hardware/clocks.h"
+#include <synth_sequencer.h>
+
+#define SAMPLE_RATE   44100
+#define NUM_VOICES    8
+#define NUM_DRUMS     4
+#define BUFFER_FRAMES 256
+#define RUNS          2000
+
+// The XIP cache is 16KB with 8-byte lines: reading 64KB of flash at
+// that stride evicts all of it
+#define THRASH_BYTES  (64 * 1024)
+#define THRASH_STRIDE 8
+
+enum BenchmarkMode {
+  MODE_QUIET,     // nothing else runs
+  MODE_FLUSHED,   // the XIP cache is flushed before every buffer
+  MODE_THRASHED,  // core 1 keeps evicting the XIP cache
+  MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = { "quiet", "flushed", "thrashed" };
+
+static uint32_t buffer[BUFFER_FRAMES];
+static uint8_t delay_buffer[8000];
+static uint8_t reverb_buffer[6000];
+
+/**
+ * @brief Reads flash from core 1 until reset, evicting the XIP cache.
+ */
+static void thrash_cache() {
+  volatile const uint8_t *flash = (volatile const uint8_t *)XIP_BASE;
+  while(true) {
+    for(uint32_t i = 0; i < THRASH_BYTES; i += THRASH_STRIDE) {
+      (void)flash[i];
+    }
+  }
+}
+
+/**
+ * @brief Starts notes on all the voices and triggers the drums.
+ */
+static void play_chord() {
+  static const uint16_t frequencies[NUM_VOICES] = { 110, 165, 220, 277, 330, 440, 554, 660 };
+  for(uint8_t i = 0; i < NUM_VOICES; i++) {
+    SynthEvent event = {
+      .frame = synth_get_frame(),
+      .type = EVENT_NOTE_ON,
+      .channel = i,
+      .value = frequencies[i],
+      .velocity = 0xffff
+    };
+    synth_queue_event(&event);
+  }
+  for(uint8_t i = 0; i < NUM_DRUMS; i++) {
+    drums_trigger(i, 0xffff);
+  }
+}
+
+/**
+ * @brief Renders buffers and prints their render time.
+ *
+ * @param mode One of BenchmarkMode.
+ */
+static void run(uint8_t mode) {
+  uint32_t total = 0;
+  uint32_t max = 0;
+
+  if(mode == MODE_THRASHED) {
+    multicore_launch_core1(thrash_cache);
+  }
+
+  for(uint32_t run = 0; run < RUNS; run++) {
+    // Keep the voices in their sustain phase
+    if(run % 64 == 0) { play_chord(); }
+
+    if(mode == MODE_FLUSHED) {
+      xip_ctrl_hw->flush = 1;
+      (void)xip_ctrl_hw->flush; // blocks until the flush is complete
+    }
+
+    uint32_t status = save_and_disable_interrupts();
+    uint32_t start = systick_hw->cvr;
+    synth_render_format(buffer, BUFFER_FRAMES, SYNTH_FORMAT_STEREO16);
+    uint32_t cycles = (start - systick_hw->cvr) & 0xffffff; // 24-bit down counter
+    restore_interrupts(status);
+
+    total += cycles;
+    max = MAX(max, cycles);
+  }
+
+  if(mode == MODE_THRASHED) {
+    multicore_reset_core1();
+  }
+
+  uint32_t budget = (uint32_t)((uint64_t)clock_get_hz(clk_sys) * BUFFER_FRAMES / SAMPLE_RATE);
+  printf("%-8s avg %7lu max %7lu cycles per %u frames, worst case %lu.%lu%% of the budget\n",
+         mode_names[mode], (unsigned long)(total / RUNS), (unsigned long)max, BUFFER_FRAMES,
+         (unsigned long)(max * 100 / budget), (unsigned long)(max * 1000 / budget % 10));
+}
+
+int main() {
+  stdio_init_all();
+  AudioChannel * voices = synth_init(NUM_VOICES, SAMPLE_RATE);
+  DrumVoice * drums = drums_init(NUM_DRUMS);
+
+  static const uint8_t waveforms[4] = { SINE, TRIANGLE | SQUARE, SAW, SQUARE | NOISE };
+  for(uint8_t i = 0; i < NUM_VOICES; i++) {
+    voices[i].waveforms   = waveforms[i % 4];
+    voices[i].attack_ms   = 10;
+    voices[i].decay_ms    = 100;
+    voices[i].sustain     = 0x8000;
+    voices[i].release_ms  = 200;
+    voices[i].volume      = 4000;
+    voices[i].sends[SEND_DELAY]  = 0x4000;
+    voices[i].sends[SEND_REVERB] = 0x4000;
+  }
+
+  drum_init(&drums[0], DRUM_KICK);
+  drum_init(&drums[1], DRUM_SNARE);
+  drum_init(&drums[2], DRUM_OPEN_HAT);
+  drum_init(&drums[3], DRUM_CLAP);
+
+  effects_init_delay(delay_buffer, sizeof(delay_buffer), EFFECTS_8BIT);
+  effects_init_reverb(reverb_buffer, sizeof(reverb_buffer), EFFECTS_COMPANDED);
+
+  // SysTick counts down from 2^24 at the system clock
+  systick_hw->rvr = 0xffffff;
+  systick_hw->csr = 0x5;
+
+  while (true) {
+    sleep_ms(5000); // time to open the USB serial port
+    printf("render path in %s, %lu Hz system clock, %u voices, %u drums\n",
+           SYNTH_IN_RAM ? "SRAM" : "flash", (unsigned long)clock_get_hz(clk_sys),
+           NUM_VOICES, NUM_DRUMS);
+    for(uint8_t mode = 0; mode < MODE_COUNT; mode++) {
+      run(mode);
+    }
+  }
+
+  return 0;
+}
@@ -13,6 +13,7 @@
 **/
 
 #include "pico/stdlib.h"
+#include "hardware/sync.h"
 #include <synth_sequencer.h>
 
 #define SAMPLE_RATE 22050
@@ -31,28 +32,38 @@
     .pin_scl         = I2S_CLOCK_PIN_BASE,
     .pin_ws          = I2S_CLOCK_PIN_BASE + 1,
     .sample_rate     = SAMPLE_RATE,
-    .bits_per_sample = 16,
+    .bits_per_sample = 16, // 8, 16, 24 or 32
     .pio_num         = 0, // 0 for pio0, 1 for pio1
   };
 
 #endif
 
-#define NUM_VOICES  5
+#define NUM_VOICES  3
+#define NUM_DRUMS   2
+#define NUM_TRACKS  (NUM_VOICES + NUM_DRUMS)
 #define NUM_NOTES 128
-#define KICK      500
-#define HH      20000
+#define HIT         1 // Drum tracks only need a positive note
+
+// The arp plays the chords of the progression, one per two bars: up
+// through the notes of the chord, an eighth note each, gated at half.
+// The chords are intervals from the root note of the step.
+const SequencerChord chords[] = {
+  { 4, { 0, 4, 7, 12 } }, // Bb:  Bb D F Bb
+  { 4, { 0, 3, 7, 10 } }, // Gm7: G Bb D F
+  { 4, { 0, 3, 5, 12 } }, // on A: A C D A
+  { 4, { 0, 3, 5, 7 } },  // on G: G Bb C D
+};
 
-const int16_t notes[NUM_VOICES][NUM_NOTES] = {
-  { // Arp
-    AS3, -1,  D4, -1,  F4, -1, AS4, -1, AS3, -1,  D4, -1,  F4, -1, AS4, -1,
-    AS3, -1,  D4, -1,  F4, -1, AS4, -1, AS3, -1,  D4, -1,  F4, -1, AS4, -1,
-     G3, -1, AS3, -1,  D4, -1,  F4, -1,  G3, -1, AS3, -1,  D4, -1,  F4, -1,
-     G3, -1, AS3, -1,  D4, -1,  F4, -1,  G3, -1, AS3, -1,  D4, -1,  F4, -1,
-     A3, -1,  C4, -1,  D4, -1,  A4, -1,  A3, -1,  C4, -1,  D4, -1,  A4, -1,
-     A3, -1,  C4, -1,  D4, -1,  A4, -1,  A3, -1,  C4, -1,  D4, -1,  A4, -1,
-     G3, -1, AS3, -1,  C4, -1,  D4, -1,  G3, -1, AS3, -1,  C4, -1,  D4, -1,
-     G3, -1, AS3, -1,  C4, -1,  D4, -1,  G3, -1, AS3, -1,  C4, -1,  D4, -1,
-  },
+const SequencerArp arp = {
+  .mode = SEQUENCER_ARP_UP, .ticks = 12, .gate = 50,
+  .chords = chords, .chord_count = count_of(chords),
+};
+
+const SequencerStep arp_steps[] = {
+  { AS3 }, { G3, .chord = 1 }, { A3, .chord = 2 }, { G3, .chord = 3 },
+};
+
+const int16_t notes[NUM_VOICES - 1][NUM_NOTES] = {
   { // Pad
      F3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
       0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 
@@ -73,31 +84,38 @@ const int16_t notes[NUM_VOICES][NUM_NOTES] = {
      G2, 0, -1, 0,  G3, 0, -1,  G2, 0,  G2, 0,  G2,  G3, 0, -1, 0,
      G2, 0, -1, 0,  G3, 0, -1,  G2, 0,  G2, 0,  G2,  G3, 0, -1, 0,
   },
-  { // Kick drum
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
-    KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0, KICK, -1, 0, 0,
+};
+
+// Voice presets, kept in flash
+const SynthPreset presets[NUM_VOICES] = {
+  { // Arp
+    .waveforms = TRIANGLE | SQUARE, .attack_ms = 16, .decay_ms = 168,
+    .sustain = 0xafff, .release_ms = 168, .volume = 10000,
   },
-  { // Hi-hat
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
-    0, 0, HH, -1, 0, 0, HH, -1, 0, 0, HH, -1, HH, 0, HH, -1,
+  { // Pad
+    .waveforms = SINE | SQUARE, .attack_ms = 56, .decay_ms = 2000,
+    .sustain = 0, .release_ms = 0x8080, .volume = 10000,
+  },
+  { // Bass
+    .waveforms = SQUARE, .attack_ms = 10, .decay_ms = 100,
+    .sustain = 0, .release_ms = 500, .volume = 12000,
   },
 };
 
+// Drums use their own, shorter tracks
+const int16_t kick[] = { HIT, 0, 0, 0 };
+
+// Hi-hat steps carry velocity (accents and ghost notes).
+// The ghost note on step 13 only plays half of the time.
+const SequencerStep hihat[] = {
+  { 0 }, { 0 }, { HIT, 127 }, { 0 }, { 0 }, { 0 }, { HIT, 80 }, { 0 },
+  { 0 }, { 0 }, { HIT, 127 }, { 0 }, { HIT, 40, 0, 50 }, { 0 }, { HIT, 90 }, { 0 },
+};
+
 int main() {
   stdio_init_all();
   AudioChannel * voices = synth_init(NUM_VOICES, SAMPLE_RATE);
+  DrumVoice * drums = drums_init(NUM_DRUMS);
 
   #if USE_AUDIO_PWM
     sound_pwm_init(PWM_AUDIO_PIN, SAMPLE_RATE);
@@ -106,53 +124,51 @@ int main() {
   #endif
 
   // Initialize voices
-  sequencer_init(NUM_VOICES, (const int16_t *)notes, NUM_NOTES);
+  sequencer_init(NUM_TRACKS, NULL, NUM_NOTES);
+  sequencer_set_track_steps(0, arp_steps, count_of(arp_steps), 32);
+  sequencer_set_track_arp(0, &arp);
+  sequencer_set_track_notes(1, notes[0], NUM_NOTES, 1);
+  sequencer_set_track_notes(2, notes[1], NUM_NOTES, 1);
+  sequencer_set_track_notes(3, kick, count_of(kick), 1);
+  sequencer_set_track_steps(4, hihat, count_of(hihat), 1);
+  sequencer_set_track_drum(3, 0);
+  sequencer_set_track_drum(4, 1);
 
   // Configure voices
-  // Arp
-  voices[0].waveforms   = TRIANGLE | SQUARE;
-  voices[0].attack_ms   = 16;
-  voices[0].decay_ms    = 168;
-  voices[0].sustain     = 0xafff;
-  voices[0].release_ms  = 168;
-  voices[0].volume      = 10000;
-
-  // Pad
-  voices[1].waveforms   = SINE | SQUARE;
-  voices[1].attack_ms   = 56;
-  voices[1].decay_ms    = 2000;
-  voices[1].sustain     = 0;
-  voices[1].release_ms  = 0x8080;
-  voices[1].volume      = 10000;
-
-  // Bass
-  voices[2].waveforms   = SQUARE;
-  voices[2].attack_ms   = 10;
-  voices[2].decay_ms    = 100;
-  voices[2].sustain     = 0;
-  voices[2].release_ms  = 500;
-  voices[2].volume      = 12000;
-
-  // Kick drum
-  voices[3].waveforms   = NOISE;
-  voices[3].attack_ms   = 5;
-  voices[3].decay_ms    = 10;
-  voices[3].sustain     = 16000;
-  voices[3].release_ms  = 100;
-  voices[3].volume      = 18000; // NOISE waveform is very loud
-                                 // when using PWM, try lowering
-                                 // the volume if it's too noisy
-  // Hi-hat
-  voices[4].waveforms   = NOISE;
-  voices[4].attack_ms   = 5;
-  voices[4].decay_ms    = 100;
-  voices[4].sustain     = 50;
-  voices[4].release_ms  = 40;
-  voices[4].volume      = 10000;
+  for(uint8_t i = 0; i < NUM_VOICES; i++) {
+    synth_apply_preset(&voices[i], &presets[i]);
+  }
+
+  // Presets can also be switched while playing, at a given frame:
+  // synth_set_presets(presets, count_of(presets));
+  // SynthEvent change = { .frame = synth_get_frame(), .type = EVENT_PRESET, .channel = 2, .value = 0 };
+  // synth_queue_event(&change);
+
+  // Drums don't use any synth voice
+  drum_init(&drums[0], DRUM_KICK);
+  drums[0].volume       = 30000;
+
+  drum_init(&drums[1], DRUM_CLOSED_HAT);
+  drums[1].volume       = 12000;
 
   // Change the playback speed:
   // sequencer_set_tempo(128); // Default is 120bpm
 
+  // Add some swing:
+  // static SequencerGroove swing;
+  // sequencer_groove_swing(&swing, 58); // 50 is straight, 66 is triplet feel
+  // sequencer_set_groove(&swing);
+
+  // Send the arp to a dotted eighth delay that follows the tempo,
+  // and the pad to a small reverb. The buffers set the RAM they use.
+  // static uint8_t delay_buffer[12000];
+  // static uint8_t reverb_buffer[6000];
+  // effects_init_delay(delay_buffer, sizeof(delay_buffer), EFFECTS_8BIT);
+  // effects_set_delay_steps(3);
+  // effects_init_reverb(reverb_buffer, sizeof(reverb_buffer), EFFECTS_COMPANDED);
+  // voices[0].sends[SEND_DELAY]  = 0x6000; // or .sends in the presets
+  // voices[1].sends[SEND_REVERB] = 0x8000;
+
   // Change the overall volume (I2S output only):
   set_volume(50); // 0-100, default 100
 
@@ -161,16 +177,38 @@ int main() {
   sequencer_start(true);
 
   // You can stop the sequencer with:
-  // sequencer_stop();
+  // sequencer_stop(); // the notes playing are released, not cut
+
+  // or pause it and resume from the same step:
+  // sequencer_pause();
+  // sequencer_resume();
+
+  // Switch the bass to another pattern at the next bar:
+  // sequencer_queue_track_notes(1, (const int16_t *)other_bass, 16, 1);
 
   // You can also set a callback to execute when the sequence
   // is complete:
   // sequencer_set_callback(your_callback_function);
 
+  // With SYNTH_TELEMETRY=1, print the render load over USB every second:
+  // telemetry_stream(1000);
+
+  // Or, with SYNTH_TAP=1, stream the output itself over USB as raw
+  // 16-bit PCM, to record it on the computer:
+  // static int16_t tap_buffer[8192];
+  // tap_start(tap_buffer, count_of(tap_buffer));
+  // tap_set_sink(tap_sink_stdio, NULL);
+  // stdio_set_translate_crlf(&stdio_usb, false); // from pico/stdio_usb.h
+
   while (true) {
     // Nothing to do here, as all processing and
-    // audio generation is asyncronous
-    tight_loop_contents();
+    // audio generation is asyncronous. The core sleeps
+    // until the next interrupt: the audio buffers and the
+    // sequencer timer wake it up while playing, and nothing
+    // does once the sequencer is stopped and silent.
+    telemetry_task();
+    tap_task();
+    __wfi();
   }
 
   return 0;
@@ -0,0 +1,413 @@
+/**
+ * @file clock_sync.c
+ * @brief Implementation of the clock sync module.
+ *
+ * The external clock is followed by a second order PLL: the pulse
+ * period is smoothed to estimate the tempo, and the phase error between
+ * the pulses and the sequencer position is fed back into the tempo
+ * applied to the sequencer, so the sequencer never drifts away.
+ *
+ * The phase is measured on the sequencer itself: the synth frame at
+ * which a pulse arrives against the frame the sequencer plays the tick
+ * of that pulse at. The frames the sequencer loses re-anchoring its
+ * tempo, and a sample rate off from the system clock, show up in that
+ * error and are corrected with the rest.
+ */
+
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "clock_sync.h"
+#include "sequencer.h"
+#include "synth.h"
+
+/**
+ * @brief Smoothing of the pulse period estimate (1/16 of the error per pulse).
+ */
+#define PERIOD_SHIFT 4
+
+/**
+ * @brief Fraction of the phase error corrected on every pulse (1/8).
+ */
+#define PHASE_SHIFT 3
+
+/**
+ * @brief Fraction of the phase error accumulated into the tempo on every
+ * pulse (1/256), which takes up a constant rate offset between the clocks.
+ */
+#define TRIM_SHIFT 8
+
+/**
+ * @brief Smoothing of the jitter measurement.
+ */
+#define JITTER_SHIFT 3
+
+/**
+ * @brief Number of missing pulses after which the external clock is considered stopped.
+ */
+#define TIMEOUT_PULSES 4
+
+/**
+ * @brief Number of synth frame reads the audio clock is corrected over.
+ */
+#define AUDIO_READS 16
+
+extern Sequencer sequencer;
+
+/**
+ * @brief The clock driving the sequencer.
+ */
+static uint8_t clock_source = CLOCK_INTERNAL;
+
+/**
+ * @brief Received pulse times, consumed by clock_sync_task().
+ */
+static volatile uint64_t pulse_queue[CLOCK_SYNC_QUEUE_SIZE];
+static volatile uint8_t pulse_head = 0;
+static volatile uint8_t pulse_tail = 0;
+
+/**
+ * @brief PLL state. Periods are in microseconds (Q8), positions in ticks (Q8).
+ */
+static uint32_t pulse_count;
+static uint64_t last_pulse_us;
+static uint32_t period_q8;     // filtered period of the external clock
+static uint32_t applied_q8;    // tick period applied to the sequencer
+static int32_t  trim_q8;       // accumulated phase correction
+static int64_t  ref_ticks_q8;  // sequencer position at the first pulse
+static int32_t  drift_us;
+static uint32_t jitter_q4;
+static bool     locked;
+
+/**
+ * @brief The audio clock: the synth frame rendered at audio_us.
+ *
+ * The synth frame moves a buffer at a time, so read at any other time
+ * it lags behind. The clock follows the earliest frames seen: it moves
+ * up to a frame ahead of it at once, and down to the earliest of every
+ * AUDIO_READS reads, so it follows a sample rate off from the system
+ * clock either way.
+ */
+static uint64_t audio_us;
+static uint32_t audio_frame;
+static int32_t  audio_peak;    // earliest frame of the reads, from the clock
+static uint8_t  audio_reads;
+static bool     audio_valid;
+
+/**
+ * @brief Clock output state.
+ */
+static uint8_t output_pin = CLOCK_SYNC_NO_PIN;
+static alarm_id_t output_alarm = 0;
+static bool output_high = false;
+static uint32_t output_frac_q8 = 0;
+static uint32_t output_low_us = 0;
+
+/**
+ * @brief The callback function for the clock output.
+ */
+static void noop(void) { ; }
+static void (*output_callback)(void) = noop;
+
+/**
+ * @brief Gets the tick period of the sequencer tempo.
+ *
+ * @return The tick period in microseconds (Q8).
+ */
+static uint32_t sequencer_tick_us_q8() {
+  return (uint32_t)((uint64_t)sequencer.step_frames_q8 * 1000000 /
+                    ((uint64_t)get_sample_rate() * SEQUENCER_TICKS_PER_STEP));
+}
+
+/**
+ * @brief Gets the synth frame at a time, from the audio clock.
+ *
+ * @param time_us The time, at most a few seconds from the last read.
+ *
+ * @return The frame.
+ */
+static uint32_t audio_frame_at(uint64_t time_us) {
+  int64_t elapsed_us = (int64_t)(time_us - audio_us);
+  return audio_frame + (uint32_t)(elapsed_us * (int64_t)get_sample_rate() / 1000000);
+}
+
+/**
+ * @brief Reads the synth frame into the audio clock.
+ *
+ * @param now_us The current time.
+ */
+static void update_audio_clock(uint64_t now_us) {
+  uint32_t frame = synth_get_frame();
+  int32_t ahead = (int32_t)(frame - audio_frame_at(now_us));
+  if(!audio_valid || ahead > 0 || ahead < -(int32_t)get_sample_rate()) {
+    audio_us = now_us;
+    audio_frame = frame;
+    audio_valid = true;
+    audio_peak = INT32_MIN;
+    audio_reads = 0;
+    return;
+  }
+  audio_peak = MAX(audio_peak, ahead);
+  if(++audio_reads == AUDIO_READS) {
+    audio_frame += audio_peak;
+    audio_peak = INT32_MIN;
+    audio_reads = 0;
+  }
+}
+
+/**
+ * @brief Gets the sequencer position at a synth frame.
+ *
+ * Counted from the frame and step the sequencer last anchored its tempo
+ * on, so it is where the sequencer actually plays, rounding included.
+ *
+ * @param frame The synth frame.
+ *
+ * @return The position in ticks since the sequencer was started (Q8).
+ */
+static int64_t sequencer_ticks_q8(uint32_t frame) {
+  int32_t frames = (int32_t)(frame - sequencer.start_frame);
+  return (int64_t)sequencer.start_step * SEQUENCER_TICKS_PER_STEP * 256 +
+         (int64_t)frames * SEQUENCER_TICKS_PER_STEP * 65536 / sequencer.step_frames_q8;
+}
+
+/**
+ * @brief Gets the frame at which the sequencer plays a position.
+ *
+ * @param ticks_q8 The position in ticks since the sequencer was started (Q8).
+ *
+ * @return The frame, from the frame the sequencer anchored its tempo on (Q8).
+ */
+static int64_t sequencer_frame_q8(int64_t ticks_q8) {
+  int64_t ticks = ticks_q8 - (int64_t)sequencer.start_step * SEQUENCER_TICKS_PER_STEP * 256;
+  return ticks * sequencer.step_frames_q8 / (SEQUENCER_TICKS_PER_STEP * 256);
+}
+
+/**
+ * @brief GPIO interrupt handler for the clock input.
+ */
+static void gpio_callback(uint gpio, uint32_t events) {
+  clock_sync_pulse(time_us_64());
+}
+
+/**
+ * @brief Initializes the clock sync module.
+ *
+ * @param in_pin The GPIO receiving clock pulses, or CLOCK_SYNC_NO_PIN.
+ * @param out_pin The GPIO emitting clock pulses, or CLOCK_SYNC_NO_PIN.
+ */
+void clock_sync_init(uint8_t in_pin, uint8_t out_pin) {
+  if(in_pin != CLOCK_SYNC_NO_PIN) {
+    gpio_init(in_pin);
+    gpio_set_dir(in_pin, GPIO_IN);
+    gpio_set_irq_enabled_with_callback(in_pin, GPIO_IRQ_EDGE_RISE, true, &gpio_callback);
+  }
+  output_pin = out_pin;
+  if(output_pin != CLOCK_SYNC_NO_PIN) {
+    gpio_init(output_pin);
+    gpio_set_dir(output_pin, GPIO_OUT);
+    gpio_put(output_pin, 0);
+  }
+  clock_sync_reset();
+}
+
+/**
+ * @brief Selects the clock driving the sequencer.
+ *
+ * @param source The clock source.
+ */
+void clock_sync_set_source(enum ClockSource source) {
+  clock_source = source;
+  clock_sync_reset();
+}
+
+/**
+ * @brief Feeds an external clock pulse.
+ *
+ * @param time_us The time the pulse was received at.
+ */
+void clock_sync_pulse(uint64_t time_us) {
+  uint8_t next_tail = (pulse_tail + 1) & (CLOCK_SYNC_QUEUE_SIZE - 1);
+  if(next_tail == pulse_head) { return; } // Queue full, the pulse is lost
+  pulse_queue[pulse_tail] = time_us;
+  pulse_tail = next_tail;
+}
+
+/**
+ * @brief Restarts the measurements, the next pulse is the first beat.
+ */
+void clock_sync_reset() {
+  uint32_t status = save_and_disable_interrupts();
+  pulse_head = pulse_tail;
+  restore_interrupts(status);
+
+  pulse_count = 0;
+  period_q8 = sequencer_tick_us_q8();
+  applied_q8 = period_q8;
+  trim_q8 = 0;
+  audio_valid = false;
+  drift_us = 0;
+  jitter_q4 = 0;
+  locked = false;
+}
+
+/**
+ * @brief Runs the PLL on a received pulse.
+ *
+ * @param time_us The time the pulse was received at.
+ */
+static void process_pulse(uint64_t time_us) {
+  uint32_t frame = audio_frame_at(time_us);
+  if(pulse_count == 0) {
+    // The first pulse is the reference of both clocks
+    ref_ticks_q8 = sequencer_ticks_q8(frame);
+    last_pulse_us = time_us;
+    pulse_count = 1;
+    return;
+  }
+
+  if(time_us - last_pulse_us > 0xffffff) {
+    // The clock stopped for a long time, start over
+    pulse_count = 0;
+    process_pulse(time_us);
+    return;
+  }
+
+  // Period estimate, ignoring the jitter of single pulses. A pulse far
+  // from the expected time is a tempo change, which is followed at once.
+  uint32_t interval = (uint32_t)(time_us - last_pulse_us);
+  uint32_t period = period_q8 >> 8;
+  last_pulse_us = time_us;
+  if(pulse_count == 1 || interval > 2 * period || 2 * interval < period) {
+    period_q8 = interval << 8;
+    applied_q8 = period_q8;
+    jitter_q4 = 0;
+  } else {
+    period_q8 += ((int32_t)(interval << 8) - (int32_t)period_q8) >> PERIOD_SHIFT;
+    int32_t deviation = abs((int32_t)interval - (int32_t)period);
+    jitter_q4 += ((int32_t)(deviation << 4) - (int32_t)jitter_q4) >> JITTER_SHIFT;
+  }
+
+  // Phase detector: the frame the sequencer plays the tick of this pulse
+  // at, against the frame the pulse arrived at. A stopped sequencer is
+  // in phase, it starts over from the next pulse.
+  int64_t tick_q8 = ref_ticks_q8 + ((int64_t)pulse_count << 8);
+  if(!sequencer.playing) {
+    ref_ticks_q8 += sequencer_ticks_q8(frame) - tick_q8;
+    tick_q8 = sequencer_ticks_q8(frame);
+  }
+  int64_t pulse_frame_q8 = (int64_t)(int32_t)(frame - sequencer.start_frame) << 8;
+  int64_t error_q8 = sequencer_frame_q8(tick_q8) - pulse_frame_q8;
+  error_q8 = MIN(MAX(error_q8, -((int64_t)INT32_MAX >> 8)), (int64_t)INT32_MAX >> 8);
+  drift_us = (int32_t)(error_q8 * 1000000 / ((int64_t)get_sample_rate() << 8));
+  pulse_count++;
+
+  // Loop filter: follow the tempo estimate, catch up with a fraction of
+  // the phase error over the next tick, and keep the rest of a constant
+  // error in the trim
+  int64_t max_correction_q8 = period_q8 >> 3;
+  trim_q8 += ((int64_t)drift_us * 256) >> TRIM_SHIFT;
+  trim_q8 = MIN(MAX(trim_q8, -max_correction_q8), max_correction_q8);
+  int64_t correction_q8 = (((int64_t)drift_us * 256) >> PHASE_SHIFT) + trim_q8;
+  correction_q8 = MIN(MAX(correction_q8, -max_correction_q8), max_correction_q8);
+  applied_q8 = period_q8 - correction_q8;
+
+  locked = pulse_count > CLOCK_SYNC_PPQN && (uint32_t)abs(drift_us) < (period_q8 >> 10);
+
+  sequencer_set_step_frames((uint32_t)((uint64_t)applied_q8 * SEQUENCER_TICKS_PER_STEP *
+                                       get_sample_rate() / 1000000));
+}
+
+/**
+ * @brief Processes the received pulses and updates the sequencer tempo.
+ *
+ * Called by the sequencer before scheduling steps.
+ */
+void clock_sync_task() {
+  uint64_t now_us = time_us_64();
+  update_audio_clock(now_us);
+  while(pulse_head != pulse_tail) {
+    uint64_t time_us = pulse_queue[pulse_head];
+    pulse_head = (pulse_head + 1) & (CLOCK_SYNC_QUEUE_SIZE - 1);
+    if(clock_source == CLOCK_EXTERNAL) {
+      process_pulse(time_us);
+    }
+  }
+
+  // When the external clock stops, the sequencer keeps the last tempo
+  if(clock_source == CLOCK_EXTERNAL && pulse_count > 0 &&
+     now_us - last_pulse_us > (uint64_t)TIMEOUT_PULSES * (period_q8 >> 8)) {
+    locked = false;
+  }
+}
+
+/**
+ * @brief Alarm callback generating the clock output.
+ *
+ * @return The time until the next edge, from the time this edge was scheduled.
+ */
+static int64_t output_alarm_callback(alarm_id_t id, void *user_data) {
+  if(output_high) {
+    if(output_pin != CLOCK_SYNC_NO_PIN) { gpio_put(output_pin, 0); }
+    output_high = false;
+    return output_low_us;
+  }
+
+  // The fraction of the period is carried over, so the output
+  // does not drift from the sequencer
+  output_frac_q8 += (clock_source == CLOCK_EXTERNAL) ? applied_q8 : sequencer_tick_us_q8();
+  uint32_t period_us = output_frac_q8 >> 8;
+  output_frac_q8 &= 0xff;
+  uint32_t pulse_us = MIN(CLOCK_SYNC_PULSE_US, period_us / 2);
+  output_low_us = period_us - pulse_us;
+
+  if(output_pin != CLOCK_SYNC_NO_PIN) { gpio_put(output_pin, 1); }
+  output_high = true;
+  output_callback();
+  return pulse_us;
+}
+
+/**
+ * @brief Starts emitting clock pulses.
+ *
+ * @param delay_us Delay of the first pulse, to align it with the audio output.
+ */
+void clock_sync_output_start(uint32_t delay_us) {
+  clock_sync_output_stop();
+  output_frac_q8 = 0;
+  output_alarm = add_alarm_in_us(MAX(delay_us, 1), output_alarm_callback, NULL, true);
+}
+
+/**
+ * @brief Stops emitting clock pulses.
+ */
+void clock_sync_output_stop() {
+  if(output_alarm > 0) {
+    cancel_alarm(output_alarm);
+    output_alarm = 0;
+  }
+  output_high = false;
+  if(output_pin != CLOCK_SYNC_NO_PIN) { gpio_put(output_pin, 0); }
+}
+
+/**
+ * @brief Sets the function called on every output pulse, e.g. to send MIDI clock.
+ *
+ * @param callback The callback function.
+ */
+void clock_sync_set_output_callback(void (*callback)(void)) {
+  output_callback = callback ? callback : noop;
+}
+
+/**
+ * @brief Gets the measurements of the external clock.
+ *
+ * @param stats The structure to fill.
+ */
+void clock_sync_get_stats(ClockSyncStats *stats) {
+  stats->pulses = pulse_count;
+  stats->period_us = period_q8 >> 8;
+  stats->bpm_x100 = period_q8 ? (uint32_t)(60000000ull * 100 * 256 / ((uint64_t)period_q8 * CLOCK_SYNC_PPQN)) : 0;
+  stats->drift_us = drift_us;
+  stats->jitter_us = jitter_q4 >> 4;
+  stats->locked = locked;
+}
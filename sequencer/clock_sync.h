@@ -0,0 +1,149 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+/**
+ * @file clock_sync.h
+ * @brief Header file for the clock sync module.
+ *
+ * Follows an external clock (analog pulses or MIDI clock, 24 pulses per
+ * quarter note) with a PLL that filters the pulse jitter and drives the
+ * sequencer tempo, and emits a 24 PPQN clock from the sequencer.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of clock pulses per quarter note.
+ */
+#define CLOCK_SYNC_PPQN 24
+
+/**
+ * @brief Value used to leave a clock pin unassigned.
+ */
+#define CLOCK_SYNC_NO_PIN 0xff
+
+/**
+ * @brief Number of pulses that can be buffered between two sequencer tasks.
+ */
+#define CLOCK_SYNC_QUEUE_SIZE 16 // Must be a power of two
+
+/**
+ * @brief Length of the pulses on the clock output, in microseconds.
+ */
+#define CLOCK_SYNC_PULSE_US 2000
+
+/**
+ * @enum ClockSource
+ * @brief The clock driving the sequencer.
+ */
+enum ClockSource {
+  CLOCK_INTERNAL,
+  CLOCK_EXTERNAL
+};
+
+/**
+ * @struct ClockSyncStats
+ * @brief Measurements of the external clock.
+ */
+typedef struct ClockSyncStats {
+  /**
+   * @brief The number of pulses received since the last reset.
+   */
+  uint32_t pulses;
+
+  /**
+   * @brief The estimated tempo in hundredths of beats per minute.
+   */
+  uint32_t bpm_x100;
+
+  /**
+   * @brief The filtered pulse period in microseconds.
+   */
+  uint32_t period_us;
+
+  /**
+   * @brief How far the sequencer is behind the external clock, in microseconds.
+   */
+  int32_t drift_us;
+
+  /**
+   * @brief The average deviation of the pulse period, in microseconds.
+   */
+  uint32_t jitter_us;
+
+  /**
+   * @brief Flag indicating whether the sequencer is locked to the external clock.
+   */
+  bool locked;
+} ClockSyncStats;
+
+/**
+ * @brief Initializes the clock sync module.
+ *
+ * @param in_pin The GPIO receiving clock pulses, or CLOCK_SYNC_NO_PIN.
+ * @param out_pin The GPIO emitting clock pulses, or CLOCK_SYNC_NO_PIN.
+ */
+void clock_sync_init(uint8_t in_pin, uint8_t out_pin);
+
+/**
+ * @brief Selects the clock driving the sequencer.
+ *
+ * @param source The clock source.
+ */
+void clock_sync_set_source(enum ClockSource source);
+
+/**
+ * @brief Feeds an external clock pulse.
+ *
+ * Called by the GPIO interrupt, and can be called from a MIDI clock
+ * (0xF8) handler or a test stub. Safe to call from interrupts.
+ *
+ * @param time_us The time the pulse was received at.
+ */
+void clock_sync_pulse(uint64_t time_us);
+
+/**
+ * @brief Restarts the measurements, the next pulse is the first beat.
+ */
+void clock_sync_reset();
+
+/**
+ * @brief Processes the received pulses and updates the sequencer tempo.
+ */
+void clock_sync_task();
+
+/**
+ * @brief Starts emitting clock pulses.
+ *
+ * @param delay_us Delay of the first pulse, to align it with the audio output.
+ */
+void clock_sync_output_start(uint32_t delay_us);
+
+/**
+ * @brief Stops emitting clock pulses.
+ */
+void clock_sync_output_stop();
+
+/**
+ * @brief Sets the function called on every output pulse, e.g. to send MIDI clock.
+ *
+ * @param callback The callback function.
+ */
+void clock_sync_set_output_callback(void (*callback)(void));
+
+/**
+ * @brief Gets the measurements of the external clock.
+ *
+ * @param stats The structure to fill.
+ */
+void clock_sync_get_stats(ClockSyncStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
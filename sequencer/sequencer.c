@@ -3,10 +3,16 @@
  * @brief Implementation of the sequencer module.
  */
 
+#include <assert.h>
+#include <string.h>
 #include "pico/stdlib.h"
 #include "sequencer.h"
 #include "synth.h"
 #include "pitches.h"
+#include "clock_sync.h"
+#include "effects.h"
+#include "dynamics.h"
+#include "telemetry.h"
 #if USE_AUDIO_PWM
   #include "sound_pwm.h"
 #elif USE_AUDIO_I2S
@@ -14,121 +20,1307 @@
 #endif
 
 /**
- * @brief The sequencer object.
+ * @brief The default sequencer, playing the default synth instance.
  */
 Sequencer sequencer;
 
 /**
- * @brief The repeating timer object for the sequencer.
+ * @brief The callback function for the sequencer.
  */
-repeating_timer_t sequencer_timer;
+static void noop(void *user_data) { ; }
 
 /**
- * @brief The callback function for the sequencer.
+ * @brief Gets the default sequencer.
+ *
+ * @return The sequencer used by the functions without a Sequencer parameter.
  */
-static void noop(void *user_data) { ; }
+Sequencer * sequencer_get_default() {
+  return &sequencer;
+}
 
 /**
- * @brief The notes to be played by the sequencer.
+ * @brief Initializes a sequencer playing a synth instance.
+ *
+ * The default sequencer drives the audio output; other sequencers are
+ * advanced with sequencer_task_ctx() by the code rendering their synth.
+ *
+ * @param seq The sequencer.
+ * @param synth The synth instance to play.
+ * @param _num_voices The number of voices to initialize.
+ * @param notes The notes to be played by the sequencer.
+ * @param length The length of the track in beats.
  */
-int16_t * _notes;
+void sequencer_init_ctx(Sequencer *seq, Synth *synth, uint8_t _num_voices, const int16_t *notes, uint16_t length) {
+  if(seq != &sequencer) {
+    memset(seq, 0, sizeof(*seq));
+  }
+  seq->output = (seq == &sequencer);
+  seq->synth = synth;
+  seq->track_length = length;
+  seq->callback = noop;
+  seq->num_voices = _num_voices;
+  if(seq->prng_state == 0) { seq->prng_state = 0x9E3779B9; }
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    SequencerTrack *track = &seq->tracks[i];
+    track->notes = notes ? notes + i * length : NULL;
+    track->steps = NULL;
+    track->length = length;
+    track->divider = 1;
+    track->groove = NULL;
+    track->drum = SEQUENCER_NO_DRUM;
+    track->sampler = SEQUENCER_NO_SAMPLER;
+    track->pending = false;
+    track->arp = NULL;
+    track->arp_active = false;
+  }
+  sequencer_set_tempo_ctx(seq, 120);
+}
 
 /**
- * @brief The number of voices in the sequencer.
+ * @brief Initializes the sequencer module.
+ *
+ * @param _num_voices The number of voices to initialize.
+ * @param notes The notes to be played by the sequencer.
+ * @param length The length of the track in beats.
  */
-uint8_t num_voices;
+void sequencer_init(uint8_t _num_voices, const int16_t *notes, uint16_t length) {
+  sequencer_init_ctx(&sequencer, synth_get_default(), _num_voices, notes, length);
+}
 
 /**
- * @brief The beat duration in milliseconds.
+ * @brief Initializes a sequencer playing a synth instance with a sequence of steps.
+ *
+ * @param seq The sequencer.
+ * @param synth The synth instance to play.
+ * @param _num_voices The number of voices to initialize.
+ * @param steps The steps to be played by the sequencer, one row of length steps per voice.
+ * @param length The length of the track in beats.
  */
-uint16_t beat_ms = 125; // 125ms beat = 120bpm
+void sequencer_init_steps_ctx(Sequencer *seq, Synth *synth, uint8_t _num_voices, const SequencerStep *steps, uint16_t length) {
+  sequencer_init_ctx(seq, synth, _num_voices, NULL, length);
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    seq->tracks[i].steps = steps + i * length;
+  }
+}
 
 /**
- * @brief Initializes the sequencer module.
+ * @brief Initializes the sequencer module with a sequence of steps.
  *
  * @param _num_voices The number of voices to initialize.
- * @param notes The notes to be played by the sequencer.
+ * @param steps The steps to be played by the sequencer, one row of length steps per voice.
  * @param length The length of the track in beats.
  */
-void sequencer_init(uint8_t _num_voices, const int16_t *notes, uint16_t length) {
-  sequencer.track_length = length;
-  sequencer.beat_ms = beat_ms;
-  sequencer.callback = noop;
-  sequencer_set_tempo(120);
-  num_voices = _num_voices;
-  _notes = (int16_t *)notes;
+void sequencer_init_steps(uint8_t _num_voices, const SequencerStep *steps, uint16_t length) {
+  sequencer_init_steps_ctx(&sequencer, synth_get_default(), _num_voices, steps, length);
 }
 
 /**
- * @brief Starts the sequencer.
+ * @brief Precomputes the step timings of a track.
  *
- * @param loop Flag indicating whether the sequencer should loop.
+ * The start of every step of a groove cycle is stored relative to the
+ * start of the cycle, so scheduling a step is a table lookup.
+ *
+ * @param seq The sequencer.
+ * @param track The track to compute the schedule of.
  */
-void sequencer_start(bool loop) {
-  sequencer.start_time = time_us_64();
-  sequencer.loop = loop;
-  sequencer.playing = true;
+static void build_schedule(const Sequencer *seq, SequencerTrack *track) {
+  uint64_t step_q8 = (uint64_t)seq->step_frames_q8 * track->divider;
+  uint8_t length = 1;
+  if(track->groove && track->groove->length) {
+    length = MIN(track->groove->length, SEQUENCER_GROOVE_MAX_STEPS);
+  }
+
+  for(uint8_t k = 0; k < length; k++) {
+    int8_t offset = track->groove ? track->groove->offsets[(k * track->divider) % length] : 0;
+    int64_t frame_q8 = (int64_t)(k * step_q8) + (int64_t)offset * seq->step_frames_q8 / 100;
+    track->groove_frames[k] = (int32_t)(frame_q8 >> 8);
+  }
+  track->groove_length = length;
+  track->cycle_frames_q8 = length * step_q8;
+  track->step_frames = (uint32_t)(step_q8 >> 8);
+}
+
+/**
+ * @brief Moves a track to its first step.
+ *
+ * @param track The track to reset.
+ * @param frame The frame of the first step, before the groove offset.
+ */
+static void reset_track(SequencerTrack *track, uint32_t frame) {
+  track->position = 0;
+  track->groove_pos = 0;
+  track->cycle = 0;
+  track->count = 0;
+  track->beat = 0;
+  track->arp_active = false;
+  track->anchor_frame = frame;
+  track->cycle_frame = frame;
+  track->next_frame = frame + track->groove_frames[0];
+}
+
+/**
+ * @brief Recomputes the schedule of a playing track.
+ *
+ * The next step keeps its timing, the new schedule applies from the
+ * step after it.
+ *
+ * @param seq The sequencer.
+ * @param track The track to retime.
+ */
+static void retime_track(const Sequencer *seq, SequencerTrack *track) {
+  build_schedule(seq, track);
+  if(track->groove_pos >= track->groove_length) { track->groove_pos = 0; }
+  if(track->position >= track->length) { track->position = 0; }
+  track->cycle = 0;
+  track->anchor_frame = track->next_frame - track->groove_frames[track->groove_pos];
+  track->cycle_frame = track->anchor_frame;
+  // The next arpeggio note keeps its timing as well
+  track->arp_origin = track->arp_next_frame;
+  track->arp_count = 0;
+}
+
+/**
+ * @brief Moves a track to its next step.
+ *
+ * @param track The track to advance.
+ */
+static void advance_track(SequencerTrack *track) {
+  if(++track->position >= track->length) { track->position = 0; }
+  if(++track->groove_pos == track->groove_length) {
+    track->groove_pos = 0;
+    track->cycle++;
+    track->cycle_frame = track->anchor_frame + (uint32_t)((track->cycle * track->cycle_frames_q8) >> 8);
+  }
+  track->next_frame = track->cycle_frame + track->groove_frames[track->groove_pos];
+  track->count++;
+  track->beat += track->divider;
+}
+
+/**
+ * @brief Applies a change to the configuration of a track.
+ *
+ * @param seq The sequencer.
+ * @param track The track that changed.
+ */
+static void update_track(const Sequencer *seq, SequencerTrack *track) {
+  if(track->divider == 0) { track->divider = 1; }
+  if(seq->playing) { retime_track(seq, track); }
+}
+
+/**
+ * @brief Sets the notes played by a track.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set, the voice it plays.
+ * @param notes The notes to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_set_track_notes_ctx(Sequencer *seq, uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider) {
+  if(track >= CHANNEL_COUNT) { return; }
+  seq->tracks[track].notes = notes;
+  seq->tracks[track].steps = NULL;
+  seq->tracks[track].length = length;
+  seq->tracks[track].divider = divider;
+  update_track(seq, &seq->tracks[track]);
+}
+
+/**
+ * @brief Sets the notes played by a track of the default sequencer.
+ */
+void sequencer_set_track_notes(uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider) {
+  sequencer_set_track_notes_ctx(&sequencer, track, notes, length, divider);
+}
+
+/**
+ * @brief Sets the steps played by a track.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set, the voice it plays.
+ * @param steps The steps to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_set_track_steps_ctx(Sequencer *seq, uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider) {
+  if(track >= CHANNEL_COUNT) { return; }
+  seq->tracks[track].notes = NULL;
+  seq->tracks[track].steps = steps;
+  seq->tracks[track].length = length;
+  seq->tracks[track].divider = divider;
+  update_track(seq, &seq->tracks[track]);
+}
+
+/**
+ * @brief Sets the steps played by a track of the default sequencer.
+ */
+void sequencer_set_track_steps(uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider) {
+  sequencer_set_track_steps_ctx(&sequencer, track, steps, length, divider);
+}
+
+/**
+ * @brief Replaces the notes or steps of a track by its queued pattern.
+ *
+ * The track plays the pattern from its first step.
+ *
+ * @param track The track to switch.
+ */
+static void take_pattern(SequencerTrack *track) {
+  track->notes = track->next_notes;
+  track->steps = track->next_steps;
+  track->length = track->next_length;
+  track->divider = track->next_divider ? track->next_divider : 1;
+  track->position = 0;
+  track->pending = false;
+}
+
+/**
+ * @brief Queues a pattern to replace the notes or steps of a track at the next bar.
+ *
+ * The timer callback of the default sequencer schedules its steps, so
+ * the pattern is written with interrupts disabled: the track never
+ * switches to a half-written one.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set.
+ * @param notes The notes of the pattern, used when steps is NULL.
+ * @param steps The steps of the pattern.
+ * @param length The length of the pattern in steps.
+ * @param divider The number of sequencer beats per step of the pattern.
+ */
+static void queue_track(Sequencer *seq, uint8_t track, const int16_t *notes, const SequencerStep *steps,
+                        uint16_t length, uint8_t divider) {
+  if(track >= CHANNEL_COUNT) { return; }
+  SequencerTrack *t = &seq->tracks[track];
+  uint32_t status = save_and_disable_interrupts();
+  t->next_notes = notes;
+  t->next_steps = steps;
+  t->next_length = length;
+  t->next_divider = divider;
+  if(seq->playing || seq->paused) {
+    // The first bar not scheduled yet: steps before the next step of
+    // the track are already queued to the synth
+    t->switch_beat = (t->beat + SEQUENCER_STEPS_PER_BAR - 1) / SEQUENCER_STEPS_PER_BAR * SEQUENCER_STEPS_PER_BAR;
+    t->pending = true;
+  } else {
+    take_pattern(t);
+  }
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Queues notes to replace those of a track at the next bar.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set, the voice it plays.
+ * @param notes The notes to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_queue_track_notes_ctx(Sequencer *seq, uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider) {
+  queue_track(seq, track, notes, NULL, length, divider);
+}
+
+/**
+ * @brief Queues notes to replace those of a track of the default sequencer at the next bar.
+ */
+void sequencer_queue_track_notes(uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider) {
+  sequencer_queue_track_notes_ctx(&sequencer, track, notes, length, divider);
+}
+
+/**
+ * @brief Queues steps to replace those of a track at the next bar.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set, the voice it plays.
+ * @param steps The steps to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_queue_track_steps_ctx(Sequencer *seq, uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider) {
+  queue_track(seq, track, NULL, steps, length, divider);
+}
+
+/**
+ * @brief Queues steps to replace those of a track of the default sequencer at the next bar.
+ */
+void sequencer_queue_track_steps(uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider) {
+  sequencer_queue_track_steps_ctx(&sequencer, track, steps, length, divider);
+}
+
+/**
+ * @brief Queues a pattern for all tracks at the next bar.
+ *
+ * Every track switches on the same bar, as long as their steps start
+ * on it.
+ *
+ * @param seq The sequencer.
+ * @param steps The steps to be played, one row of length steps per voice.
+ * @param length The length of the pattern in steps.
+ */
+void sequencer_queue_pattern_ctx(Sequencer *seq, const SequencerStep *steps, uint16_t length) {
+  uint32_t status = save_and_disable_interrupts();
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    queue_track(seq, i, NULL, steps + i * length, length, 1);
+  }
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Queues a pattern for all tracks of the default sequencer at the next bar.
+ */
+void sequencer_queue_pattern(const SequencerStep *steps, uint16_t length) {
+  sequencer_queue_pattern_ctx(&sequencer, steps, length);
+}
+
+/**
+ * @brief Makes a track play a drum voice instead of its synth voice.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set.
+ * @param drum The index of the drum voice, or SEQUENCER_NO_DRUM to play the synth voice.
+ */
+void sequencer_set_track_drum_ctx(Sequencer *seq, uint8_t track, uint8_t drum) {
+  if(track >= CHANNEL_COUNT) { return; }
+  seq->tracks[track].drum = drum;
+}
+
+/**
+ * @brief Makes a track of the default sequencer play a drum voice.
+ */
+void sequencer_set_track_drum(uint8_t track, uint8_t drum) {
+  sequencer_set_track_drum_ctx(&sequencer, track, drum);
+}
+
+/**
+ * @brief Makes a track play a sampler voice instead of its synth voice.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set.
+ * @param voice The index of the sampler voice, or SEQUENCER_NO_SAMPLER to play the synth voice.
+ */
+void sequencer_set_track_sampler_ctx(Sequencer *seq, uint8_t track, uint8_t voice) {
+  if(track >= CHANNEL_COUNT) { return; }
+  seq->tracks[track].sampler = voice;
+}
+
+/**
+ * @brief Makes a track of the default sequencer play a sampler voice.
+ */
+void sequencer_set_track_sampler(uint8_t track, uint8_t voice) {
+  sequencer_set_track_sampler_ctx(&sequencer, track, voice);
+}
+
+/**
+ * @brief Attaches an arpeggiator to a track.
+ *
+ * The arpeggio playing, if any, stops; the notes already queued are
+ * released by the next step of the track.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set.
+ * @param arp The arpeggiator settings, NULL to play the notes as they are.
+ */
+void sequencer_set_track_arp_ctx(Sequencer *seq, uint8_t track, const SequencerArp *arp) {
+  if(track >= CHANNEL_COUNT) { return; }
+  uint32_t status = save_and_disable_interrupts();
+  seq->tracks[track].arp = arp;
+  seq->tracks[track].arp_active = false;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Attaches an arpeggiator to a track of the default sequencer.
+ */
+void sequencer_set_track_arp(uint8_t track, const SequencerArp *arp) {
+  sequencer_set_track_arp_ctx(&sequencer, track, arp);
+}
+
+/**
+ * @brief Sets the groove template of all tracks.
+ *
+ * @param seq The sequencer.
+ * @param groove The groove template, NULL for straight timing.
+ */
+void sequencer_set_groove_ctx(Sequencer *seq, const SequencerGroove *groove) {
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    sequencer_set_track_groove_ctx(seq, i, groove);
+  }
+}
+
+/**
+ * @brief Sets the groove template of all tracks of the default sequencer.
+ */
+void sequencer_set_groove(const SequencerGroove *groove) {
+  sequencer_set_groove_ctx(&sequencer, groove);
+}
+
+/**
+ * @brief Sets the groove template of a track.
+ *
+ * @param seq The sequencer.
+ * @param track The track to set.
+ * @param groove The groove template, NULL for straight timing.
+ */
+void sequencer_set_track_groove_ctx(Sequencer *seq, uint8_t track, const SequencerGroove *groove) {
+  if(track >= CHANNEL_COUNT) { return; }
+  seq->tracks[track].groove = groove;
+  update_track(seq, &seq->tracks[track]);
+}
+
+/**
+ * @brief Sets the groove template of a track of the default sequencer.
+ */
+void sequencer_set_track_groove(uint8_t track, const SequencerGroove *groove) {
+  sequencer_set_track_groove_ctx(&sequencer, track, groove);
+}
+
+/**
+ * @brief Fills a groove template with a swing.
+ *
+ * @param groove The groove template to fill.
+ * @param percent The swing amount, 50 for straight timing, 66 for triplet feel.
+ */
+void sequencer_groove_swing(SequencerGroove *groove, uint8_t percent) {
+  percent = MIN(MAX(percent, 50), 75);
+  groove->length = 2;
+  groove->offsets[0] = 0;
+  groove->offsets[1] = (percent - 50) * 2;
+}
+
+/**
+ * @brief Queues a note on the voice of a track.
+ *
+ * @param seq The sequencer.
+ * @param voice The track playing the note.
+ * @param offset The voice to play, from the voice of the track.
+ * @param note The frequency of the note (Hz).
+ * @param velocity The velocity (0xffff for full).
+ * @param frame The synth frame of the note.
+ * @param gate_frames The length of the note, 0 to hold it.
+ */
+static void queue_note(Sequencer *seq, uint8_t voice, uint8_t offset, uint16_t note, uint16_t velocity,
+                       uint32_t frame, uint32_t gate_frames) {
+  const SequencerTrack *track = &seq->tracks[voice];
+  bool sampler = track->sampler != SEQUENCER_NO_SAMPLER;
+  SynthEvent event = {
+    .frame = frame,
+    .type = sampler ? EVENT_SAMPLE_ON : EVENT_NOTE_ON,
+    .channel = (sampler ? track->sampler : voice) + offset,
+    .value = note,
+    .velocity = velocity
+  };
+  synth_queue_event_ctx(seq->synth, &event);
+  if(gate_frames) {
+    event.type = sampler ? EVENT_SAMPLE_OFF : EVENT_NOTE_OFF;
+    event.frame = frame + gate_frames;
+    synth_queue_event_ctx(seq->synth, &event);
+  }
+}
+
+/**
+ * @brief Gets the number of voices a track plays at once.
+ *
+ * @param track The track.
+ *
+ * @return The notes of its chord with SEQUENCER_ARP_CHORD, 1 otherwise.
+ */
+static uint8_t track_voices(const SequencerTrack *track) {
+  if(track->arp && track->arp->mode == SEQUENCER_ARP_CHORD && track->arp_chord) {
+    return track->arp_chord->notes;
+  }
+  return 1;
+}
+
+/**
+ * @brief Queues the release of the voices of a track.
+ *
+ * @param seq The sequencer.
+ * @param voice The track to release.
+ * @param frame The synth frame of the release.
+ */
+static void release_track(Sequencer *seq, uint8_t voice, uint32_t frame) {
+  const SequencerTrack *track = &seq->tracks[voice];
+  if(track->drum != SEQUENCER_NO_DRUM) {
+    return; // drum hits end by themselves
+  }
+  bool sampler = track->sampler != SEQUENCER_NO_SAMPLER;
+  uint8_t first = sampler ? track->sampler : voice;
+  uint8_t voices = MIN(track_voices(track), CHANNEL_COUNT - first);
+  for(uint8_t k = 0; k < voices; k++) {
+    SynthEvent event = {
+      .frame = frame,
+      .type = sampler ? EVENT_SAMPLE_OFF : EVENT_NOTE_OFF,
+      .channel = first + k
+    };
+    synth_queue_event_ctx(seq->synth, &event);
+  }
+}
+
+/**
+ * @brief Checks if a track has played the whole sequence, when not looping.
+ *
+ * @param seq The sequencer.
+ * @param track The track to check.
+ *
+ * @return True if the track has no step left to schedule.
+ */
+static bool track_done(const Sequencer *seq, const SequencerTrack *track) {
+  return !seq->loop && track->count * track->divider >= seq->track_length;
+}
+
+/**
+ * @brief Gets the delay between the render clock and the audio output.
+ *
+ * @param synth The synth instance rendered to the output.
+ *
+ * @return The delay in microseconds.
+ */
+static uint32_t output_latency_us(Synth *synth) {
+  uint64_t latency_us = (uint64_t)dynamics_latency() * 1000000 / get_sample_rate_ctx(synth);
+#if USE_AUDIO_PWM
+  latency_us += (uint64_t)2 * SAMPLES_PER_BUFFER * 1000000 / get_output_rate_ctx(synth);
+#elif USE_AUDIO_I2S
+  // The first buffer is heard once the one playing now is over
+  latency_us += (uint64_t)SOUND_I2S_BUFFER_NUM_SAMPLES * 1000000 / get_output_rate_ctx(synth);
+#endif
+  return (uint32_t)latency_us;
+}
+
+/**
+ * @brief Starts the audio output and the timer, unless they still play
+ * the release of a previous run.
+ *
+ * @param seq The sequencer, playing.
+ */
+static void start_output(Sequencer *seq) {
+  assert(seq == &sequencer);
+  uint32_t status = save_and_disable_interrupts();
+  bool running = seq->running;
+  seq->running = true;
+  seq->silent = false;
+  restore_interrupts(status);
+
+  if(!running) {
   #if USE_AUDIO_PWM
+    // The first steps are queued before the buffers are rendered
+    sequencer_task_ctx(seq);
     sound_pwm_start();
   #elif USE_AUDIO_I2S
     sound_i2s_playback_start();
   #endif
-  add_repeating_timer_ms(10, seq_timer_callback, NULL, &sequencer_timer);
+  }
+  clock_sync_output_start(output_latency_us(seq->synth));
+  // The sequencer position starts over, so does the phase of the clock
+  clock_sync_reset();
+  if(!running) {
+    add_repeating_timer_ms(SEQUENCER_TIMER_MS, seq_timer_callback, seq, &seq->timer);
+  }
+}
+
+/**
+ * @brief Starts the sequencer.
+ *
+ * @param seq The sequencer.
+ * @param loop Flag indicating whether the sequencer should loop.
+ */
+void sequencer_start_ctx(Sequencer *seq, bool loop) {
+  Synth *synth = seq->synth;
+  seq->start_frame = synth_get_frame_ctx(synth);
+  seq->start_step = 0;
+  seq->step = 0;
+  seq->next_step_frame = seq->start_frame;
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    // A pattern queued before the start plays from its first bar
+    if(seq->tracks[i].pending) { take_pattern(&seq->tracks[i]); }
+    build_schedule(seq, &seq->tracks[i]);
+    reset_track(&seq->tracks[i], seq->start_frame);
+  }
+#if USE_AUDIO_I2S
+  // Events are scheduled right before each buffer is rendered
+  seq->lookahead_frames = SOUND_I2S_BUFFER_NUM_SAMPLES;
+#elif USE_AUDIO_PWM
+  // The renderer fills a whole PWM buffer at once, and both buffers
+  // when starting: schedule past them and the next timer callback
+  seq->lookahead_frames = 2 * SEQUENCER_TIMER_MS * get_sample_rate_ctx(synth) / 1000 +
+                          2 * SAMPLES_PER_BUFFER;
+#else
+  // Offline renders call sequencer_task_ctx() before each block
+  seq->lookahead_frames = SYNTH_BLOCK_SIZE;
+#endif
+  seq->loop = loop;
+  seq->paused = false;
+  seq->playing = true;
+  if(seq->output) {
+    start_output(seq);
+  }
+}
+
+/**
+ * @brief Starts the default sequencer.
+ *
+ * @param loop Flag indicating whether the sequencer should loop.
+ */
+void sequencer_start(bool loop) {
+  sequencer_start_ctx(&sequencer, loop);
+}
+
+/**
+ * @brief Restores the parameters left locked by the last steps.
+ *
+ * @param seq The sequencer.
+ */
+static void restore_locks(Sequencer *seq) {
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    for(uint8_t p = PARAM_NONE + 1; p < PARAM_COUNT; p++) {
+      if(seq->locked_params[i] & (1u << p)) {
+        synth_set_param(&seq->synth->channels[i], p, seq->param_defaults[i][p]);
+      }
+    }
+    seq->locked_params[i] = 0;
+    seq->saved_params[i] = 0;
+  }
 }
 
 /**
  * @brief Stops the sequencer.
+ *
+ * Events not rendered yet are dropped and the voices are released at
+ * the render clock. The audio output is not touched: the timer keeps
+ * rendering the release and the effect tails, and stops the output
+ * once both are over (see seq_timer_callback()), so nothing is cut
+ * and no buffer is written while it is being played.
+ *
+ * @param seq The sequencer.
+ */
+void sequencer_stop_ctx(Sequencer *seq) {
+  uint32_t status = save_and_disable_interrupts();
+  seq->playing = false;
+  seq->paused = false;
+  seq->silent = false;
+  synth_clear_events_ctx(seq->synth);
+  uint32_t now = synth_get_frame_ctx(seq->synth);
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    release_track(seq, i, now);
+  }
+  restore_locks(seq);
+  restore_interrupts(status);
+  if(seq->output) {
+    clock_sync_output_stop();
+  }
+}
+
+/**
+ * @brief Stops the default sequencer.
  */
 void sequencer_stop() {
-  sequencer.playing = false;
+  sequencer_stop_ctx(&sequencer);
+}
+
+/**
+ * @brief Stops the sequencer and the audio output at once.
+ *
+ * Used when the output can not keep running, e.g. to change its rate.
+ *
+ * @param seq The sequencer.
+ */
+static void halt(Sequencer *seq) {
+  seq->playing = false;
+  seq->paused = false;
+  if(seq->output && seq->running) {
 #if USE_AUDIO_PWM
-  sound_pwm_stop();
+    sound_pwm_stop();
 #elif USE_AUDIO_I2S
-  // Clear i2s buffer
-  int16_t *buf_0 = sound_i2s_get_buffer(0);
-  int16_t *buf_1 = sound_i2s_get_buffer(1);
-  for (int i = 0; i < 2 * SOUND_I2S_BUFFER_NUM_SAMPLES; i++) {
-    buf_0[i] = 0;
-    buf_1[i] = 0;
-  }
+    // Stop the dma and the pio, and start again from silence
+    sound_i2s_playback_stop();
+    sound_i2s_clear_buffers();
 #endif
-  cancel_repeating_timer(&sequencer_timer);
+    cancel_repeating_timer(&seq->timer);
+    clock_sync_output_stop();
+    seq->running = false;
+  }
+  synth_clear_events_ctx(seq->synth);
+  restore_locks(seq);
 }
 
-extern AudioChannel channels[CHANNEL_COUNT];
+/**
+ * @brief Pauses the sequencer.
+ *
+ * The steps already queued to the synth are played, and the voices are
+ * released right after them: at the earliest frame a step has not been
+ * scheduled for. The output then stops as after sequencer_stop_ctx().
+ *
+ * @param seq The sequencer.
+ */
+void sequencer_pause_ctx(Sequencer *seq) {
+  uint32_t status = save_and_disable_interrupts();
+  if(!seq->playing) {
+    restore_interrupts(status);
+    return;
+  }
+  uint32_t frame = seq->next_step_frame;
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    const SequencerTrack *track = &seq->tracks[i];
+    if(track->arp_active && (int32_t)(track->arp_next_frame - frame) < 0) { frame = track->arp_next_frame; }
+    if(track->length == 0 || track_done(seq, track)) { continue; }
+    if((int32_t)(track->next_frame - frame) < 0) { frame = track->next_frame; }
+  }
+  uint32_t now = synth_get_frame_ctx(seq->synth);
+  if((int32_t)(frame - now) < 0) { frame = now; }
+
+  seq->playing = false;
+  seq->paused = true;
+  seq->pause_frame = frame;
+  seq->silent = false;
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    release_track(seq, i, frame);
+  }
+  restore_interrupts(status);
+  if(seq->output) {
+    clock_sync_output_stop();
+  }
+}
 
 /**
- * @brief Executes the sequencer task.
+ * @brief Pauses the default sequencer.
  */
-void sequencer_task(){
-  if(!sequencer.playing) { return; }
-  static uint16_t prev_beat = 1;
-  static uint16_t beat = 0;
-
-  uint64_t tick_ms = (time_us_64() - sequencer.start_time) / 1000;
-
-  beat = (tick_ms / sequencer.beat_ms);
-  if(beat >= sequencer.track_length) { // We reached the end of the track
-    if(sequencer.loop) { beat = beat % sequencer.track_length; }
-    else {
-      sequencer_stop();
-      sequencer.callback(&sequencer);
-      return;
+void sequencer_pause() {
+  sequencer_pause_ctx(&sequencer);
+}
+
+/**
+ * @brief Resumes a paused sequencer.
+ *
+ * The schedule is moved by the length of the pause, which is counted
+ * on the render clock from the pause frame, so the steps keep their
+ * spacing to the frame. Resuming before the pause frame is rendered
+ * continues as if there was no pause.
+ *
+ * @param seq The sequencer.
+ */
+void sequencer_resume_ctx(Sequencer *seq) {
+  uint32_t status = save_and_disable_interrupts();
+  if(!seq->paused) {
+    restore_interrupts(status);
+    return;
+  }
+  uint32_t now = synth_get_frame_ctx(seq->synth);
+  uint32_t shift = (int32_t)(now - seq->pause_frame) > 0 ? now - seq->pause_frame : 0;
+  seq->start_frame += shift;
+  seq->next_step_frame += shift;
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    SequencerTrack *track = &seq->tracks[i];
+    track->anchor_frame += shift;
+    track->cycle_frame += shift;
+    track->next_frame += shift;
+    track->arp_origin += shift;
+    track->arp_next_frame += shift;
+    track->arp_end_frame += shift;
+  }
+  seq->paused = false;
+  seq->playing = true;
+  restore_interrupts(status);
+  if(seq->output) {
+    start_output(seq);
+  }
+}
+
+/**
+ * @brief Resumes the default sequencer.
+ */
+void sequencer_resume() {
+  sequencer_resume_ctx(&sequencer);
+}
+
+/**
+ * @brief Generates the next value of the step probability PRNG.
+ *
+ * @param seq The sequencer.
+ *
+ * @return The next value in the sequence.
+ */
+static uint32_t prng_next(Sequencer *seq) {
+  uint32_t x = seq->prng_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  seq->prng_state = x;
+  return x;
+}
+
+/**
+ * @brief Gets the synth frame at which a step starts.
+ *
+ * @param seq The sequencer.
+ * @param step The index of the step since the sequencer was started.
+ *
+ * @return The frame of the step.
+ */
+static uint32_t step_frame(const Sequencer *seq, uint32_t step) {
+  uint64_t frames_q8 = (uint64_t)(step - seq->start_step) * seq->step_frames_q8;
+  return seq->start_frame + (uint32_t)(frames_q8 >> 8);
+}
+
+/**
+ * @brief Gets the next step of a track.
+ *
+ * @param track The track to read.
+ * @param scratch Storage for steps converted from plain notes.
+ *
+ * @return The step.
+ */
+static const SequencerStep *get_step(const SequencerTrack *track, SequencerStep *scratch) {
+  if(track->steps) {
+    return &track->steps[track->position];
+  }
+  *scratch = (SequencerStep){ .note = track->notes ? track->notes[track->position] : 0 };
+  return scratch;
+}
+
+/**
+ * @brief Queues a parameter change event.
+ */
+static void queue_param(Sequencer *seq, uint8_t voice, uint32_t frame, uint8_t param, uint16_t value) {
+  SynthEvent event = {
+    .frame = frame,
+    .type = EVENT_PARAM,
+    .channel = voice,
+    .param = param,
+    .value = value
+  };
+  synth_queue_event_ctx(seq->synth, &event);
+}
+
+/**
+ * @brief Frequency ratios of the semitones of an octave (Q16).
+ */
+static const uint32_t semitone_ratios[12] = {
+  65536, 69433, 73562, 77936, 82570, 87480, 92682, 98193, 104032, 110218, 116772, 123715
+};
+
+/**
+ * @brief Transposes a note by a number of semitones.
+ *
+ * @param note The frequency of the note (Hz).
+ * @param semitones The interval, negative to go down.
+ *
+ * @return The frequency of the transposed note (Hz).
+ */
+static uint16_t transpose(uint16_t note, int16_t semitones) {
+  int16_t octave = semitones >= 0 ? semitones / 12 : -((11 - semitones) / 12);
+  uint64_t frequency = (uint64_t)note * semitone_ratios[semitones - octave * 12];
+  frequency = octave >= 0 ? frequency << octave : frequency >> -octave;
+  frequency = (frequency + 0x8000) >> 16;
+  return (uint16_t)MIN(MAX(frequency, 1), 0x7fff);
+}
+
+/**
+ * @brief Gets the spacing of the arpeggio notes of a track.
+ *
+ * @param seq The sequencer.
+ * @param arp The arpeggiator settings.
+ *
+ * @return The spacing in frames (Q8).
+ */
+static uint64_t arp_spacing_q8(const Sequencer *seq, const SequencerArp *arp) {
+  uint8_t ticks = arp->ticks ? arp->ticks : SEQUENCER_TICKS_PER_STEP;
+  return (uint64_t)seq->step_frames_q8 * ticks / SEQUENCER_TICKS_PER_STEP;
+}
+
+/**
+ * @brief Gets a note of the arpeggio of a track.
+ *
+ * The notes of the chord over all the octaves are numbered from the
+ * lowest, and the mode picks one of them for each position.
+ *
+ * @param seq The sequencer.
+ * @param track The track.
+ * @param index The position in the arpeggio.
+ *
+ * @return The frequency of the note (Hz).
+ */
+static uint16_t arp_note(Sequencer *seq, const SequencerTrack *track, uint32_t index) {
+  const SequencerArp *arp = track->arp;
+  const SequencerChord *chord = track->arp_chord;
+  uint8_t notes = chord ? chord->notes : 1;
+  uint32_t count = notes * (arp->octaves ? arp->octaves : 1);
+  uint32_t k;
+  switch(arp->mode) {
+    case SEQUENCER_ARP_DOWN:
+      k = count - 1 - index % count;
+      break;
+    case SEQUENCER_ARP_UP_DOWN:
+      k = count > 1 ? index % (2 * count - 2) : 0;
+      if(k >= count) { k = 2 * count - 2 - k; }
+      break;
+    case SEQUENCER_ARP_RANDOM:
+      k = prng_next(seq) % count;
+      break;
+    default:
+      k = index % count;
+      break;
+  }
+  int16_t interval = chord ? chord->intervals[k % notes] : 0;
+  return transpose(track->arp_root, interval + 12 * (int16_t)(k / notes));
+}
+
+/**
+ * @brief Gets the chord an arpeggiator plays from a step.
+ *
+ * @param arp The arpeggiator.
+ * @param step The step.
+ *
+ * @return The chord, NULL for the note of the step alone.
+ */
+static const SequencerChord *step_chord(const SequencerArp *arp, const SequencerStep *step) {
+  if(!arp->chords || !arp->chord_count) {
+    return NULL;
+  }
+  const SequencerChord *chord = &arp->chords[step->chord < arp->chord_count ? step->chord : 0];
+  if(chord->notes == 0 || chord->notes > SEQUENCER_CHORD_MAX_NOTES) {
+    return NULL;
+  }
+  return chord;
+}
+
+/**
+ * @brief Starts the arpeggio of a note.
+ *
+ * The first note of the arpeggio is played at the frame of the step.
+ * With SEQUENCER_ARP_CHORD, the whole chord is played at once instead.
+ *
+ * @param seq The sequencer.
+ * @param voice The track of the step.
+ * @param step The step starting the arpeggio.
+ * @param velocity The velocity of the step.
+ * @param frame The synth frame of the step.
+ * @param gate_frames The gate of the step, 0 for none.
+ */
+static void arp_start(Sequencer *seq, uint8_t voice, const SequencerStep *step, uint16_t velocity,
+                      uint32_t frame, uint32_t gate_frames) {
+  SequencerTrack *track = &seq->tracks[voice];
+  const SequencerArp *arp = track->arp;
+  const SequencerChord *chord = step_chord(arp, step);
+  track->arp_chord = chord;
+  track->arp_root = step->note;
+  track->arp_velocity = velocity;
+
+  if(arp->mode == SEQUENCER_ARP_CHORD) {
+    uint8_t first = track->sampler != SEQUENCER_NO_SAMPLER ? track->sampler : voice;
+    uint8_t notes = MIN(chord ? chord->notes : 1, CHANNEL_COUNT - first);
+    for(uint8_t k = 0; k < notes; k++) {
+      uint16_t note = transpose(step->note, chord ? chord->intervals[k] : 0);
+      queue_note(seq, voice, k, note, velocity, frame, gate_frames);
     }
+    track->arp_active = false;
+    return;
+  }
+
+  track->arp_index = 0;
+  track->arp_origin = frame;
+  track->arp_count = 0;
+  track->arp_next_frame = frame;
+  track->arp_gated = gate_frames != 0;
+  track->arp_end_frame = frame + gate_frames;
+  track->arp_active = true;
+}
+
+/**
+ * @brief Queues the next note of the arpeggio of a track.
+ *
+ * @param seq The sequencer.
+ * @param voice The track playing the arpeggio.
+ */
+static void arp_play(Sequencer *seq, uint8_t voice) {
+  SequencerTrack *track = &seq->tracks[voice];
+  const SequencerArp *arp = track->arp;
+  uint32_t frame = track->arp_next_frame;
+  if(track->arp_gated && (int32_t)(frame - track->arp_end_frame) >= 0) {
+    // The gate of the step is over
+    release_track(seq, voice, track->arp_end_frame);
+    track->arp_active = false;
+    return;
   }
 
-  if (beat == prev_beat) return;
-  prev_beat = beat;
+  uint64_t spacing_q8 = arp_spacing_q8(seq, arp);
+  uint32_t gate_frames = arp->gate ? MAX((uint32_t)((spacing_q8 * arp->gate / 100) >> 8), 1) : 0;
+  queue_note(seq, voice, 0, arp_note(seq, track, track->arp_index), track->arp_velocity, frame, gate_frames);
+  track->arp_index++;
+  track->arp_count++;
+  track->arp_next_frame = track->arp_origin + (uint32_t)((track->arp_count * spacing_q8) >> 8);
+}
 
-  for(uint8_t i = 0; i < num_voices; i++) {
-    int16_t note = _notes[i*sequencer.track_length + beat];
-    if(note > 0) {
-      channels[i].frequency = note;
-      trigger_attack(&channels[i]);
-    } else if (note == -1) {
-      trigger_release(&channels[i]);
+/**
+ * @brief Checks if the event queue has room for some events.
+ *
+ * Events that can not fit in the queue along with the reserve wait for
+ * it to be empty.
+ *
+ * @param seq The sequencer.
+ * @param events The number of events.
+ * @param reserve The number of entries to leave free.
+ *
+ * @return True if the events fit.
+ */
+static bool queue_fits(const Sequencer *seq, uint8_t events, uint8_t reserve) {
+  uint8_t room = SYNTH_EVENT_QUEUE_SIZE - 1 - synth_event_queue_depth_ctx(seq->synth);
+  return room >= MIN(events + reserve, SYNTH_EVENT_QUEUE_SIZE - 1);
+}
+
+/**
+ * @brief Gets the number of events the release of every track takes.
+ *
+ * The task keeps them free in the queue, for sequencer_pause_ctx() to
+ * release the tracks behind the steps already queued.
+ *
+ * @param seq The sequencer.
+ *
+ * @return The number of events.
+ */
+static uint8_t release_events(const Sequencer *seq) {
+  uint8_t events = 0;
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    const SequencerTrack *track = &seq->tracks[i];
+    if(track->drum != SEQUENCER_NO_DRUM) { continue; }
+    uint8_t first = track->sampler != SEQUENCER_NO_SAMPLER ? track->sampler : i;
+    uint8_t voices = (track->arp && track->arp->mode == SEQUENCER_ARP_CHORD) ? SEQUENCER_CHORD_MAX_NOTES : 1;
+    events += MIN(voices, CHANNEL_COUNT - first);
+  }
+  return events;
+}
+
+/**
+ * @brief Gets the largest number of events play_step() queues for a step.
+ *
+ * @param seq The sequencer.
+ * @param voice The track of the step.
+ * @param step The step.
+ *
+ * @return The number of events.
+ */
+static uint8_t step_events(const Sequencer *seq, uint8_t voice, const SequencerStep *step) {
+  const SequencerTrack *track = &seq->tracks[voice];
+  if(track->drum != SEQUENCER_NO_DRUM) {
+    return step->note > 0;
+  }
+  bool sampler = track->sampler != SEQUENCER_NO_SAMPLER;
+  uint8_t events = 0;
+  uint16_t locks = 0;
+  for(uint8_t l = 0; l < SEQUENCER_STEP_LOCKS && !sampler; l++) {
+    uint8_t param = step->locks[l].param;
+    if(param == PARAM_NONE || param >= PARAM_COUNT) { continue; }
+    locks |= (1u << param);
+    events++;
+  }
+  if(step->note > 0) {
+    if(!sampler) {
+      events += __builtin_popcount(seq->locked_params[voice] & ~locks);
+    }
+    if(!track->arp) {
+      events += 2;
+    } else if(track->arp->mode == SEQUENCER_ARP_CHORD) {
+      const SequencerChord *chord = step_chord(track->arp, step);
+      uint8_t first = sampler ? track->sampler : voice;
+      events += 2 * MIN(chord ? chord->notes : 1, CHANNEL_COUNT - first);
+    }
+  } else if(step->note == -1) {
+    events += track_voices(track);
+  }
+  return events;
+}
+
+/**
+ * @brief Queues the events of a step.
+ *
+ * @param seq The sequencer.
+ * @param voice The voice playing the step.
+ * @param step The step to play.
+ * @param frame The synth frame at which the step starts.
+ * @param step_frames The duration of a step in frames.
+ */
+static void play_step(Sequencer *seq, uint8_t voice, const SequencerStep *step, uint32_t frame, uint32_t step_frames) {
+  if(step->probability && (prng_next(seq) % 100) >= step->probability) { return; }
+
+  const SequencerTrack *track = &seq->tracks[voice];
+  Synth *synth = seq->synth;
+  uint16_t velocity = step->velocity ? (uint16_t)(MIN(step->velocity, 127) * 0xffff / 127) : 0xffff;
+  if(track->drum != SEQUENCER_NO_DRUM) {
+    if(step->note > 0) {
+      SynthEvent event = {
+        .frame = frame,
+        .type = EVENT_DRUM,
+        .channel = track->drum,
+        .velocity = velocity
+      };
+      synth_queue_event_ctx(synth, &event);
+    }
+    return;
+  }
+
+  // Locks are queued first so they apply to the note they come with.
+  // Sampler voices have no parameters to lock.
+  bool sampler = track->sampler != SEQUENCER_NO_SAMPLER;
+  uint16_t locks = 0;
+  for(uint8_t l = 0; l < SEQUENCER_STEP_LOCKS && !sampler; l++) {
+    uint8_t param = step->locks[l].param;
+    if(param == PARAM_NONE || param >= PARAM_COUNT) { continue; }
+    if(!(seq->saved_params[voice] & (1u << param))) {
+      seq->param_defaults[voice][param] = synth_get_param(&synth->channels[voice], param);
+      seq->saved_params[voice] |= (1u << param);
+    }
+    queue_param(seq, voice, frame, param, step->locks[l].value);
+    locks |= (1u << param);
+  }
+
+  if(step->note > 0) {
+    if(!sampler) {
+      // A new note ends the locks of the previous one
+      uint16_t expired = seq->locked_params[voice] & ~locks;
+      for(uint8_t p = PARAM_NONE + 1; p < PARAM_COUNT; p++) {
+        if(expired & (1u << p)) {
+          queue_param(seq, voice, frame, p, seq->param_defaults[voice][p]);
+        }
+      }
+      seq->locked_params[voice] = locks;
+    }
+
+    uint32_t gate_frames = step->gate ? step->gate * step_frames / SEQUENCER_TICKS_PER_STEP : 0;
+    if(track->arp) {
+      arp_start(seq, voice, step, velocity, frame, gate_frames);
+    } else {
+      queue_note(seq, voice, 0, step->note, velocity, frame, gate_frames);
+    }
+  } else {
+    seq->locked_params[voice] |= locks;
+    if(step->note == -1) {
+      release_track(seq, voice, frame);
+      seq->tracks[voice].arp_active = false;
+    }
+  }
+}
+
+/**
+ * @brief Checks if every track has queued its last step, when not looping.
+ *
+ * @param seq The sequencer.
+ *
+ * @return True if no step is left, not even one the full queue held back.
+ */
+static bool tracks_done(const Sequencer *seq) {
+  for(uint8_t i = 0; i < seq->num_voices; i++) {
+    const SequencerTrack *track = &seq->tracks[i];
+    if(track->length && !track_done(seq, track)) { return false; }
+  }
+  return true;
+}
+
+/**
+ * @brief Executes the sequencer task.
+ *
+ * Queues the events of every step and arpeggio note starting before
+ * the renderer reaches the lookahead horizon. A step is only queued
+ * with room for all its events, and for the release of every track:
+ * when the queue is too full, it waits for the next task.
+ *
+ * @param seq The sequencer.
+ */
+void sequencer_task_ctx(Sequencer *seq) {
+  if(!seq->playing) { return; }
+  uint32_t now = synth_get_frame_ctx(seq->synth);
+  uint32_t horizon = now + seq->lookahead_frames;
+  uint8_t reserve = release_events(seq);
+
+  while(true) {
+    // The tracks are queued together, in the order they play, so that a
+    // full queue holds back the latest events rather than whole tracks
+    SequencerTrack *track = NULL;
+    uint8_t voice = 0;
+    uint32_t frame = 0;
+    bool arp = false;
+    for(uint8_t i = 0; i < seq->num_voices; i++) {
+      SequencerTrack *t = &seq->tracks[i];
+      bool step_due = t->length && !track_done(seq, t) &&
+                      (int32_t)(horizon - t->next_frame) > 0;
+      // Arpeggio notes and steps are queued in the order they play,
+      // a step replacing the arpeggio note on the same frame
+      bool arp_due = t->arp_active && (int32_t)(horizon - t->arp_next_frame) > 0 &&
+                     (!step_due || (int32_t)(t->next_frame - t->arp_next_frame) > 0);
+      if(!step_due && !arp_due) { continue; }
+      uint32_t f = arp_due ? t->arp_next_frame : t->next_frame;
+      if(track == NULL || (int32_t)(f - frame) < 0) {
+        track = t;
+        voice = i;
+        frame = f;
+        arp = arp_due;
+      }
+    }
+    if(track == NULL) { break; }
+
+    if(arp) {
+      if(!queue_fits(seq, 2, reserve)) { break; }
+      arp_play(seq, voice);
+      continue;
     }
+    if(track->pending && (int32_t)(track->beat - track->switch_beat) >= 0) {
+      // The queued pattern starts on this step, which keeps its timing
+      take_pattern(track);
+      retime_track(seq, track);
+      continue;
+    }
+    SequencerStep scratch;
+    const SequencerStep *step = get_step(track, &scratch);
+    if(!queue_fits(seq, step_events(seq, voice, step), reserve)) {
+      // The queue is full: the step is left for the next task, rather
+      // than losing the note off or the restore of a lock
+      break;
+    }
+    play_step(seq, voice, step, track->next_frame, track->step_frames);
+    advance_track(track);
+  }
+
+  // The sequencer beats keep track of the end of the sequence
+  while((int32_t)(horizon - seq->next_step_frame) > 0 &&
+        (seq->loop || seq->step < seq->track_length)) {
+    seq->next_step_frame = step_frame(seq, ++seq->step);
+  }
+
+  if(!seq->loop && seq->step >= seq->track_length &&
+     (int32_t)(now - seq->next_step_frame) >= 0 && tracks_done(seq)) {
+    // The renderer reached the end of the track
+    sequencer_stop_ctx(seq);
+    seq->callback(seq);
+  }
+}
+
+/**
+ * @brief Executes the task of the default sequencer.
+ */
+void sequencer_task(){
+  sequencer_task_ctx(&sequencer);
+}
+
+/**
+ * @brief Checks if the audio output of a stopped sequencer can stop.
+ *
+ * The synth must have been silent for two lookaheads, and for the delay
+ * of the dynamics: every buffer of the output then holds silence, and
+ * the DMA can stop without a click.
+ *
+ * @param seq The sequencer driving the output.
+ *
+ * @return True if the output can stop.
+ */
+static bool output_done(Sequencer *seq) {
+  if(seq->playing) { return false; }
+  uint32_t now = synth_get_frame_ctx(seq->synth);
+  if(is_audio_playing_ctx(seq->synth)) {
+    seq->silent = false;
+    return false;
   }
+  if(!seq->silent) {
+    seq->silent = true;
+    seq->silent_frame = now;
+  }
+  return now - seq->silent_frame >= 2 * seq->lookahead_frames + dynamics_latency();
 }
 
 /**
@@ -138,44 +1330,168 @@ void sequencer_task(){
  *
  * @return True if the timer should continue, false otherwise.
  */
-bool seq_timer_callback(repeating_timer_t *timer) {
+bool SYNTH_RAM_FUNC(seq_timer_callback)(repeating_timer_t *timer) {
+    Sequencer *seq = (Sequencer *)timer->user_data;
+    assert(seq == &sequencer); // the output and its buffers are single
 #if USE_AUDIO_I2S
-    static int16_t *last_buffer;
-    int16_t *buffer = sound_i2s_get_next_buffer();
-    if (buffer == NULL || buffer == last_buffer) { return true; }
-    last_buffer = buffer;
+    void *buffer = sound_i2s_get_next_buffer();
+    if (buffer == NULL || buffer == seq->last_buffer) { return true; }
+    seq->last_buffer = buffer;
+  #if SYNTH_TELEMETRY
+    // More than one buffer played since the last render: one of them
+    // was played again instead of a new one
+    uint32_t played = sound_i2s_num_buffers_played;
+    if (played > seq->last_played + 1) { TELEMETRY_UNDERRUN(); }
+    seq->last_played = played;
+  #endif
+    TELEMETRY_RENDER_BEGIN();
 #endif
 
-    sequencer_task();
+    clock_sync_task();
+    sequencer_task_ctx(seq);
     
 #if USE_AUDIO_I2S
-    for (int i = 0; i < SOUND_I2S_BUFFER_NUM_SAMPLES; i++) {
-      int16_t level = get_audio_frame();
-
-      // Copy to I2S buffer
-      *buffer++ = level;
-      *buffer++ = level;
-    }
+    // Rendered straight into the I2S buffer, in its native packing
+    int bits = sound_i2s_get_bits_per_sample();
+    uint8_t format = (bits == 8) ? SYNTH_FORMAT_STEREO8 :
+                     (bits == 16) ? SYNTH_FORMAT_STEREO16 : SYNTH_FORMAT_STEREO32;
+    synth_render_format_ctx(seq->synth, buffer, SOUND_I2S_BUFFER_NUM_SAMPLES, format);
+    TELEMETRY_RENDER_END(SOUND_I2S_BUFFER_NUM_SAMPLES);
 #endif
+    if (output_done(seq)) {
+      // Nothing runs until the next start, so the cores can sleep
+#if USE_AUDIO_PWM
+      sound_pwm_stop();
+#elif USE_AUDIO_I2S
+      sound_i2s_playback_stop();
+#endif
+      seq->running = false;
+      return false;
+    }
     return true;
 }
 
 /**
  * @brief Sets the tempo of the sequencer.
  *
+ * @param seq The sequencer.
+ * @param bpm The tempo in beats per minute.
+ */
+void sequencer_set_tempo_ctx(Sequencer *seq, uint16_t bpm) {
+  sequencer_set_step_frames_ctx(seq, (uint32_t)((uint64_t)get_sample_rate_ctx(seq->synth) * 60 * 256 / (bpm * 4)));
+}
+
+/**
+ * @brief Sets the tempo of the default sequencer.
+ *
  * @param bpm The tempo in beats per minute.
  */
 void sequencer_set_tempo(uint16_t bpm) {
-  beat_ms = 60 * 1000 / bpm / 4;
-  sequencer.beat_ms = beat_ms;
+  sequencer_set_tempo_ctx(&sequencer, bpm);
+}
+
+/**
+ * @brief Sets the tempo of the sequencer as a step duration.
+ *
+ * The delay of the master bus follows the tempo of the sequencer
+ * playing the default synth.
+ *
+ * @param seq The sequencer.
+ * @param step_frames_q8 The step duration in frames (Q8).
+ */
+void sequencer_set_step_frames_ctx(Sequencer *seq, uint32_t step_frames_q8) {
+  // Steps already scheduled keep their timing, the new tempo
+  // applies from the next step
+  seq->start_frame = seq->next_step_frame;
+  seq->start_step = seq->step;
+  seq->step_frames_q8 = step_frames_q8;
+  seq->beat_ms = (uint64_t)step_frames_q8 * 1000 / (256 * get_sample_rate_ctx(seq->synth));
+  if(seq->synth->master_bus) {
+    effects_set_step_frames(step_frames_q8);
+  }
+  if(seq->playing) {
+    for(uint8_t i = 0; i < seq->num_voices; i++) {
+      retime_track(seq, &seq->tracks[i]);
+    }
+  }
+}
+
+/**
+ * @brief Sets the tempo of the default sequencer as a step duration.
+ *
+ * @param step_frames_q8 The step duration in frames (Q8).
+ */
+void sequencer_set_step_frames(uint32_t step_frames_q8) {
+  sequencer_set_step_frames_ctx(&sequencer, step_frames_q8);
+}
+
+/**
+ * @brief Changes the sample rate of the synth and of the audio output.
+ *
+ * The synth renders at sample_rate / divider and its output is
+ * upsampled to sample_rate, see synth_set_rate_divider(). Playback is
+ * stopped, as the audio output can not change rate in the middle of a
+ * buffer; the tempo is kept. Only the sequencer driving the audio
+ * output moves it to the new rate.
+ *
+ * @param seq The sequencer.
+ * @param sample_rate The sample rate of the audio output.
+ * @param divider The ratio between the output and the internal rate: 1, 2 or 4.
+ *
+ * @return True if the rate was changed, false if the divider is not supported.
+ */
+bool sequencer_set_sample_rate_ctx(Sequencer *seq, uint32_t sample_rate, uint8_t divider) {
+  if(seq->playing || seq->paused || seq->running) {
+    halt(seq);
+  }
+  Synth *synth = seq->synth;
+  uint32_t old_rate = get_sample_rate_ctx(synth);
+  if(!synth_set_rate_divider_ctx(synth, divider)) {
+    return false;
+  }
+  set_sample_rate_ctx(synth, sample_rate);
+  sequencer_set_step_frames_ctx(seq, (uint32_t)((uint64_t)seq->step_frames_q8 * get_sample_rate_ctx(synth) / old_rate));
+  if(!seq->output) {
+    return true;
+  }
+#if USE_AUDIO_PWM
+  sound_pwm_set_sample_rate(sample_rate);
+#elif USE_AUDIO_I2S
+  sound_i2s_set_sample_rate(sample_rate);
+#endif
+  clock_sync_reset();
+  return true;
+}
+
+/**
+ * @brief Changes the sample rate of the default synth and of the audio output.
+ *
+ * @param sample_rate The sample rate of the audio output.
+ * @param divider The ratio between the output and the internal rate: 1, 2 or 4.
+ *
+ * @return True if the rate was changed, false if the divider is not supported.
+ */
+bool sequencer_set_sample_rate(uint32_t sample_rate, uint8_t divider) {
+  return sequencer_set_sample_rate_ctx(&sequencer, sample_rate, divider);
 }
 
 /**
  * @brief Sets the callback function to be executed when the sequencer finishes playing.
  *
+ * The callback receives the sequencer as its user data.
+ *
+ * @param seq The sequencer.
+ * @param callback The callback function.
+ */
+void sequencer_set_callback_ctx(Sequencer *seq, void (*callback)(void *user_data)) {
+  seq->callback = callback;
+}
+
+/**
+ * @brief Sets the callback function to be executed when the default sequencer finishes playing.
+ *
  * @param callback The callback function.
  */
 void sequencer_set_callback(void (*callback)(void *user_data)) {
-    sequencer.callback = callback;
+    sequencer_set_callback_ctx(&sequencer, callback);
 };
-
@@ -13,9 +13,255 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Number of clock ticks in a step. Steps are sixteenth notes,
+ * so this gives 24 ticks per quarter note.
+ */
+#define SEQUENCER_TICKS_PER_STEP 6
+
+/**
+ * @brief Maximum number of parameter locks in a step.
+ */
+#define SEQUENCER_STEP_LOCKS 2
+
+/**
+ * @brief Period of the sequencer timer in milliseconds.
+ */
+#define SEQUENCER_TIMER_MS 10
+
+/**
+ * @brief Value used for tracks that do not play a drum voice.
+ */
+#define SEQUENCER_NO_DRUM 0xff
+
+/**
+ * @brief Value used for tracks that do not play a sampler voice.
+ */
+#define SEQUENCER_NO_SAMPLER 0xff
+
+/**
+ * @brief Maximum number of steps in a groove template.
+ */
+#define SEQUENCER_GROOVE_MAX_STEPS 16
+
+/**
+ * @brief Number of sequencer beats in a bar. Queued patterns start on
+ * the first step of a bar.
+ */
+#define SEQUENCER_STEPS_PER_BAR 16
+
+/**
+ * @brief Maximum number of notes in a chord of the arpeggiator.
+ */
+#define SEQUENCER_CHORD_MAX_NOTES 6
+
+/**
+ * @struct SequencerLock
+ * @brief Overrides a channel parameter for the duration of a step.
+ */
+typedef struct SequencerLock {
+  /**
+   * @brief The parameter to override, one of SynthParam. PARAM_NONE if unused.
+   */
+  uint8_t param;
+
+  /**
+   * @brief The value of the parameter.
+   */
+  uint16_t value;
+} SequencerLock;
+
+/**
+ * @struct SequencerStep
+ * @brief A step of a sequence, with per-step performance data.
+ *
+ * Fields left at zero keep the behaviour of a plain note sequence, so
+ * steps can be written with designated initializers.
+ */
+typedef struct SequencerStep {
+  /**
+   * @brief The frequency of the note (Hz), 0 to hold, -1 to release.
+   */
+  int16_t note;
+
+  /**
+   * @brief The note velocity (1-127, higher values play at 127), 0 for full velocity.
+   */
+  uint8_t velocity;
+
+  /**
+   * @brief The gate length in ticks, 0 to hold the note until it is released.
+   */
+  uint8_t gate;
+
+  /**
+   * @brief The probability of the step being played in percent, 0 to always play it.
+   */
+  uint8_t probability;
+
+  /**
+   * @brief Parameter locks, applied right before the note is triggered.
+   * Locks last until the next step that triggers a note.
+   */
+  SequencerLock locks[SEQUENCER_STEP_LOCKS];
+
+  /**
+   * @brief The chord the arpeggiator of the track plays from the note,
+   * an index in its chords.
+   */
+  uint8_t chord;
+} SequencerStep;
+
+/**
+ * @enum SequencerArpMode
+ * @brief The order in which the arpeggiator plays the notes of a chord.
+ */
+typedef enum {
+  SEQUENCER_ARP_UP,       // lowest to highest, then again
+  SEQUENCER_ARP_DOWN,     // highest to lowest, then again
+  SEQUENCER_ARP_UP_DOWN,  // up then down, the ends played once
+  SEQUENCER_ARP_RANDOM,   // a random note of the chord each time
+  SEQUENCER_ARP_CHORD     // all the notes at once, on consecutive voices
+} SequencerArpMode;
+
+/**
+ * @struct SequencerChord
+ * @brief A chord shape, played from the note of a step.
+ */
+typedef struct SequencerChord {
+  /**
+   * @brief The number of notes in the chord (1-SEQUENCER_CHORD_MAX_NOTES).
+   */
+  uint8_t notes;
+
+  /**
+   * @brief The notes in semitones from the step note, lowest first.
+   */
+  int8_t intervals[SEQUENCER_CHORD_MAX_NOTES];
+} SequencerChord;
+
+/**
+ * @struct SequencerArp
+ * @brief The settings of an arpeggiator, attached to a track.
+ *
+ * A note of the track is not played itself: it starts the arpeggio of
+ * a chord built on it, which runs until the gate of the step ends, the
+ * track releases, or the next note of the track replaces it.
+ */
+typedef struct SequencerArp {
+  /**
+   * @brief The order of the notes, one of SequencerArpMode.
+   */
+  uint8_t mode;
+
+  /**
+   * @brief The number of octaves the arpeggio spans, 0 for one.
+   */
+  uint8_t octaves;
+
+  /**
+   * @brief The spacing of the notes in ticks (SEQUENCER_TICKS_PER_STEP
+   * per step), 0 for one step.
+   */
+  uint8_t ticks;
+
+  /**
+   * @brief The length of the notes in percent of their spacing, 0 to
+   * hold each note until the next one.
+   */
+  uint8_t gate;
+
+  /**
+   * @brief The chord memory, selected by the chord field of the steps.
+   * NULL to arpeggiate the step note alone, over the octaves.
+   */
+  const SequencerChord *chords;
+
+  /**
+   * @brief The number of chords.
+   */
+  uint8_t chord_count;
+} SequencerArp;
+
+/**
+ * @struct SequencerGroove
+ * @brief A timing template applied to the steps of a track.
+ *
+ * The template repeats every length steps of the sequencer grid, so a
+ * two-step template with a delayed second step gives a classic swing.
+ */
+typedef struct SequencerGroove {
+  /**
+   * @brief The number of steps in the template (1-SEQUENCER_GROOVE_MAX_STEPS).
+   */
+  uint8_t length;
+
+  /**
+   * @brief The timing offset of each step, in percent of a step.
+   */
+  int8_t offsets[SEQUENCER_GROOVE_MAX_STEPS];
+} SequencerGroove;
+
+/**
+ * @struct SequencerTrack
+ * @brief The data, timing and playback position of a track.
+ */
+typedef struct SequencerTrack {
+  const int16_t *notes;           // notes of the track, used when steps is NULL
+  const SequencerStep *steps;     // steps of the track
+  uint16_t length;                // length of the track in steps
+  uint8_t divider;                // number of sequencer beats per track step
+  const SequencerGroove *groove;  // timing template, NULL for straight timing
+  uint8_t drum;                   // drum voice played by the track, SEQUENCER_NO_DRUM for none
+  uint8_t sampler;                // sampler voice played by the track, SEQUENCER_NO_SAMPLER for none
+
+  // Schedule, precomputed whenever the timing changes
+  int32_t  groove_frames[SEQUENCER_GROOVE_MAX_STEPS]; // start of each step from the start of the cycle
+  uint8_t  groove_length;         // number of steps in a groove cycle
+  uint64_t cycle_frames_q8;       // duration of a groove cycle (Q8)
+  uint32_t step_frames;           // duration of a track step
+
+  // Playback position
+  uint16_t position;              // position of the next step in the track
+  uint8_t  groove_pos;            // position of the next step in the groove cycle
+  uint32_t cycle;                 // groove cycles since the anchor frame
+  uint32_t anchor_frame;          // frame the groove cycles are counted from
+  uint32_t cycle_frame;           // frame of the current groove cycle
+  uint32_t next_frame;            // frame of the next step
+  uint32_t count;                 // steps scheduled since the sequencer started
+  uint32_t beat;                  // sequencer beat of the next step
+
+  // Pattern queued to replace the notes or steps at a bar boundary
+  const int16_t *next_notes;      // notes of the queued pattern, used when next_steps is NULL
+  const SequencerStep *next_steps; // steps of the queued pattern
+  uint16_t next_length;           // length of the queued pattern in steps
+  uint8_t  next_divider;          // number of sequencer beats per step of the queued pattern
+  bool     pending;               // flag indicating whether a pattern is queued
+  uint32_t switch_beat;           // sequencer beat from which the queued pattern plays
+
+  // Arpeggiator, generating the notes between the steps
+  const SequencerArp *arp;        // arpeggiator settings, NULL to play the notes as they are
+  const SequencerChord *arp_chord; // chord of the note being arpeggiated, NULL for the note alone
+  bool     arp_active;            // flag indicating whether a note is being arpeggiated
+  bool     arp_gated;             // flag indicating whether the arpeggio ends at arp_end_frame
+  uint16_t arp_root;              // note being arpeggiated (Hz)
+  uint16_t arp_velocity;          // velocity of the arpeggio
+  uint32_t arp_index;             // arpeggio notes played since the step
+  uint32_t arp_origin;            // frame the arpeggio notes are counted from
+  uint32_t arp_count;             // arpeggio notes since arp_origin
+  uint32_t arp_next_frame;        // frame of the next arpeggio note
+  uint32_t arp_end_frame;         // frame the gate of the step ends at
+} SequencerTrack;
+
 /**
  * @struct Sequencer
  * @brief Represents a sequencer object.
+ *
+ * The functions without a Sequencer parameter use the default sequencer,
+ * which plays the default synth instance and drives the audio output,
+ * its timer and the clock sync. Other sequencers are set up with
+ * sequencer_init_ctx() and advanced with sequencer_task_ctx() by the
+ * code rendering their synth.
  */
 typedef struct Sequencer {
   /**
@@ -31,24 +277,135 @@ typedef struct Sequencer {
   uint16_t  track_length;
 
   /**
-   * @brief The start time of the sequencer in microseconds.
+   * @brief The synth frame of the first step.
+   */
+  uint32_t start_frame;
+
+  /**
+   * @brief The index of the step the start frame refers to.
+   */
+  uint32_t start_step;
+
+  /**
+   * @brief The number of steps scheduled since the sequencer was started.
+   */
+  uint32_t step;
+
+  /**
+   * @brief The synth frame of the next step to be scheduled.
+   */
+  uint32_t next_step_frame;
+
+  /**
+   * @brief How far ahead of the renderer events are scheduled, in frames.
    */
-  uint64_t start_time;
+  uint32_t lookahead_frames;
 
   /**
    * @brief The beat duration in milliseconds.
    */
   uint16_t beat_ms;
 
+  /**
+   * @brief The beat duration in frames (Q8).
+   */
+  uint32_t step_frames_q8;
+
   /**
    * @brief Flag indicating whether the sequencer is playing.
    */
   bool playing;
 
+  /**
+   * @brief Flag indicating whether the sequencer is paused, see sequencer_resume().
+   */
+  bool paused;
+
+  /**
+   * @brief The synth frame playback was paused at.
+   */
+  uint32_t pause_frame;
+
   /**
    * @brief Flag indicating whether the sequencer should loop.
    */
   bool loop;
+
+  /**
+   * @brief Flag indicating whether the audio output and the timer are running.
+   *
+   * They keep running after the sequencer stops, until the release of
+   * the last notes and the effect tails have been played.
+   */
+  bool running;
+
+  /**
+   * @brief Flag indicating whether the synth has been silent since silent_frame.
+   */
+  bool silent;
+
+  /**
+   * @brief The synth frame the synth went silent at after the sequencer stopped.
+   */
+  uint32_t silent_frame;
+
+  /**
+   * @brief Flag indicating whether the sequencer drives the audio output.
+   * Only the default sequencer does.
+   */
+  bool output;
+
+  /**
+   * @brief The last output buffer the timer rendered, so a buffer is
+   * never rendered twice.
+   */
+  void *last_buffer;
+
+  /**
+   * @brief The number of output buffers played when the timer last
+   * rendered, to count the underruns.
+   */
+  uint32_t last_played;
+
+  /**
+   * @brief The synth instance played by the sequencer.
+   */
+  Synth *synth;
+
+  /**
+   * @brief The tracks of the sequencer, one per voice.
+   */
+  SequencerTrack tracks[CHANNEL_COUNT];
+
+  /**
+   * @brief The number of voices in the sequencer.
+   */
+  uint8_t num_voices;
+
+  /**
+   * @brief Bitmask of the parameters currently locked on each voice.
+   */
+  uint16_t locked_params[CHANNEL_COUNT];
+
+  /**
+   * @brief Bitmask of the parameters whose default value has been saved.
+   */
+  uint16_t saved_params[CHANNEL_COUNT];
+
+  /**
+   * @brief The values locked parameters are restored to.
+   */
+  uint16_t param_defaults[CHANNEL_COUNT][PARAM_COUNT];
+
+  /**
+   * @brief The state of the PRNG used for step probabilities.
+   */
+  uint32_t prng_state;
+
+  /**
+   * @brief The repeating timer of the sequencer driving the audio output.
+   */
+  repeating_timer_t timer;
 } Sequencer;
 
 /**
@@ -60,6 +417,96 @@ typedef struct Sequencer {
  */
 void sequencer_init(uint8_t _num_voices, const int16_t *notes, uint16_t length);
 
+/**
+ * @brief Initializes the sequencer module with a sequence of steps.
+ *
+ * @param _num_voices The number of voices to initialize.
+ * @param steps The steps to be played by the sequencer, one row of length steps per voice.
+ * @param length The length of the track in beats.
+ */
+void sequencer_init_steps(uint8_t _num_voices, const SequencerStep *steps, uint16_t length);
+
+/**
+ * @brief Sets the notes played by a track.
+ *
+ * Tracks have their own length and clock divider, so tracks of different
+ * lengths can be combined into polymeters.
+ *
+ * @param track The track to set, the voice it plays.
+ * @param notes The notes to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_set_track_notes(uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Sets the steps played by a track.
+ *
+ * @param track The track to set, the voice it plays.
+ * @param steps The steps to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_set_track_steps(uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Makes a track play a drum voice instead of its synth voice.
+ *
+ * Every note on the track hits the drum voice with the step velocity;
+ * releases, gates and parameter locks are ignored.
+ *
+ * @param track The track to set.
+ * @param drum The index of the drum voice, or SEQUENCER_NO_DRUM to play the synth voice.
+ */
+void sequencer_set_track_drum(uint8_t track, uint8_t drum);
+
+/**
+ * @brief Makes a track play a sampler voice instead of its synth voice.
+ *
+ * Notes play the sample at their pitch with the step velocity; releases
+ * and gates release the sampler voice. Parameter locks are ignored.
+ *
+ * @param track The track to set.
+ * @param voice The index of the sampler voice, or SEQUENCER_NO_SAMPLER to play the synth voice.
+ */
+void sequencer_set_track_sampler(uint8_t track, uint8_t voice);
+
+/**
+ * @brief Attaches an arpeggiator to a track.
+ *
+ * The notes of the track start arpeggios of the chords of the
+ * arpeggiator; parameter locks still apply to the voice. With
+ * SEQUENCER_ARP_CHORD, the chord plays on the voice of the track and
+ * the following ones. Drum tracks ignore the arpeggiator.
+ *
+ * @param track The track to set.
+ * @param arp The arpeggiator settings, NULL to play the notes as they are.
+ */
+void sequencer_set_track_arp(uint8_t track, const SequencerArp *arp);
+
+/**
+ * @brief Sets the groove template of all tracks.
+ *
+ * @param groove The groove template, NULL for straight timing.
+ */
+void sequencer_set_groove(const SequencerGroove *groove);
+
+/**
+ * @brief Sets the groove template of a track.
+ *
+ * @param track The track to set.
+ * @param groove The groove template, NULL for straight timing.
+ */
+void sequencer_set_track_groove(uint8_t track, const SequencerGroove *groove);
+
+/**
+ * @brief Fills a groove template with a swing.
+ *
+ * @param groove The groove template to fill.
+ * @param percent The swing amount, 50 for straight timing, 66 for triplet feel.
+ */
+void sequencer_groove_swing(SequencerGroove *groove, uint8_t percent);
+
 /**
  * @brief Starts the sequencer.
  *
@@ -69,9 +516,60 @@ void sequencer_start(bool loop);
 
 /**
  * @brief Stops the sequencer.
+ *
+ * The notes playing are released: the audio output keeps running until
+ * their release and the effect tails are over, then stops.
  */
 void sequencer_stop();
 
+/**
+ * @brief Pauses the sequencer.
+ *
+ * The steps already scheduled are played and the notes are released
+ * after them. The playback position is kept for sequencer_resume().
+ */
+void sequencer_pause();
+
+/**
+ * @brief Resumes a paused sequencer.
+ *
+ * The steps keep their spacing across the pause: the step following the
+ * pause frame is played as early as the render clock allows.
+ */
+void sequencer_resume();
+
+/**
+ * @brief Queues notes to replace those of a track at the next bar.
+ *
+ * The track switches to the new notes on its first step starting on or
+ * after the next bar boundary, and plays them from the beginning. A
+ * stopped sequencer switches immediately.
+ *
+ * @param track The track to set, the voice it plays.
+ * @param notes The notes to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_queue_track_notes(uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Queues steps to replace those of a track at the next bar.
+ *
+ * @param track The track to set, the voice it plays.
+ * @param steps The steps to be played by the track.
+ * @param length The length of the track in steps.
+ * @param divider The number of sequencer beats per step of the track.
+ */
+void sequencer_queue_track_steps(uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Queues a pattern for all tracks at the next bar.
+ *
+ * @param steps The steps to be played, one row of length steps per voice.
+ * @param length The length of the pattern in steps.
+ */
+void sequencer_queue_pattern(const SequencerStep *steps, uint16_t length);
+
 /**
  * @brief Executes the sequencer task.
  */
@@ -84,6 +582,28 @@ void sequencer_task();
  */
 void sequencer_set_tempo(uint16_t bpm);
 
+/**
+ * @brief Sets the tempo of the sequencer as a step duration.
+ *
+ * Used by the clock sync module, which needs more resolution than
+ * whole beats per minute.
+ *
+ * @param step_frames_q8 The step duration in frames (Q8).
+ */
+void sequencer_set_step_frames(uint32_t step_frames_q8);
+
+/**
+ * @brief Changes the sample rate of the synth and of the audio output.
+ *
+ * Stops playback. The tempo is kept.
+ *
+ * @param sample_rate The sample rate of the audio output.
+ * @param divider The ratio between the output and the internal rate: 1, 2 or 4.
+ *
+ * @return True if the rate was changed, false if the divider is not supported.
+ */
+bool sequencer_set_sample_rate(uint32_t sample_rate, uint8_t divider);
+
 /**
  * @brief Sets the callback function to be executed when the sequencer finishes playing.
  *
@@ -100,6 +620,134 @@ void sequencer_set_callback(void (*callback)(void *user_data));
  */
 bool seq_timer_callback(repeating_timer_t *timer);
 
+/**
+ * @brief Gets the default sequencer.
+ *
+ * @return The sequencer used by the functions without a Sequencer parameter.
+ */
+Sequencer * sequencer_get_default();
+
+/**
+ * @brief Initializes a sequencer playing a synth instance.
+ *
+ * @param seq The sequencer.
+ * @param synth The synth instance to play, initialized with synth_init_ctx().
+ * @param _num_voices The number of voices to initialize.
+ * @param notes The notes to be played by the sequencer.
+ * @param length The length of the track in beats.
+ */
+void sequencer_init_ctx(Sequencer *seq, Synth *synth, uint8_t _num_voices, const int16_t *notes, uint16_t length);
+
+/**
+ * @brief Initializes a sequencer playing a synth instance with a sequence of steps.
+ *
+ * @param seq The sequencer.
+ * @param synth The synth instance to play.
+ * @param _num_voices The number of voices to initialize.
+ * @param steps The steps to be played by the sequencer, one row of length steps per voice.
+ * @param length The length of the track in beats.
+ */
+void sequencer_init_steps_ctx(Sequencer *seq, Synth *synth, uint8_t _num_voices, const SequencerStep *steps, uint16_t length);
+
+/**
+ * @brief Sets the notes played by a track of a sequencer.
+ */
+void sequencer_set_track_notes_ctx(Sequencer *seq, uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Sets the steps played by a track of a sequencer.
+ */
+void sequencer_set_track_steps_ctx(Sequencer *seq, uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Makes a track of a sequencer play a drum voice instead of its synth voice.
+ */
+void sequencer_set_track_drum_ctx(Sequencer *seq, uint8_t track, uint8_t drum);
+
+/**
+ * @brief Makes a track of a sequencer play a sampler voice instead of its synth voice.
+ */
+void sequencer_set_track_sampler_ctx(Sequencer *seq, uint8_t track, uint8_t voice);
+
+/**
+ * @brief Attaches an arpeggiator to a track of a sequencer.
+ */
+void sequencer_set_track_arp_ctx(Sequencer *seq, uint8_t track, const SequencerArp *arp);
+
+/**
+ * @brief Sets the groove template of all tracks of a sequencer.
+ */
+void sequencer_set_groove_ctx(Sequencer *seq, const SequencerGroove *groove);
+
+/**
+ * @brief Sets the groove template of a track of a sequencer.
+ */
+void sequencer_set_track_groove_ctx(Sequencer *seq, uint8_t track, const SequencerGroove *groove);
+
+/**
+ * @brief Starts a sequencer.
+ */
+void sequencer_start_ctx(Sequencer *seq, bool loop);
+
+/**
+ * @brief Stops a sequencer, releasing the notes playing.
+ */
+void sequencer_stop_ctx(Sequencer *seq);
+
+/**
+ * @brief Pauses a sequencer.
+ */
+void sequencer_pause_ctx(Sequencer *seq);
+
+/**
+ * @brief Resumes a paused sequencer.
+ */
+void sequencer_resume_ctx(Sequencer *seq);
+
+/**
+ * @brief Queues notes to replace those of a track of a sequencer at the next bar.
+ */
+void sequencer_queue_track_notes_ctx(Sequencer *seq, uint8_t track, const int16_t *notes, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Queues steps to replace those of a track of a sequencer at the next bar.
+ */
+void sequencer_queue_track_steps_ctx(Sequencer *seq, uint8_t track, const SequencerStep *steps, uint16_t length, uint8_t divider);
+
+/**
+ * @brief Queues a pattern for all tracks of a sequencer at the next bar.
+ */
+void sequencer_queue_pattern_ctx(Sequencer *seq, const SequencerStep *steps, uint16_t length);
+
+/**
+ * @brief Queues the events of a sequencer due before its lookahead horizon.
+ *
+ * Sequencers that do not drive the audio output must be advanced by
+ * calling this before rendering their synth.
+ */
+void sequencer_task_ctx(Sequencer *seq);
+
+/**
+ * @brief Sets the tempo of a sequencer.
+ */
+void sequencer_set_tempo_ctx(Sequencer *seq, uint16_t bpm);
+
+/**
+ * @brief Sets the tempo of a sequencer as a step duration (Q8).
+ */
+void sequencer_set_step_frames_ctx(Sequencer *seq, uint32_t step_frames_q8);
+
+/**
+ * @brief Changes the sample rate of the synth of a sequencer, and of the
+ * audio output if the sequencer drives it.
+ */
+bool sequencer_set_sample_rate_ctx(Sequencer *seq, uint32_t sample_rate, uint8_t divider);
+
+/**
+ * @brief Sets the callback function of a sequencer, called with the sequencer.
+ */
+void sequencer_set_callback_ctx(Sequencer *seq, void (*callback)(void *user_data));
+
 #ifdef __cplusplus
 }
 #endif
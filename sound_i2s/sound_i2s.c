@@ -7,20 +7,30 @@
 #include "hardware/pio.h"
 #include "hardware/dma.h"
 #include "hardware/irq.h"
+#include "hardware/clocks.h"
 
 #include "sound_i2s.h"
 #include "sound_i2s_8bits.pio.h"
 #include "sound_i2s_16bits.pio.h"
+#include "sound_i2s_32bits.pio.h"
 
 volatile unsigned int sound_i2s_num_buffers_played = 0;
 
 static struct sound_i2s_config config;
 static PIO sound_pio;
 static uint sound_pio_sm;
+static uint sound_pio_offset;
 static uint sound_dma_chan;
 
 static volatile int sound_cur_buffer_num;
 static void *sound_sample_buffers[2];
+static size_t sound_buffer_size;
+
+// bits per channel slot: 24 bit samples are sent in 32 bit slots
+static uint slot_bits(void)
+{
+  return (config.bits_per_sample > 16) ? 32 : config.bits_per_sample;
+}
 
 static void __isr __time_critical_func(dma_handler)(void)
 {
@@ -41,7 +51,7 @@ int sound_i2s_init(const struct sound_i2s_config *cfg)
   config = *cfg;
 
   // allocate sound buffers
-  size_t sound_buffer_size = (config.bits_per_sample/8) * 2 * SOUND_I2S_BUFFER_NUM_SAMPLES;
+  sound_buffer_size = (slot_bits()/8) * 2 * SOUND_I2S_BUFFER_NUM_SAMPLES;
   sound_sample_buffers[0] = malloc(sound_buffer_size);
   sound_sample_buffers[1] = malloc(sound_buffer_size);
   if (! sound_sample_buffers[0] || ! sound_sample_buffers[1]) {
@@ -54,12 +64,16 @@ int sound_i2s_init(const struct sound_i2s_config *cfg)
 
   // setup pio
   sound_pio = (config.pio_num == 0) ? pio0 : pio1;
-  uint offset = pio_add_program(sound_pio, (config.bits_per_sample == 8) ? &sound_i2s_8bits_program : &sound_i2s_16bits_program);
   sound_pio_sm = pio_claim_unused_sm(sound_pio, true);
-  if (config.bits_per_sample == 8) {
+  if (slot_bits() == 8) {
+    uint offset = sound_pio_offset = pio_add_program(sound_pio, &sound_i2s_8bits_program);
     sound_i2s_8bits_program_init(sound_pio, sound_pio_sm, offset, config.sample_rate, config.pin_sda, config.pin_scl);
-  } else {
+  } else if (slot_bits() == 16) {
+    uint offset = sound_pio_offset = pio_add_program(sound_pio, &sound_i2s_16bits_program);
     sound_i2s_16bits_program_init(sound_pio, sound_pio_sm, offset, config.sample_rate, config.pin_sda, config.pin_scl);
+  } else {
+    uint offset = sound_pio_offset = pio_add_program(sound_pio, &sound_i2s_32bits_program);
+    sound_i2s_32bits_program_init(sound_pio, sound_pio_sm, offset, config.sample_rate, config.pin_sda, config.pin_scl);
   }
 
   // allocate dma channel and setup irq
@@ -83,18 +97,31 @@ void sound_i2s_playback_start(void)
 
   // setup dma channel
   dma_channel_config dma_cfg = dma_channel_get_default_config(sound_dma_chan);
-  channel_config_set_transfer_data_size(&dma_cfg, (config.bits_per_sample == 8) ? DMA_SIZE_16 : DMA_SIZE_32);
+  channel_config_set_transfer_data_size(&dma_cfg, (slot_bits() == 8) ? DMA_SIZE_16 : DMA_SIZE_32);
   channel_config_set_read_increment(&dma_cfg, true);
   channel_config_set_write_increment(&dma_cfg, false);
   channel_config_set_dreq(&dma_cfg, pio_get_dreq(sound_pio, sound_pio_sm, true));
   dma_channel_configure(sound_dma_chan, &dma_cfg,
                         &sound_pio->txf[sound_pio_sm],  // destination
                         buffer,                         // source
-                        SOUND_I2S_BUFFER_NUM_SAMPLES,   // number of dma transfers
+                        (slot_bits() == 32) ? 2 * SOUND_I2S_BUFFER_NUM_SAMPLES : SOUND_I2S_BUFFER_NUM_SAMPLES, // number of dma transfers
                         true                            // start immediatelly (will be blocked by pio)
                         );
 }
 
+// stops the dma and the bit clock, e.g. once silence has been played,
+// so neither the dma irq nor the pio run while idle
+void sound_i2s_playback_stop(void)
+{
+  dma_channel_abort(sound_dma_chan);
+  dma_hw->ints0 = 1u << sound_dma_chan;
+  pio_sm_set_enabled(sound_pio, sound_pio_sm, false);
+  // the next start begins with a left slot
+  pio_sm_clear_fifos(sound_pio, sound_pio_sm);
+  pio_sm_restart(sound_pio, sound_pio_sm);
+  pio_sm_exec(sound_pio, sound_pio_sm, pio_encode_jmp(sound_pio_offset));
+}
+
 void *sound_i2s_get_next_buffer(void)
 {
   return sound_sample_buffers[1-sound_cur_buffer_num];
@@ -104,3 +131,24 @@ void *sound_i2s_get_buffer(int buffer_num)
 {
   return sound_sample_buffers[buffer_num];
 }
+
+int sound_i2s_get_bits_per_sample(void)
+{
+  return config.bits_per_sample;
+}
+
+void sound_i2s_clear_buffers(void)
+{
+  memset(sound_sample_buffers[0], 0, sound_buffer_size);
+  memset(sound_sample_buffers[1], 0, sound_buffer_size);
+}
+
+// changes the bit clock, e.g. while playback is stopped
+void sound_i2s_set_sample_rate(uint32_t sample_rate)
+{
+  config.sample_rate = sample_rate;
+  uint f_clk_sys = frequency_count_khz(CLOCKS_FC0_SRC_VALUE_CLK_SYS);
+  // the same divider as the *_program_init of the loaded program
+  uint frame_bits = (slot_bits() == 32) ? 64 : 32;
+  pio_sm_set_clkdiv(sound_pio, sound_pio_sm, (f_clk_sys * 1000.f) / (sample_rate * frame_bits * 2.0f));
+}
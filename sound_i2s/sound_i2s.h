@@ -16,14 +16,18 @@ struct sound_i2s_config {
   uint8_t  pin_scl;
   uint8_t  pin_sda;
   uint8_t  pin_ws;
-  uint16_t sample_rate;
+  uint32_t sample_rate;
   uint8_t  bits_per_sample;
 };
 
 int sound_i2s_init(const struct sound_i2s_config *cfg);
 void sound_i2s_playback_start(void);
+void sound_i2s_playback_stop(void);
 void *sound_i2s_get_next_buffer(void);
 void *sound_i2s_get_buffer(int buffer_num);
+int sound_i2s_get_bits_per_sample(void);
+void sound_i2s_clear_buffers(void);
+void sound_i2s_set_sample_rate(uint32_t sample_rate);
 
 extern volatile unsigned int sound_i2s_num_buffers_played;
 
@@ -2,46 +2,185 @@
 #include "sound_pwm.h"
 #include "synth.h"
 #include "sequencer.h"
+#include "telemetry.h"
 
 #include "hardware/pwm.h"
 #include "hardware/clocks.h"
+#include "hardware/dma.h"
 #include "hardware/irq.h"
 
+// The PWM levels are written by DMA, one per PWM period, from two
+// buffers: while one is played the other one is rendered, a whole
+// buffer at a time.
+//
+// Samples are mapped to levels with an offset, so silence is a 50% duty
+// cycle, and quantized with an error feedback loop that moves the
+// quantization noise above the audio band. In dual mode, a second PWM
+// channel, mixed through a resistor 2^fine_bits times larger, plays the
+// bits the first one can not resolve.
+
 static uint8_t slice_num;
 static uint8_t audio_gpio;
 static uint8_t pwm_channel;
+static uint dma_chan;
+static bool dual = false;
+static uint8_t fine_bits = 0;
+static uint32_t idle_level;
 
-void sound_pwm_init(uint16_t audio_pin, uint32_t sample_rate) {
-  audio_gpio = audio_pin;
+static uint32_t buffers[2][SAMPLES_PER_BUFFER];
+static volatile uint8_t cur_buffer = 0;
 
-  gpio_set_function(audio_pin, GPIO_FUNC_PWM);
-  slice_num = pwm_gpio_to_slice_num(audio_pin);
+static enum PwmDither dither = PWM_DITHER_SHAPED;
+static uint32_t span;           // number of output steps
+static uint32_t scale;          // sample to step factor (Q8 steps per sample unit)
+static int32_t error[2];        // quantization errors of the last two frames (Q8)
+static uint32_t dither_state = 0x2545F491;
+
+// Converts a step to the value of the compare register
+static inline uint32_t step_to_cc(uint32_t step) {
+  if(dual) {
+    return (step >> fine_bits) | ((step & ((1u << fine_bits) - 1)) << 16);
+  }
+  return step | (step << 16);
+}
+
+// Converts rendered samples to compare register values
+static void SYNTH_RAM_FUNC(convert)(uint32_t *out, const int16_t *samples, uint32_t frames) {
+  int32_t e1 = error[0], e2 = error[1];
+  uint32_t x = dither_state;
+  int32_t top = span - 1;
 
-  pwm_clear_irq(slice_num);
-  pwm_set_irq_enabled(slice_num, true);
-  irq_set_exclusive_handler(PWM_IRQ_WRAP, pwm_isr);
-  irq_set_enabled(PWM_IRQ_WRAP, true);
+  for(uint32_t i = 0; i < frames; i++) {
+    int32_t v = (int32_t)((uint32_t)(samples[i] + 0x8000) * scale);
+    int32_t d = 0;
+    if(dither != PWM_DITHER_NONE) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      d = (int32_t)(x & 0xff) - (int32_t)((x >> 8) & 0xff); // triangular, +-1 step
+    }
+    if(dither == PWM_DITHER_SHAPED) {
+      v -= 2 * e1 - e2;
+    }
+    int32_t step = (v + d) >> 8;
+    step = MIN(MAX(step, 0), top);
+    e2 = e1;
+    e1 = MIN(MAX((step << 8) - v, -0x400), 0x400);
+    out[i] = step_to_cc(step);
+  }
 
-  static const uint16_t wrap = 2048;
-  pwm_set_clkdiv(slice_num, clock_get_hz(clk_sys) / (float)(wrap * sample_rate));
+  error[0] = e1;
+  error[1] = e2;
+  dither_state = x;
+}
+
+// Renders a buffer
+static void SYNTH_RAM_FUNC(fill_buffer)(uint32_t *buffer) {
+  int16_t block[SYNTH_BLOCK_SIZE];
+  for(uint32_t i = 0; i < SAMPLES_PER_BUFFER; i += SYNTH_BLOCK_SIZE) {
+    uint32_t frames = MIN(SYNTH_BLOCK_SIZE, SAMPLES_PER_BUFFER - i);
+    synth_render(block, frames);
+    convert(&buffer[i], block, frames);
+  }
+}
+
+static void __isr SYNTH_RAM_FUNC(dma_handler)(void) {
+  // play the buffer rendered last, and render the one just played
+  uint8_t played = cur_buffer;
+  cur_buffer = !played;
+  dma_hw->ch[dma_chan].al3_read_addr_trig = (uintptr_t)buffers[cur_buffer];
+  dma_hw->ints0 = 1u << dma_chan;
+  TELEMETRY_RENDER_BEGIN();
+  fill_buffer(buffers[played]);
+  TELEMETRY_RENDER_END(SAMPLES_PER_BUFFER);
+#if SYNTH_TELEMETRY
+  // the buffer playing ended before this one was ready
+  if(!dma_channel_is_busy(dma_chan)) { TELEMETRY_UNDERRUN(); }
+#endif
+}
+
+// Sets the PWM period and the levels for a sample rate
+static void set_timing(uint32_t sample_rate) {
+  // the highest resolution the sample rate allows
+  uint32_t cycles = clock_get_hz(clk_sys) / sample_rate;
+  uint32_t div = (cycles + 0x7fff) / 0x8000;
+  uint32_t wrap = cycles / div - 1;
+  pwm_set_clkdiv_int_frac(slice_num, div, 0);
   pwm_set_wrap(slice_num, wrap);
 
+  span = (wrap + 1) << fine_bits;
+  scale = span >> 8;
+  error[0] = error[1] = 0;
+  idle_level = step_to_cc(span / 2);
+  for(uint8_t b = 0; b < 2; b++) {
+    for(uint32_t i = 0; i < SAMPLES_PER_BUFFER; i++) { buffers[b][i] = idle_level; }
+  }
+  pwm_hw->slice[slice_num].cc = idle_level;
+}
+
+static void init(uint16_t audio_pin, uint32_t sample_rate) {
+  audio_gpio = audio_pin;
+  gpio_set_function(audio_pin, GPIO_FUNC_PWM);
+  slice_num = pwm_gpio_to_slice_num(audio_pin);
   pwm_channel = pwm_gpio_to_channel(audio_pin);
-  pwm_set_chan_level(slice_num, pwm_channel, 0);
+  set_timing(sample_rate);
+
+  dma_chan = dma_claim_unused_channel(true);
+  dma_channel_set_irq0_enabled(dma_chan, true);
+  irq_set_exclusive_handler(DMA_IRQ_0, dma_handler);
+  irq_set_priority(DMA_IRQ_0, 0xff);
+  irq_set_enabled(DMA_IRQ_0, true);
+
   pwm_set_enabled(slice_num, true);
 }
 
+void sound_pwm_init(uint16_t audio_pin, uint32_t sample_rate) {
+  dual = false;
+  fine_bits = 0;
+  init(audio_pin, sample_rate);
+}
+
+// audio_pin must be the A channel of a slice (an even GPIO). The fine
+// channel is on the next GPIO, mixed through a resistor 2^fine_bits
+// times the one of audio_pin.
+void sound_pwm_init_dual(uint16_t audio_pin, uint32_t sample_rate, uint8_t _fine_bits) {
+  dual = true;
+  fine_bits = MIN(_fine_bits, 8);
+  gpio_set_function(audio_pin + 1, GPIO_FUNC_PWM);
+  init(audio_pin, sample_rate);
+}
+
+// Must be called while stopped: the buffers are reset to the idle level
+void sound_pwm_set_sample_rate(uint32_t sample_rate) {
+  set_timing(sample_rate);
+}
+
+void sound_pwm_set_dither(enum PwmDither _dither) {
+  dither = _dither;
+}
+
 void sound_pwm_start() {
+  cur_buffer = 0;
+  fill_buffer(buffers[0]);
+  fill_buffer(buffers[1]);
+
+  dma_channel_config dma_cfg = dma_channel_get_default_config(dma_chan);
+  channel_config_set_transfer_data_size(&dma_cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&dma_cfg, true);
+  channel_config_set_write_increment(&dma_cfg, false);
+  channel_config_set_dreq(&dma_cfg, pwm_get_dreq(slice_num));
+  dma_channel_configure(dma_chan, &dma_cfg,
+                        &pwm_hw->slice[slice_num].cc, // destination
+                        buffers[0],                   // source
+                        SAMPLES_PER_BUFFER,           // number of dma transfers
+                        true                          // start immediately (paced by the pwm wrap)
+                        );
   pwm_set_enabled(slice_num, true);
 }
 
 void sound_pwm_stop() {
-  pwm_set_chan_level(slice_num, pwm_channel, 0);
-  pwm_set_enabled(slice_num, false);
+  dma_channel_abort(dma_chan);
+  dma_hw->ints0 = 1u << dma_chan;
+  // rest at the middle level, where the output settles when idle
+  pwm_hw->slice[slice_num].cc = idle_level;
 }
-
-void pwm_isr() {
-  pwm_clear_irq(slice_num);
-  uint16_t level = get_audio_frame();
-  pwm_set_chan_level(slice_num, pwm_channel, level);  
-}
\ No newline at end of file
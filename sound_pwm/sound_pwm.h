@@ -8,12 +8,19 @@ extern "C" {
 
 #define SAMPLES_PER_BUFFER 256
 
-extern void update_playback(void);
+// Dithering of the PWM levels
+enum PwmDither {
+  PWM_DITHER_NONE,    // plain truncation
+  PWM_DITHER_FLAT,    // triangular dither, white noise floor
+  PWM_DITHER_SHAPED   // triangular dither with second order noise shaping
+};
 
 void sound_pwm_init(uint16_t audio_pin, uint32_t sample_rate);
+void sound_pwm_init_dual(uint16_t audio_pin, uint32_t sample_rate, uint8_t fine_bits);
+void sound_pwm_set_sample_rate(uint32_t sample_rate);
+void sound_pwm_set_dither(enum PwmDither dither);
 void sound_pwm_start();
 void sound_pwm_stop();
-void pwm_isr();
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,333 @@
+/**
+ * @file drums.c
+ * @brief Implementation of the drum voices module.
+ */
+
+#include "pico/stdlib.h"
+#include "drums.h"
+#include "synth.h"
+
+/**
+ * @brief The drum voices.
+ */
+DrumVoice drums[DRUM_VOICE_COUNT];
+
+/**
+ * @brief The number of drum voices in use.
+ */
+static uint8_t num_drum_voices = 0;
+
+/**
+ * @brief Amplitude below which a voice is considered silent.
+ */
+#define DRUM_SILENCE 16
+
+/**
+ * @brief Number of clap bursts, and the time between them.
+ */
+#define CLAP_BURSTS 3
+#define CLAP_BURST_MS 10
+
+extern const int16_t sine_waveform[256];
+
+/**
+ * @brief Computes the per-frame factor of an exponential decay.
+ *
+ * Uses the first order approximation of exp(ln(1/1000) / frames),
+ * which is close enough for decays longer than a few frames.
+ *
+ * @param decay_ms The time for the envelope to fall by 60dB.
+ *
+ * @return The decay factor (Q16).
+ */
+static uint32_t decay_factor(uint16_t decay_ms) {
+  uint32_t frames = MAX((uint32_t)decay_ms * get_sample_rate() / 1000, 8);
+  return 65536 - (452710 / frames); // 6.9078 (Q16) / frames
+}
+
+/**
+ * @brief Moves a decay factor to a new sample rate.
+ *
+ * With the first order approximation of decay_factor(), the distance of
+ * the factor to unity is inversely proportional to the sample rate.
+ *
+ * @param k The decay factor at old_rate (Q16).
+ * @param old_rate The sample rate k was computed for.
+ *
+ * @return The decay factor at the current sample rate (Q16).
+ */
+static uint32_t rescale_decay(uint32_t k, uint32_t old_rate) {
+  if(k >= 65536) { return k; }
+  uint64_t distance = (uint64_t)(65536 - k) * old_rate / get_sample_rate();
+  return 65536 - (uint32_t)MIN(distance, 452710 / 8);
+}
+
+/**
+ * @brief Generates the next white noise value.
+ *
+ * @param drum The drum voice holding the generator state.
+ *
+ * @return A value with a uniform distribution over the 16-bit range.
+ */
+static inline int32_t drum_noise(DrumVoice *drum) {
+  uint32_t x = drum->noise_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  drum->noise_state = x;
+  return (int16_t)(x >> 16);
+}
+
+/**
+ * @brief Initializes the drum voices module.
+ *
+ * @param num_drums The number of drum voices to use.
+ *
+ * @return A pointer to the drum voices.
+ */
+DrumVoice * drums_init(uint8_t num_drums) {
+  num_drum_voices = MIN(num_drums, DRUM_VOICE_COUNT);
+  for(uint8_t i = 0; i < num_drum_voices; i++) {
+    drum_init(&drums[i], DRUM_KICK);
+    drums[i].noise_state = 0x5EED1234 + i * 0x9E3779B9;
+  }
+  return drums;
+}
+
+/**
+ * @brief Initializes a drum voice with the default settings of a drum type.
+ *
+ * @param drum The drum voice to initialize.
+ * @param type The drum type, one of DrumType.
+ */
+void drum_init(DrumVoice *drum, uint8_t type) {
+  drum->type         = type;
+  drum->choke_group  = 0;
+  drum->volume       = 0xffff;
+  drum->pitch        = 0;
+  drum->sweep        = 0;
+  drum->tone         = 0;
+  drum->active       = false;
+  drum->amp          = 0;
+  drum->env          = 0;
+  drum->env_decay_ms = 0;
+  drum->filter[0]    = 0;
+  drum->filter[1]    = 0;
+  if(drum->noise_state == 0) { drum->noise_state = 0x5EED1234; }
+
+  switch(type) {
+    case DRUM_KICK:
+      drum->pitch        = 50;
+      drum->sweep        = 150;
+      drum->decay_ms     = 300;
+      drum->env_decay_ms = 40;
+      break;
+    case DRUM_SNARE:
+      drum->pitch        = 180;
+      drum->decay_ms     = 150;
+      drum->env_decay_ms = 60;
+      drum->tone         = 0x6000;
+      break;
+    case DRUM_CLOSED_HAT:
+      drum->decay_ms     = 40;
+      drum->choke_group  = 1;
+      break;
+    case DRUM_OPEN_HAT:
+      drum->decay_ms     = 300;
+      drum->choke_group  = 1;
+      break;
+    case DRUM_CLAP:
+      drum->decay_ms     = 200;
+      drum->env_decay_ms = 8;
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @brief Triggers a drum voice.
+ *
+ * @param drum The index of the drum voice.
+ * @param velocity The velocity of the hit, 0xffff is full.
+ */
+void drums_trigger(uint8_t drum, uint16_t velocity) {
+  if(drum >= num_drum_voices) { return; }
+  DrumVoice *d = &drums[drum];
+
+  // Silence the other voices of the choke group with a quick fade
+  if(d->choke_group) {
+    for(uint8_t i = 0; i < num_drum_voices; i++) {
+      if(i != drum && drums[i].active && drums[i].choke_group == d->choke_group) {
+        drums[i].amp_k = decay_factor(2);
+        drums[i].bursts = 0;
+      }
+    }
+  }
+
+  uint32_t sample_rate = get_sample_rate();
+  d->velocity = velocity;
+  d->amp = velocity;
+  d->amp_k = decay_factor(d->decay_ms);
+  d->env = (d->type == DRUM_KICK || d->type == DRUM_SNARE) ? 0xffff : 0;
+  d->env_k = decay_factor(d->env_decay_ms);
+  d->phase = 0x4000; // start the body at a zero crossing
+  d->increment = ((uint32_t)d->pitch << 16) / sample_rate;
+  d->sweep_increment = ((uint32_t)d->sweep << 16) / sample_rate;
+  d->bursts = 0;
+  if(d->type == DRUM_CLAP) {
+    d->bursts = CLAP_BURSTS - 1;
+    d->burst_timer = CLAP_BURST_MS * sample_rate / 1000;
+  }
+  d->active = true;
+}
+
+/**
+ * @brief Renders a kick: a sine with an exponential pitch sweep.
+ */
+static void SYNTH_RAM_FUNC(render_kick)(DrumVoice *d, int32_t *mix, uint32_t frames, int32_t gain) {
+  uint32_t amp = d->amp, env = d->env, phase = d->phase;
+  for(uint32_t i = 0; i < frames; i++) {
+    phase += d->increment + ((d->sweep_increment * env) >> 16);
+    int32_t sample = sine_waveform[(phase >> 8) & 0xff];
+    mix[i] += ((sample * (int32_t)amp) >> 16) * gain >> 16;
+    amp = (amp * d->amp_k) >> 16;
+    env = (env * d->env_k) >> 16;
+  }
+  d->amp = amp; d->env = env; d->phase = phase;
+}
+
+/**
+ * @brief Renders a snare: a decaying tone mixed with high-passed noise.
+ */
+static void SYNTH_RAM_FUNC(render_snare)(DrumVoice *d, int32_t *mix, uint32_t frames, int32_t gain) {
+  uint32_t amp = d->amp, env = d->env, phase = d->phase;
+  int32_t tone = d->tone, noise_level = 0xffff - d->tone;
+  int32_t velocity = d->velocity;
+  for(uint32_t i = 0; i < frames; i++) {
+    phase += d->increment;
+    int32_t body = (sine_waveform[(phase >> 8) & 0xff] * (int32_t)env) >> 16;
+    body = ((body * velocity) >> 16) * tone >> 16;
+    int32_t white = drum_noise(d);
+    int32_t noise = white - d->filter[0]; // first order high-pass
+    d->filter[0] = white;
+    noise = (((noise >> 1) * (int32_t)amp) >> 16) * noise_level >> 16;
+    mix[i] += (body + noise) * gain >> 16;
+    amp = (amp * d->amp_k) >> 16;
+    env = (env * d->env_k) >> 16;
+  }
+  d->amp = amp; d->env = env; d->phase = phase;
+}
+
+/**
+ * @brief Renders a hi-hat: high-passed noise.
+ */
+static void SYNTH_RAM_FUNC(render_hat)(DrumVoice *d, int32_t *mix, uint32_t frames, int32_t gain) {
+  uint32_t amp = d->amp;
+  int32_t low = d->filter[0];
+  for(uint32_t i = 0; i < frames; i++) {
+    int32_t white = drum_noise(d);
+    low += (white - low) >> 1;
+    mix[i] += ((((white - low) >> 1) * (int32_t)amp) >> 16) * gain >> 16;
+    amp = (amp * d->amp_k) >> 16;
+  }
+  d->amp = amp; d->filter[0] = low;
+}
+
+/**
+ * @brief Renders a clap: a few short noise bursts and a longer tail.
+ */
+static void SYNTH_RAM_FUNC(render_clap)(DrumVoice *d, int32_t *mix, uint32_t frames, int32_t gain) {
+  uint32_t amp = d->amp;
+  int32_t low = d->filter[0], lower = d->filter[1];
+  uint16_t burst_frames = CLAP_BURST_MS * get_sample_rate() / 1000;
+  for(uint32_t i = 0; i < frames; i++) {
+    if(d->bursts && --d->burst_timer == 0) {
+      amp = d->velocity;
+      if(--d->bursts) { d->burst_timer = burst_frames; }
+    }
+    // band-pass: a low-pass, minus a lower low-pass
+    int32_t white = drum_noise(d);
+    low += (white - low) >> 2;
+    lower += (low - lower) >> 5;
+    // the band swings over 16 bits, so its products are taken in 64 bits
+    int64_t band = ((int64_t)(low - lower) * amp) >> 16;
+    mix[i] += (int32_t)((band * gain) >> 16);
+    amp = (amp * (d->bursts ? d->env_k : d->amp_k)) >> 16;
+  }
+  d->amp = amp; d->filter[0] = low; d->filter[1] = lower;
+}
+
+/**
+ * @brief Renders the active drum voices and adds them to the mix.
+ *
+ * @param mix The block to add the drums to.
+ * @param frames The number of frames to render.
+ */
+void SYNTH_RAM_FUNC(drums_render)(int32_t *mix, uint32_t frames) {
+  for(uint8_t i = 0; i < num_drum_voices; i++) {
+    DrumVoice *d = &drums[i];
+    if(!d->active) { continue; }
+
+    int32_t gain = d->volume;
+    switch(d->type) {
+      case DRUM_KICK:       render_kick(d, mix, frames, gain); break;
+      case DRUM_SNARE:      render_snare(d, mix, frames, gain); break;
+      case DRUM_CLOSED_HAT:
+      case DRUM_OPEN_HAT:   render_hat(d, mix, frames, gain); break;
+      case DRUM_CLAP:       render_clap(d, mix, frames, gain); break;
+      default: break;
+    }
+
+    // Early out for the next blocks once the voice has decayed
+    if(d->amp < DRUM_SILENCE && d->env < DRUM_SILENCE && d->bursts == 0) {
+      d->active = false;
+    }
+  }
+}
+
+/**
+ * @brief Moves the playing drum voices to a new sample rate.
+ *
+ * Called by the synth when its sample rate changes. Voices triggered
+ * afterwards are computed for the new rate anyway.
+ *
+ * @param old_rate The previous sample rate.
+ */
+void drums_retarget(uint32_t old_rate) {
+  uint32_t sample_rate = get_sample_rate();
+  for(uint8_t i = 0; i < num_drum_voices; i++) {
+    DrumVoice *d = &drums[i];
+    if(!d->active) { continue; }
+    d->amp_k = rescale_decay(d->amp_k, old_rate);
+    d->env_k = rescale_decay(d->env_k, old_rate);
+    d->increment = ((uint32_t)d->pitch << 16) / sample_rate;
+    d->sweep_increment = ((uint32_t)d->sweep << 16) / sample_rate;
+    d->burst_timer = MAX((uint32_t)d->burst_timer * sample_rate / old_rate, 1);
+  }
+}
+
+/**
+ * @brief Checks if any drum voice is playing.
+ *
+ * @return True if a drum voice is playing, false otherwise.
+ */
+bool SYNTH_RAM_FUNC(drums_playing)() {
+  for(uint8_t i = 0; i < num_drum_voices; i++) {
+    if(drums[i].active) { return true; }
+  }
+  return false;
+}
+
+/**
+ * @brief Counts the drum voices playing.
+ *
+ * @return The number of active drum voices.
+ */
+uint8_t drums_active_count() {
+  uint8_t count = 0;
+  for(uint8_t i = 0; i < num_drum_voices; i++) {
+    count += drums[i].active;
+  }
+  return count;
+}
@@ -0,0 +1,75 @@
+#ifndef DRUMS_H
+#define DRUMS_H
+
+/**
+ * @file drums.h
+ * @brief Header file for the drum voices module.
+ *
+ * Drum voices are lightweight percussion generators with exponential
+ * amplitude and pitch envelopes. They are mixed by the synth renderer
+ * alongside the audio channels, without using any of them, by the
+ * default synth instance only.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DRUM_VOICE_COUNT 6 // Number of maximum drum voices
+
+/**
+ * @enum DrumType
+ * @brief The sound generated by a drum voice.
+ */
+enum DrumType {
+  DRUM_KICK,        // sine with a pitch sweep
+  DRUM_SNARE,       // tone and noise
+  DRUM_CLOSED_HAT,  // short high-passed noise
+  DRUM_OPEN_HAT,    // long high-passed noise
+  DRUM_CLAP         // band-passed noise bursts
+};
+
+/**
+ * @struct DrumVoice
+ * @brief A drum voice, its settings and its state.
+ */
+typedef struct DrumVoice {
+  uint8_t   type;           // one of DrumType
+  uint8_t   choke_group;    // triggering a voice silences the others of its group, 0 for none
+  uint16_t  volume;         // voice volume
+  uint16_t  pitch;          // frequency of the body (Hz)
+  uint16_t  sweep;          // frequency added at the start of the pitch envelope (Hz)
+  uint16_t  decay_ms;       // time for the amplitude to fall by 60dB
+  uint16_t  env_decay_ms;   // pitch envelope (kick), tone (snare) or burst (clap) decay time
+  uint16_t  tone;           // balance between tone (0xffff) and noise (0), snare only
+
+  bool      active;         // false once the voice is silent
+  uint8_t   bursts;         // clap bursts left to play
+  uint16_t  burst_timer;    // frames until the next clap burst
+  uint16_t  velocity;       // velocity of the current hit
+  uint32_t  amp;            // amplitude envelope (Q16)
+  uint32_t  amp_k;          // amplitude decay factor per frame (Q16)
+  uint32_t  env;            // pitch, tone or burst envelope (Q16)
+  uint32_t  env_k;          // envelope decay factor per frame (Q16)
+  uint32_t  phase;          // body waveform position (Q16)
+  uint32_t  increment;      // body phase increment at the base pitch (Q16)
+  uint32_t  sweep_increment; // phase increment added at the start of the pitch envelope (Q16)
+  uint32_t  noise_state;    // noise generator state
+  int32_t   filter[2];      // noise filter state
+} DrumVoice;
+
+DrumVoice * drums_init(uint8_t num_drums);
+void drum_init(DrumVoice *drum, uint8_t type);
+void drums_trigger(uint8_t drum, uint16_t velocity);
+void drums_render(int32_t *mix, uint32_t frames);
+void drums_retarget(uint32_t old_rate);
+bool drums_playing();
+uint8_t drums_active_count();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
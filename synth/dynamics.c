@@ -0,0 +1,337 @@
+/**
+ * @file dynamics.c
+ * @brief Implementation of the dynamics module.
+ *
+ * Gains are computed once per segment of DYNAMICS_SEGMENT frames, and
+ * ramped linearly across the segment. The output is delayed by two
+ * segments: when a segment starts playing, the peaks of both it and
+ * the next one are known, and the gain ramps down to meet them, so the
+ * limiter never lets a frame over the ceiling.
+ *
+ * The compressor works on levels in the log domain (log2, Q8), with a
+ * piecewise linear approximation that avoids any floating point math.
+ */
+
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "dynamics.h"
+#include "synth.h"
+
+#define LOOKAHEAD_MASK (DYNAMICS_LOOKAHEAD - 1)
+
+/**
+ * @brief Unity gain (Q16).
+ */
+#define UNITY 0x10000
+
+/**
+ * @brief Full scale level (log2, Q8).
+ */
+#define FULL_SCALE_Q8 (15 << 8)
+
+/**
+ * @brief Settings.
+ */
+static bool     limiter_enabled = true;
+static int32_t  limiter_ceiling = DYNAMICS_CEILING;
+static uint16_t limiter_release_ms = DYNAMICS_RELEASE_MS;
+static uint32_t limiter_release_k = UNITY;  // fraction of the release done per segment (Q16)
+static bool     compressor_enabled = false;
+static int32_t  compressor_threshold_q8 = FULL_SCALE_Q8;
+static uint8_t  compressor_ratio = 1;
+static uint16_t compressor_attack_ms = 0;
+static uint16_t compressor_release_ms = 0;
+static uint32_t compressor_attack_k = UNITY;
+static uint32_t compressor_release_k = UNITY;
+static int32_t  compressor_makeup_q8 = 0;
+
+/**
+ * @brief State.
+ */
+static int32_t  delay_line[DYNAMICS_LOOKAHEAD];
+static uint32_t delay_pos = 0;
+static uint32_t segment_pos = 0;
+static int32_t  input_peak = 0;       // peak of the segment being received
+static int32_t  output_peak = 0;      // peak of the next segment to play
+static uint32_t gain = UNITY;         // current gain (Q16)
+static int32_t  gain_step = 0;        // gain change per frame (Q16)
+static uint32_t gain_end = UNITY;     // gain at the end of the segment (Q16)
+static uint32_t compressor_gain = UNITY;
+static int32_t  compressor_env_q8 = 0; // compressor level envelope (log2, Q8)
+static uint8_t  quiet_segments = 0;   // segments of silence received in a row
+static bool     settled = false;      // the last gain update changed nothing
+
+/**
+ * @brief Meters.
+ */
+static uint32_t min_limiter_gain = UNITY;
+static uint32_t clipped = 0;
+
+/**
+ * @brief Approximates log2 of a level.
+ *
+ * @param x The level, greater than zero.
+ *
+ * @return The log2 of the level (Q8).
+ */
+static int32_t SYNTH_RAM_FUNC(log2_q8)(uint32_t x) {
+  int32_t exponent = 31 - __builtin_clz(x);
+  uint32_t mantissa = exponent >= 8 ? (x >> (exponent - 8)) : (x << (8 - exponent));
+  return (exponent << 8) + (mantissa & 0xff);
+}
+
+/**
+ * @brief Approximates 2 to the power of a log level, the inverse of log2_q8().
+ *
+ * @param y The log level (Q8), within -16 and +14.
+ *
+ * @return The gain (Q16).
+ */
+static uint32_t SYNTH_RAM_FUNC(exp2_gain)(int32_t y) {
+  int32_t exponent = y >> 8; // floor
+  uint32_t mantissa = UNITY + ((y & 0xff) << 8);
+  return exponent >= 0 ? (mantissa << exponent) : (mantissa >> -exponent);
+}
+
+/**
+ * @brief Converts a time to the fraction of the change done per segment.
+ *
+ * @param ms The time constant.
+ *
+ * @return The fraction (Q16).
+ */
+static uint32_t segment_factor(uint16_t ms) {
+  uint32_t frames = (uint32_t)ms * get_sample_rate() / 1000;
+  return frames > DYNAMICS_SEGMENT ? (uint32_t)DYNAMICS_SEGMENT * UNITY / frames : UNITY;
+}
+
+/**
+ * @brief Converts dB to a log level (Q8).
+ */
+static int32_t db_to_q8(int32_t db) {
+  return db * 256 * 100 / 602;
+}
+
+/**
+ * @brief Converts a gain (Q16) to a reduction in tenths of dB.
+ */
+static uint16_t reduction_db_x10(uint32_t gain) {
+  if(gain >= UNITY) { return 0; }
+  if(gain == 0) { return 0xffff; }
+  return (uint16_t)(((16 << 8) - log2_q8(gain)) * 602 / 256 / 10);
+}
+
+/**
+ * @brief Initializes the dynamics module: limiter on, compressor off.
+ */
+void dynamics_init() {
+  for(uint32_t i = 0; i < DYNAMICS_LOOKAHEAD; i++) { delay_line[i] = 0; }
+  delay_pos = 0;
+  segment_pos = 0;
+  input_peak = 0;
+  output_peak = 0;
+  gain = UNITY;
+  gain_step = 0;
+  gain_end = UNITY;
+  compressor_env_q8 = 0;
+  quiet_segments = 0;
+  dynamics_set_compressor(false, 0, 1, 0, 0, 0);
+  dynamics_set_limiter(true, DYNAMICS_CEILING, DYNAMICS_RELEASE_MS);
+}
+
+/**
+ * @brief Sets up the limiter.
+ *
+ * @param enable Flag indicating whether the limiter is used. When it is not, the output is clipped.
+ * @param ceiling The highest output level.
+ * @param release_ms The time the gain takes to recover after a peak.
+ */
+void dynamics_set_limiter(bool enable, int16_t ceiling, uint16_t release_ms) {
+  limiter_ceiling = MAX(ceiling, 1);
+  limiter_release_ms = release_ms;
+  limiter_release_k = segment_factor(release_ms);
+  limiter_enabled = enable;
+  settled = false;
+}
+
+/**
+ * @brief Recomputes the time constants for a new sample rate.
+ *
+ * Called by the synth when its sample rate changes.
+ */
+void dynamics_retarget() {
+  limiter_release_k = segment_factor(limiter_release_ms);
+  compressor_attack_k = segment_factor(compressor_attack_ms);
+  compressor_release_k = segment_factor(compressor_release_ms);
+}
+
+/**
+ * @brief Sets up the bus compressor.
+ *
+ * @param enable Flag indicating whether the compressor is used.
+ * @param threshold_db The level above which the gain is reduced, in dB below full scale (e.g. -12).
+ * @param ratio The amount of compression above the threshold (e.g. 4 for 4:1).
+ * @param attack_ms The time the gain takes to go down.
+ * @param release_ms The time the gain takes to recover.
+ * @param makeup_db The gain applied after the compression, up to DYNAMICS_MAX_MAKEUP_DB.
+ */
+void dynamics_set_compressor(bool enable, int8_t threshold_db, uint8_t ratio,
+                             uint16_t attack_ms, uint16_t release_ms, uint8_t makeup_db) {
+  compressor_threshold_q8 = FULL_SCALE_Q8 + db_to_q8(MIN(threshold_db, 0));
+  compressor_ratio = MAX(ratio, 1);
+  compressor_attack_ms = attack_ms;
+  compressor_release_ms = release_ms;
+  compressor_attack_k = segment_factor(attack_ms);
+  compressor_release_k = segment_factor(release_ms);
+  compressor_makeup_q8 = db_to_q8(MIN(makeup_db, DYNAMICS_MAX_MAKEUP_DB));
+  compressor_enabled = enable;
+  if(!enable) { compressor_gain = UNITY; }
+  settled = false;
+}
+
+/**
+ * @brief Computes the gain ramp of the segment about to play.
+ *
+ * @param playing_peak The peak of the segment about to play.
+ * @param next_peak The peak of the segment after it.
+ */
+static void SYNTH_RAM_FUNC(update_gain)(int32_t playing_peak, int32_t next_peak) {
+  gain = gain_end; // drop the rounding errors of the last ramp
+  int32_t env_q8 = compressor_env_q8;
+  if(compressor_enabled) {
+    int32_t level = next_peak > 0 ? log2_q8(next_peak) : 0;
+    int32_t k = level > compressor_env_q8 ? compressor_attack_k : compressor_release_k;
+    compressor_env_q8 += (int32_t)(((int64_t)(level - compressor_env_q8) * k) >> 16);
+    int32_t over = compressor_env_q8 - compressor_threshold_q8;
+    int32_t reduction = over > 0 ? over - over / compressor_ratio : 0;
+    compressor_gain = exp2_gain(compressor_makeup_q8 - reduction);
+  }
+
+  uint32_t target = compressor_gain;
+  if(limiter_enabled) {
+    // the gain must keep both segments under the ceiling
+    int32_t peak = MAX(playing_peak, next_peak);
+    if(peak > 0) {
+      uint32_t limit = (uint32_t)(((uint64_t)limiter_ceiling << 16) / peak);
+      target = MIN(target, limit);
+    }
+  }
+
+  uint32_t end = target;
+  if(target > gain) {
+    end = gain + (uint32_t)(((uint64_t)(target - gain) * limiter_release_k) >> 16);
+  }
+  gain_end = end;
+  gain_step = ((int32_t)end - (int32_t)gain) / DYNAMICS_SEGMENT;
+  settled = (end == gain) && (compressor_env_q8 == env_q8);
+  uint32_t limiter_gain = compressor_gain > 0 ? (uint32_t)(((uint64_t)MIN(end, gain) << 16) / compressor_gain) : UNITY;
+  min_limiter_gain = MIN(min_limiter_gain, limiter_gain);
+}
+
+/**
+ * @brief Applies the compressor and the limiter, and clips the result to 16 bits.
+ *
+ * The output is delayed by DYNAMICS_LOOKAHEAD frames while the compressor
+ * or the limiter is enabled.
+ *
+ * @param mix The block to process, in place.
+ * @param frames The number of frames in the block.
+ */
+void SYNTH_RAM_FUNC(dynamics_process)(int32_t *mix, uint32_t frames) {
+  if(limiter_enabled || compressor_enabled) {
+    uint32_t pos = delay_pos, seg = segment_pos;
+    int32_t peak = input_peak;
+    for(uint32_t i = 0; i < frames; i++) {
+      int32_t in = mix[i];
+      int32_t out = delay_line[pos];
+      delay_line[pos] = in;
+      pos = (pos + 1) & LOOKAHEAD_MASK;
+      peak = MAX(peak, abs(in));
+
+      mix[i] = (int32_t)(((int64_t)out * gain) >> 16);
+      gain += gain_step;
+
+      if(++seg == DYNAMICS_SEGMENT) {
+        seg = 0;
+        quiet_segments = peak ? 0 : MIN(quiet_segments + 1, 0xff);
+        update_gain(output_peak, peak);
+        output_peak = peak;
+        peak = 0;
+      }
+    }
+    delay_pos = pos;
+    segment_pos = seg;
+    input_peak = peak;
+  }
+
+  for(uint32_t i = 0; i < frames; i++) {
+    int32_t sample = mix[i];
+    if(sample > 0x7fff || sample < -0x8000) {
+      mix[i] = sample < 0 ? -0x8000 : 0x7fff;
+      clipped++;
+    }
+  }
+}
+
+/**
+ * @brief Checks if processing silence would only output silence and
+ * leave the state as it is.
+ *
+ * The delay line must hold silence, and the gains must have settled
+ * with silence at both inputs of the last update.
+ *
+ * @return True if dynamics_skip() can replace dynamics_process().
+ */
+bool SYNTH_RAM_FUNC(dynamics_idle)() {
+  if(!limiter_enabled && !compressor_enabled) {
+    return true;
+  }
+  return settled && input_peak == 0 && quiet_segments >= DYNAMICS_LOOKAHEAD / DYNAMICS_SEGMENT;
+}
+
+/**
+ * @brief Moves the dynamics over a block of silence without processing it.
+ *
+ * While dynamics_idle() is true, this leaves the same state as
+ * dynamics_process() on a block of zeros: the delay line holds zeros
+ * wherever it is read, and every gain update gives the same gain.
+ *
+ * @param frames The number of frames in the block.
+ */
+void SYNTH_RAM_FUNC(dynamics_skip)(uint32_t frames) {
+  if(!limiter_enabled && !compressor_enabled) {
+    return;
+  }
+  delay_pos = (delay_pos + frames) & LOOKAHEAD_MASK;
+  uint32_t seg = segment_pos + frames;
+  if(seg >= DYNAMICS_SEGMENT) {
+    // updates the meter as the skipped updates would
+    update_gain(0, 0);
+    seg %= DYNAMICS_SEGMENT;
+  }
+  segment_pos = seg;
+}
+
+/**
+ * @brief Reads the gain reduction meters.
+ *
+ * @param meter The structure to fill.
+ */
+void dynamics_get_meter(DynamicsMeter *meter) {
+  uint32_t limiter_gain = compressor_gain > 0 ? (uint32_t)(((uint64_t)gain << 16) / compressor_gain) : UNITY;
+  meter->limiter_db_x10 = reduction_db_x10(limiter_gain);
+  meter->limiter_peak_db_x10 = reduction_db_x10(min_limiter_gain);
+  meter->compressor_db_x10 = reduction_db_x10(exp2_gain(-compressor_makeup_q8) * (uint64_t)compressor_gain >> 16);
+  meter->clipped = clipped;
+  min_limiter_gain = UNITY;
+  clipped = 0;
+}
+
+/**
+ * @brief Gets the delay added to the output.
+ *
+ * @return The delay in frames.
+ */
+uint32_t dynamics_latency() {
+  return (limiter_enabled || compressor_enabled) ? DYNAMICS_LOOKAHEAD : 0;
+}
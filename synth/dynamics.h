@@ -0,0 +1,86 @@
+#ifndef DYNAMICS_H
+#define DYNAMICS_H
+
+/**
+ * @file dynamics.h
+ * @brief Header file for the dynamics module.
+ *
+ * The last stage of the master bus of the default synth instance: an
+ * optional bus compressor and a look-ahead limiter, which keeps the
+ * output below its ceiling without clipping, so voices can run at full
+ * volume.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Number of frames the gain is computed for at once.
+ */
+#define DYNAMICS_SEGMENT 16
+
+/**
+ * @brief Delay of the output, giving the limiter time to turn the gain down before a peak.
+ */
+#define DYNAMICS_LOOKAHEAD (2 * DYNAMICS_SEGMENT)
+
+/**
+ * @brief Default ceiling of the limiter, a little under full scale.
+ */
+#define DYNAMICS_CEILING 0x7f00
+
+/**
+ * @brief Default release time of the limiter.
+ */
+#define DYNAMICS_RELEASE_MS 50
+
+/**
+ * @brief Highest makeup gain of the compressor, in dB.
+ */
+#define DYNAMICS_MAX_MAKEUP_DB 48
+
+/**
+ * @struct DynamicsMeter
+ * @brief Gain reduction measurements, in tenths of dB.
+ */
+typedef struct DynamicsMeter {
+  /**
+   * @brief The gain reduction of the limiter.
+   */
+  uint16_t limiter_db_x10;
+
+  /**
+   * @brief The highest gain reduction of the limiter since the last reading.
+   */
+  uint16_t limiter_peak_db_x10;
+
+  /**
+   * @brief The gain reduction of the compressor, before its makeup gain.
+   */
+  uint16_t compressor_db_x10;
+
+  /**
+   * @brief The number of frames clipped since the last reading.
+   */
+  uint32_t clipped;
+} DynamicsMeter;
+
+void dynamics_init();
+void dynamics_set_limiter(bool enable, int16_t ceiling, uint16_t release_ms);
+void dynamics_set_compressor(bool enable, int8_t threshold_db, uint8_t ratio,
+                             uint16_t attack_ms, uint16_t release_ms, uint8_t makeup_db);
+void dynamics_retarget();
+void dynamics_process(int32_t *mix, uint32_t frames);
+bool dynamics_idle();
+void dynamics_skip(uint32_t frames);
+void dynamics_get_meter(DynamicsMeter *meter);
+uint32_t dynamics_latency();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
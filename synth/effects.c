@@ -0,0 +1,497 @@
+/**
+ * @file effects.c
+ * @brief Implementation of the effects module.
+ *
+ * The reverb is a Freeverb style Schroeder reverb: four damped feedback
+ * combs in parallel, followed by two allpass filters in series. The
+ * caller buffer is split between the six delay lines, keeping the
+ * ratios of the original line lengths.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "effects.h"
+
+/**
+ * @struct EffectsLine
+ * @brief A circular delay line in a caller buffer.
+ */
+typedef struct EffectsLine {
+  void      *buffer;
+  uint32_t  length;   // length in frames
+  uint32_t  pos;      // position of the next frame to write
+  uint8_t   storage;  // one of EffectsStorage
+  int32_t   filter;   // damping filter state (combs only)
+} EffectsLine;
+
+#define REVERB_COMBS 4
+#define REVERB_ALLPASSES 2
+
+/**
+ * @brief Line lengths of the reverb, in frames at 44.1kHz.
+ */
+static const uint16_t reverb_lengths[REVERB_COMBS + REVERB_ALLPASSES] = {
+  1116, 1188, 1277, 1356, 556, 441
+};
+#define REVERB_TOTAL_LENGTH 5934
+
+/**
+ * @brief Return level below which the effects are considered silent.
+ */
+#define EFFECTS_SILENCE 16
+
+/**
+ * @brief Delay state. The delay time moves towards its target by one
+ * frame per block, so small tempo changes do not click.
+ */
+static EffectsLine delay_line;
+static uint32_t delay_frames = 0;
+static uint32_t delay_target = 0;
+static uint8_t  delay_steps = 0;      // delay time in sequencer steps, 0 when not synced
+static uint32_t step_frames_q8 = 0;   // duration of a sequencer step (Q8)
+static uint16_t delay_feedback = 0x8000;
+static uint16_t delay_damping = 0x4000;
+static uint16_t delay_level = 0x8000;
+
+/**
+ * @brief Reverb state.
+ */
+static EffectsLine reverb_lines[REVERB_COMBS + REVERB_ALLPASSES];
+static bool     reverb_enabled = false;
+static bool     reverb_economy = false;   // reverb bypassed to save CPU time
+static bool     reverb_muted = false;     // reverb faded out by the economy mode
+static uint16_t reverb_size = 0xd000;
+static uint16_t reverb_damping = 0x3000;
+static uint16_t reverb_level = 0x8000;
+
+/**
+ * @brief Frames rendered since the effects last had a send or an
+ * audible return. An echo can sit in a line for its whole length with
+ * the return silent, so the effects play until this reaches the
+ * length of their longest path.
+ */
+static uint32_t quiet_frames = UINT32_MAX;
+static bool lines_cleared = true;   // the lines were silenced since the last send
+
+/**
+ * @brief Longest path through the reverb: its longest comb, then the allpasses.
+ */
+static uint32_t reverb_tail = 0;
+
+/**
+ * @brief Mu-law decoding table.
+ */
+static int16_t mulaw_table[256];
+static bool mulaw_ready = false;
+
+/**
+ * @brief Fills the mu-law decoding table.
+ *
+ * Codes decode to the bottom of their step rather than its middle, so
+ * the quantization never adds energy to the feedback loops.
+ */
+static void mulaw_init() {
+  for(uint32_t i = 0; i < 256; i++) {
+    uint8_t byte = ~i;
+    int32_t exponent = (byte >> 4) & 0x07;
+    int32_t magnitude = MAX(((((byte & 0x0f) << 3) + 0x80) << exponent) - 0x84, 0);
+    mulaw_table[i] = (byte & 0x80) ? -magnitude : magnitude;
+  }
+  mulaw_ready = true;
+}
+
+/**
+ * @brief Encodes a frame as mu-law.
+ */
+static inline uint8_t mulaw_encode(int32_t sample) {
+  uint8_t sign = 0;
+  if(sample < 0) {
+    sign = 0x80;
+    sample = -sample;
+  }
+  sample = MIN(sample, 32635) + 0x84;
+  uint8_t exponent = 31 - __builtin_clz(sample >> 7);
+  uint8_t mantissa = (sample >> (exponent + 3)) & 0x0f;
+  return ~(sign | (exponent << 4) | mantissa);
+}
+
+/**
+ * @brief Reads a frame of a delay line.
+ */
+static inline int32_t line_read(const EffectsLine *line, uint32_t pos) {
+  switch(line->storage) {
+    case EFFECTS_8BIT:      return ((const int8_t *)line->buffer)[pos] * 256;
+    case EFFECTS_COMPANDED: return mulaw_table[((const uint8_t *)line->buffer)[pos]];
+    default:                return ((const int16_t *)line->buffer)[pos];
+  }
+}
+
+/**
+ * @brief Writes a frame of a delay line, saturated to its format.
+ */
+static inline void line_write(EffectsLine *line, uint32_t pos, int32_t sample) {
+  sample = MIN(MAX(sample, -0x8000), 0x7fff);
+  switch(line->storage) {
+    case EFFECTS_8BIT:      ((int8_t *)line->buffer)[pos] = sample / 256; break; // towards zero, so tails die out
+    case EFFECTS_COMPANDED: ((uint8_t *)line->buffer)[pos] = mulaw_encode(sample); break;
+    default:                ((int16_t *)line->buffer)[pos] = sample; break;
+  }
+}
+
+/**
+ * @brief Sets up a delay line and silences it.
+ */
+static void line_init(EffectsLine *line, void *buffer, uint32_t length, uint8_t storage) {
+  line->buffer = buffer;
+  line->length = length;
+  line->pos = 0;
+  line->storage = storage;
+  line->filter = 0;
+  for(uint32_t i = 0; i < length; i++) { line_write(line, i, 0); }
+}
+
+/**
+ * @brief Silences a delay line at once, as a block of the byte of silence.
+ */
+static void SYNTH_RAM_FUNC(line_clear)(EffectsLine *line) {
+  uint8_t frame_bytes = line->storage == EFFECTS_16BIT ? 2 : 1;
+  memset(line->buffer, line->storage == EFFECTS_COMPANDED ? 0xff : 0, line->length * frame_bytes);
+  line->filter = 0;
+}
+
+/**
+ * @brief Gets the number of frames a buffer holds.
+ */
+static uint32_t buffer_frames(uint32_t bytes, uint8_t storage) {
+  return storage == EFFECTS_16BIT ? bytes / 2 : bytes;
+}
+
+/**
+ * @brief Sets up the delay.
+ *
+ * The delay time is limited by the size of the buffer: 16000 bytes hold
+ * 363ms of 16-bit frames at 22.05kHz, or twice as much as 8-bit frames.
+ *
+ * @param buffer The delay buffer, NULL to disable the delay. A buffer of
+ *               fewer than two frames disables it as well.
+ * @param bytes The size of the buffer.
+ * @param storage The format of the frames, one of EffectsStorage.
+ */
+void effects_init_delay(void *buffer, uint32_t bytes, uint8_t storage) {
+  if(storage == EFFECTS_COMPANDED && !mulaw_ready) { mulaw_init(); }
+  uint32_t status = save_and_disable_interrupts();
+  delay_line.buffer = NULL;
+  restore_interrupts(status);
+  if(!buffer || buffer_frames(bytes, storage) < 2) { return; }
+
+  EffectsLine line;
+  line_init(&line, buffer, buffer_frames(bytes, storage), storage);
+  delay_target = MIN(delay_target ? delay_target : line.length, line.length - 1);
+  delay_frames = delay_target;
+
+  status = save_and_disable_interrupts();
+  delay_line = line;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Sets the delay parameters.
+ *
+ * @param feedback The part of the output fed back to the input (Q16).
+ * @param damping How much the high frequencies fade on every repeat (Q16).
+ * @param level The level of the delay return (Q16).
+ */
+void effects_set_delay(uint16_t feedback, uint16_t damping, uint16_t level) {
+  delay_feedback = feedback;
+  delay_damping = damping;
+  delay_level = level;
+}
+
+/**
+ * @brief Sets the delay time the delay moves towards.
+ */
+static void set_delay_target(uint32_t frames) {
+  if(delay_line.buffer) {
+    frames = MIN(MAX(frames, 1), delay_line.length - 1);
+  }
+  delay_target = frames;
+  // small changes, from tempo tracking, glide; larger ones take effect at once
+  if((uint32_t)abs((int32_t)frames - (int32_t)delay_frames) > (delay_frames >> 4)) {
+    delay_frames = frames;
+  }
+}
+
+/**
+ * @brief Sets the delay time, and stops following the sequencer tempo.
+ *
+ * @param frames The delay time in frames.
+ */
+void effects_set_delay_frames(uint32_t frames) {
+  delay_steps = 0;
+  set_delay_target(frames);
+}
+
+/**
+ * @brief Makes the delay time follow the sequencer tempo.
+ *
+ * @param steps The delay time in sequencer steps (3 for a dotted eighth).
+ */
+void effects_set_delay_steps(uint8_t steps) {
+  delay_steps = steps;
+  if(steps && step_frames_q8) {
+    set_delay_target((uint32_t)(((uint64_t)step_frames_q8 * steps) >> 8));
+  }
+}
+
+/**
+ * @brief Updates the synced delay time on a tempo change.
+ *
+ * Called by the sequencer whenever its step duration changes.
+ *
+ * @param _step_frames_q8 The duration of a sequencer step in frames (Q8).
+ */
+void effects_set_step_frames(uint32_t _step_frames_q8) {
+  step_frames_q8 = _step_frames_q8;
+  effects_set_delay_steps(delay_steps);
+}
+
+/**
+ * @brief Moves the delay time to a new sample rate.
+ *
+ * Called by the synth when its sample rate changes. The reverb lines
+ * are sized by their buffer, so the reverb gets shorter and brighter at
+ * higher rates: give it a larger buffer to keep its character.
+ *
+ * @param old_rate The previous sample rate.
+ */
+void effects_retarget(uint32_t old_rate) {
+  uint32_t sample_rate = get_sample_rate();
+  step_frames_q8 = (uint32_t)((uint64_t)step_frames_q8 * sample_rate / old_rate);
+  if(delay_steps) {
+    effects_set_delay_steps(delay_steps);
+  } else if(delay_target) {
+    set_delay_target((uint32_t)((uint64_t)delay_target * sample_rate / old_rate));
+  }
+}
+
+/**
+ * @brief Sets up the reverb.
+ *
+ * The size of the buffer sets the density and the length of the
+ * reverb: 12000 bytes of 16-bit frames match the original Freeverb
+ * lines at 44.1kHz. Every line takes at least 16 frames: a buffer that
+ * can not hold them all disables the reverb, from 183 frames on they fit.
+ *
+ * @param buffer The reverb buffer, NULL to disable the reverb.
+ * @param bytes The size of the buffer.
+ * @param storage The format of the frames, one of EffectsStorage.
+ */
+void effects_init_reverb(void *buffer, uint32_t bytes, uint8_t storage) {
+  if(storage == EFFECTS_COMPANDED && !mulaw_ready) { mulaw_init(); }
+  uint32_t status = save_and_disable_interrupts();
+  reverb_enabled = false;
+  restore_interrupts(status);
+
+  if(!buffer) { return; }
+
+  // The lines share the buffer in proportion to their length, the short
+  // ones raised to 16 frames: the lines must still fit in it
+  uint32_t frames = buffer_frames(bytes, storage);
+  uint32_t lengths[REVERB_COMBS + REVERB_ALLPASSES];
+  uint32_t total = 0;
+  for(uint8_t i = 0; i < REVERB_COMBS + REVERB_ALLPASSES; i++) {
+    lengths[i] = MAX((uint64_t)frames * reverb_lengths[i] / REVERB_TOTAL_LENGTH, 16);
+    total += lengths[i];
+  }
+  if(total > frames) { return; }
+
+  uint8_t *data = (uint8_t *)buffer;
+  uint8_t frame_bytes = storage == EFFECTS_16BIT ? 2 : 1;
+  uint32_t comb_max = 0, allpasses = 0;
+  for(uint8_t i = 0; i < REVERB_COMBS + REVERB_ALLPASSES; i++) {
+    uint32_t length = lengths[i];
+    line_init(&reverb_lines[i], data, length, storage);
+    data += length * frame_bytes;
+    if(i < REVERB_COMBS) { comb_max = MAX(comb_max, length); } else { allpasses += length; }
+  }
+  reverb_tail = comb_max + allpasses;
+
+  status = save_and_disable_interrupts();
+  reverb_enabled = true;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Sets the reverb parameters.
+ *
+ * @param size The feedback of the combs, longer tails for higher values (Q16).
+ * @param damping How much the high frequencies fade in the tail (Q16).
+ * @param level The level of the reverb return (Q16).
+ */
+void effects_set_reverb(uint16_t size, uint16_t damping, uint16_t level) {
+  reverb_size = size;
+  reverb_damping = damping;
+  reverb_level = level;
+}
+
+/**
+ * @brief Renders the delay and adds its return to the mix.
+ */
+static int32_t SYNTH_RAM_FUNC(render_delay)(int32_t *mix, const int32_t *send, uint32_t frames) {
+  EffectsLine *line = &delay_line;
+  if(delay_frames < delay_target) { delay_frames++; }
+  else if(delay_frames > delay_target) { delay_frames--; }
+
+  uint32_t length = line->length;
+  uint32_t write = line->pos;
+  uint32_t read = (write + length - delay_frames) % length;
+  int32_t filter = line->filter, peak = 0;
+  int32_t feedback = delay_feedback, damping = delay_damping, level = delay_level;
+  for(uint32_t i = 0; i < frames; i++) {
+    int32_t out = line_read(line, read);
+    filter = out + (int32_t)(((int64_t)(filter - out) * damping) >> 16);
+    line_write(line, write, send[i] + ((filter * feedback) >> 16));
+    out = (out * level) >> 16;
+    mix[i] += out;
+    peak |= abs(out);
+    if(++read == length) { read = 0; }
+    if(++write == length) { write = 0; }
+  }
+  line->pos = write;
+  line->filter = filter;
+  return peak;
+}
+
+/**
+ * @brief Renders the reverb and adds its return to the mix.
+ *
+ * @param fade_out Flag indicating whether the return fades to silence over the block.
+ */
+static int32_t SYNTH_RAM_FUNC(render_reverb)(int32_t *mix, const int32_t *send, uint32_t frames, bool fade_out) {
+  int32_t wet[SYNTH_BLOCK_SIZE];
+  for(uint32_t i = 0; i < frames; i++) { wet[i] = 0; }
+
+  // parallel combs, with a low-pass in the feedback path
+  int32_t feedback = reverb_size, damping = reverb_damping;
+  for(uint8_t c = 0; c < REVERB_COMBS; c++) {
+    EffectsLine *line = &reverb_lines[c];
+    uint32_t pos = line->pos, length = line->length;
+    int32_t filter = line->filter;
+    for(uint32_t i = 0; i < frames; i++) {
+      int32_t out = line_read(line, pos);
+      filter = out + (int32_t)(((int64_t)(filter - out) * damping) >> 16);
+      line_write(line, pos, (send[i] >> 3) + ((filter * feedback) >> 16));
+      wet[i] += out;
+      if(++pos == length) { pos = 0; }
+    }
+    line->pos = pos;
+    line->filter = filter;
+  }
+
+  // allpasses in series, diffusing the echoes of the combs
+  for(uint8_t a = REVERB_COMBS; a < REVERB_COMBS + REVERB_ALLPASSES; a++) {
+    EffectsLine *line = &reverb_lines[a];
+    uint32_t pos = line->pos, length = line->length;
+    for(uint32_t i = 0; i < frames; i++) {
+      int32_t delayed = line_read(line, pos);
+      line_write(line, pos, wet[i] + (delayed >> 1));
+      wet[i] = delayed - wet[i];
+      if(++pos == length) { pos = 0; }
+    }
+    line->pos = pos;
+  }
+
+  int32_t level = reverb_level, peak = 0;
+  int32_t level_step = fade_out ? level / (int32_t)frames : 0;
+  for(uint32_t i = 0; i < frames; i++) {
+    int32_t out = (int32_t)(((int64_t)wet[i] * level) >> 16);
+    mix[i] += out;
+    peak |= abs(out);
+    level -= level_step;
+  }
+  return peak;
+}
+
+/**
+ * @brief Renders the effects and adds their returns to the mix.
+ *
+ * @param mix The block to add the returns to.
+ * @param sends The blocks sent to each effect by the channels.
+ * @param frames The number of frames to render.
+ */
+void SYNTH_RAM_FUNC(effects_render)(int32_t *mix, int32_t sends[SEND_COUNT][SYNTH_BLOCK_SIZE], uint32_t frames) {
+  int32_t peak = 0, sent = 0;
+  for(uint32_t i = 0; i < frames; i++) {
+    sent |= sends[SEND_DELAY][i] | sends[SEND_REVERB][i];
+  }
+  if(delay_line.buffer) {
+    peak |= render_delay(mix, sends[SEND_DELAY], frames);
+  }
+  if(reverb_enabled && !reverb_economy) {
+    if(reverb_muted) {
+      // the tail left when the reverb was bypassed would come back at once
+      for(uint8_t i = 0; i < REVERB_COMBS + REVERB_ALLPASSES; i++) {
+        EffectsLine *line = &reverb_lines[i];
+        line_init(line, line->buffer, line->length, line->storage);
+      }
+      reverb_muted = false;
+    }
+    peak |= render_reverb(mix, sends[SEND_REVERB], frames, false);
+  } else if(reverb_enabled && !reverb_muted) {
+    peak |= render_reverb(mix, sends[SEND_REVERB], frames, true);
+    reverb_muted = true;
+  }
+  if(sent || peak >= EFFECTS_SILENCE) {
+    quiet_frames = 0;
+    lines_cleared = false;
+  } else if(quiet_frames < UINT32_MAX - frames) {
+    quiet_frames += frames;
+  }
+  if(!lines_cleared && !effects_playing()) {
+    // the synth stops rendering the effects: what is left in the lines,
+    // below the silence level, would come back out of time with the next note
+    if(delay_line.buffer) {
+      line_clear(&delay_line);
+    }
+    if(reverb_enabled) {
+      for(uint8_t i = 0; i < REVERB_COMBS + REVERB_ALLPASSES; i++) {
+        line_clear(&reverb_lines[i]);
+      }
+    }
+    lines_cleared = true;
+  }
+}
+
+/**
+ * @brief Bypasses the reverb to save CPU time.
+ *
+ * The reverb return fades out over a block; when the reverb is back, it
+ * starts from silence.
+ *
+ * @param economy Flag indicating whether the reverb is bypassed.
+ */
+void effects_set_economy(bool economy) {
+  reverb_economy = economy;
+}
+
+/**
+ * @brief Checks if the effects are still playing a tail.
+ *
+ * The effects play until their returns have been below the silence
+ * level, with nothing sent to them, for the length of their longest
+ * path: by then every echo left in the lines has come out, below that
+ * level, and what the lines hold is only quieter.
+ *
+ * @return True if an effect return may still be audible, false otherwise.
+ */
+bool SYNTH_RAM_FUNC(effects_playing)() {
+  uint32_t tail = 0;
+  if(delay_line.buffer) {
+    tail = MAX(delay_frames, delay_target);
+  }
+  if(reverb_enabled && !reverb_muted) {
+    tail = MAX(tail, reverb_tail);
+  }
+  return quiet_frames < tail + SYNTH_BLOCK_SIZE;
+}
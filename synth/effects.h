@@ -0,0 +1,48 @@
+#ifndef EFFECTS_H
+#define EFFECTS_H
+
+/**
+ * @file effects.h
+ * @brief Header file for the effects module.
+ *
+ * A master effects bus, rendered by the default synth instance: every
+ * channel of that instance sends part of its output to a feedback delay,
+ * which can follow the sequencer tempo, and to a small Schroeder reverb.
+ * Both run on buffers provided by the caller, stored as 16-bit, 8-bit or
+ * companded 8-bit frames, so their RAM use is fixed by the application.
+ */
+
+#include "pico/stdlib.h"
+#include "synth.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @enum EffectsStorage
+ * @brief The format of the frames held by an effect buffer.
+ */
+enum EffectsStorage {
+  EFFECTS_16BIT,      // 2 bytes per frame
+  EFFECTS_8BIT,       // 1 byte per frame, 48dB of dynamic range
+  EFFECTS_COMPANDED   // 1 byte per frame, mu-law: less noise on quiet tails
+};
+
+void effects_init_delay(void *buffer, uint32_t bytes, uint8_t storage);
+void effects_set_delay(uint16_t feedback, uint16_t damping, uint16_t level);
+void effects_set_delay_frames(uint32_t frames);
+void effects_set_delay_steps(uint8_t steps);
+void effects_set_step_frames(uint32_t step_frames_q8);
+void effects_retarget(uint32_t old_rate);
+void effects_init_reverb(void *buffer, uint32_t bytes, uint8_t storage);
+void effects_set_reverb(uint16_t size, uint16_t damping, uint16_t level);
+void effects_render(int32_t *mix, int32_t sends[SEND_COUNT][SYNTH_BLOCK_SIZE], uint32_t frames);
+bool effects_playing();
+void effects_set_economy(bool economy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,144 @@
+/**
+ * @file governor.c
+ * @brief Implementation of the quality governor module.
+ *
+ * The load is smoothed over a few renders, so a single busy block does
+ * not change the quality, but a block close to the deadline does. The
+ * quality goes down quickly and comes back slowly: after a change, the
+ * measurements settle for GOVERNOR_SETTLE_MS, and a level is restored
+ * only after GOVERNOR_RECOVER_MS below the low threshold.
+ */
+
+#include "pico/stdlib.h"
+#include "governor.h"
+#include "synth.h"
+#include "sampler.h"
+#include "effects.h"
+
+/**
+ * @brief Smoothing of the load (1/4 of the difference per render).
+ */
+#define LOAD_SHIFT 2
+
+/**
+ * @brief Load of a single render that lowers the quality at once (tenths of percent).
+ */
+#define CRITICAL_LOAD_X10 950
+
+static bool enabled = false;
+static uint8_t level = GOVERNOR_FULL;
+static uint16_t high_x10 = GOVERNOR_HIGH_PERCENT * 10;
+static uint16_t low_x10 = GOVERNOR_LOW_PERCENT * 10;
+static uint32_t load_q8 = 0;        // smoothed load (tenths of percent, Q8)
+static uint32_t settle_frames = 0;  // frames left before the next change
+static uint32_t calm_frames = 0;    // frames rendered below the low threshold
+
+/**
+ * @brief The callback function for level changes.
+ */
+static void noop(uint8_t level, uint16_t load_x10) { ; }
+static void (*level_callback)(uint8_t level, uint16_t load_x10) = noop;
+
+/**
+ * @brief Applies a quality level to the synth modules.
+ *
+ * @param new_level The level, one of GovernorLevel.
+ * @param load_x10 The load that triggered the change, for the callback.
+ */
+static void set_level(uint8_t new_level, uint16_t load_x10) {
+  level = new_level;
+  sampler_set_economy(level >= GOVERNOR_NEAREST);
+  effects_set_economy(level >= GOVERNOR_NO_REVERB);
+  settle_frames = GOVERNOR_SETTLE_MS * get_output_rate() / 1000;
+  calm_frames = 0;
+  level_callback(level, load_x10);
+}
+
+/**
+ * @brief Enables the governor.
+ *
+ * @param enable Flag indicating whether the governor is used.
+ */
+void governor_enable(bool enable) {
+  uint32_t status = save_and_disable_interrupts();
+  enabled = enable;
+  load_q8 = 0;
+  if(level != GOVERNOR_FULL) { set_level(GOVERNOR_FULL, 0); }
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Checks if the governor is enabled.
+ *
+ * @return True if the governor measures the render time.
+ */
+bool governor_is_enabled() {
+  return enabled;
+}
+
+/**
+ * @brief Sets the load thresholds.
+ *
+ * @param high_percent The load above which the quality is lowered.
+ * @param low_percent The load below which the quality is restored.
+ */
+void governor_set_thresholds(uint8_t high_percent, uint8_t low_percent) {
+  high_x10 = MIN(high_percent, 100) * 10;
+  low_x10 = MIN(low_percent, high_percent) * 10;
+}
+
+/**
+ * @brief Sets the function called when the quality level changes.
+ *
+ * @param callback The callback function.
+ */
+void governor_set_callback(void (*callback)(uint8_t level, uint16_t load_x10)) {
+  level_callback = callback ? callback : noop;
+}
+
+/**
+ * @brief Gets the current quality level.
+ *
+ * @return The level, one of GovernorLevel.
+ */
+uint8_t governor_get_level() {
+  return level;
+}
+
+/**
+ * @brief Feeds the time taken to render frames.
+ *
+ * @param elapsed_us The render time.
+ * @param frames The number of frames rendered, at the output rate.
+ */
+void governor_update(uint32_t elapsed_us, uint32_t frames) {
+  uint32_t period_us = (uint32_t)((uint64_t)frames * 1000000 / get_output_rate());
+  if(!enabled || period_us == 0) { return; }
+
+  uint32_t load = MIN((uint64_t)elapsed_us * 1000 / period_us, 0xffff);
+  load_q8 += ((int32_t)(load << 8) - (int32_t)load_q8) >> LOAD_SHIFT;
+  uint32_t average = load_q8 >> 8;
+
+  if(settle_frames > frames) {
+    settle_frames -= frames;
+  } else {
+    settle_frames = 0;
+  }
+
+  if(average > high_x10 || load > CRITICAL_LOAD_X10) {
+    calm_frames = 0;
+    if(settle_frames) { return; }
+    if(level < GOVERNOR_STEAL) {
+      set_level(level + 1, load);
+    } else if(synth_steal_voice()) {
+      settle_frames = GOVERNOR_SETTLE_MS * get_output_rate() / 1000;
+    }
+  } else if(average < low_x10 && level > GOVERNOR_FULL) {
+    calm_frames += frames;
+    if(calm_frames >= GOVERNOR_RECOVER_MS * get_output_rate() / 1000) {
+      set_level(level - 1, load);
+    }
+  } else {
+    calm_frames = 0;
+  }
+}
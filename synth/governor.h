@@ -0,0 +1,105 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+/**
+ * @file governor.h
+ * @brief Header file for the quality governor module.
+ *
+ * The governor measures the time the default synth instance takes to
+ * render against the time the rendered frames play for. When the load
+ * gets close to the budget, it lowers the quality one level at a time
+ * until the render is back in time, and restores it once the load has
+ * stayed low for a while.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Default load above which the quality is lowered, in percent.
+ */
+#define GOVERNOR_HIGH_PERCENT 85
+
+/**
+ * @brief Default load below which the quality is restored, in percent.
+ */
+#define GOVERNOR_LOW_PERCENT 60
+
+/**
+ * @brief Time the measurements get to settle after a change.
+ */
+#define GOVERNOR_SETTLE_MS 20
+
+/**
+ * @brief Time the load must stay low before the quality is raised.
+ */
+#define GOVERNOR_RECOVER_MS 2000
+
+/**
+ * @enum GovernorLevel
+ * @brief The quality levels, each one cheaper than the previous.
+ */
+enum GovernorLevel {
+  GOVERNOR_FULL,      // full quality
+  GOVERNOR_NEAREST,   // sampler voices play without interpolation
+  GOVERNOR_NO_REVERB, // the reverb is bypassed
+  GOVERNOR_STEAL      // the quietest voices are released while the load is high
+};
+
+/**
+ * @brief Enables the governor.
+ *
+ * When disabled, the quality goes back to full.
+ *
+ * @param enable Flag indicating whether the governor is used.
+ */
+void governor_enable(bool enable);
+
+/**
+ * @brief Checks if the governor is enabled.
+ *
+ * @return True if the governor measures the render time.
+ */
+bool governor_is_enabled();
+
+/**
+ * @brief Sets the load thresholds.
+ *
+ * @param high_percent The load above which the quality is lowered.
+ * @param low_percent The load below which the quality is restored.
+ */
+void governor_set_thresholds(uint8_t high_percent, uint8_t low_percent);
+
+/**
+ * @brief Sets the function called when the quality level changes.
+ *
+ * The callback runs in the audio interrupt and must return quickly.
+ *
+ * @param callback The callback function, receiving the new level and
+ *                 the load that triggered it (tenths of percent).
+ */
+void governor_set_callback(void (*callback)(uint8_t level, uint16_t load_x10));
+
+/**
+ * @brief Gets the current quality level.
+ *
+ * @return The level, one of GovernorLevel.
+ */
+uint8_t governor_get_level();
+
+/**
+ * @brief Feeds the time taken to render frames. Called by the synth.
+ *
+ * @param elapsed_us The render time.
+ * @param frames The number of frames rendered, at the output rate.
+ */
+void governor_update(uint32_t elapsed_us, uint32_t frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
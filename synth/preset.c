@@ -0,0 +1,165 @@
+/**
+ * @file preset.c
+ * @brief Implementation of the voice preset module.
+ */
+
+#include "pico/stdlib.h"
+#include "preset.h"
+#include "synth.h"
+
+/**
+ * @brief Applies a preset to a channel.
+ *
+ * Only settings are written: the envelope of the note playing keeps its
+ * phase, level and step, so nothing is recomputed and nothing jumps.
+ *
+ * @param channel The audio channel.
+ * @param preset The preset.
+ */
+void SYNTH_RAM_FUNC(synth_apply_preset)(AudioChannel *channel, const SynthPreset *preset) {
+  channel->waveforms  = preset->waveforms;
+  channel->noise_mode = preset->noise_mode;
+  channel->attack_ms  = preset->attack_ms;
+  channel->decay_ms   = preset->decay_ms;
+  channel->sustain    = preset->sustain;
+  channel->release_ms = preset->release_ms;
+  channel->volume     = preset->volume;
+  channel->pulse_width = preset->pulse_width ? preset->pulse_width : 0x7fff;
+  channel->filter_cutoff_frequency = preset->filter_cutoff;
+  channel->noise_rate = preset->noise_rate;
+  for(uint8_t s = 0; s < SEND_COUNT; s++) {
+    channel->sends[s] = preset->sends[s];
+  }
+}
+
+/**
+ * @brief Copies the settings of a channel into a preset.
+ *
+ * @param channel The audio channel.
+ * @param preset The preset to fill.
+ */
+void synth_capture_preset(const AudioChannel *channel, SynthPreset *preset) {
+  preset->waveforms  = channel->waveforms;
+  preset->noise_mode = channel->noise_mode;
+  preset->attack_ms  = channel->attack_ms;
+  preset->decay_ms   = channel->decay_ms;
+  preset->sustain    = channel->sustain;
+  preset->release_ms = channel->release_ms;
+  preset->volume     = channel->volume;
+  preset->pulse_width = channel->pulse_width;
+  preset->filter_cutoff = channel->filter_cutoff_frequency;
+  preset->noise_rate = channel->noise_rate;
+  for(uint8_t s = 0; s < SEND_COUNT; s++) {
+    preset->sends[s] = channel->sends[s];
+  }
+}
+
+/**
+ * @brief Sets the presets EVENT_PRESET events select from.
+ *
+ * @param synth The synth instance.
+ * @param presets The presets, indexed by the value of the events.
+ * @param count The number of presets.
+ */
+void synth_set_presets_ctx(Synth *synth, const SynthPreset *presets, uint8_t count) {
+  uint32_t status = save_and_disable_interrupts();
+  synth->presets = presets;
+  synth->preset_count = presets ? count : 0;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Sets the presets of the default instance.
+ *
+ * @param presets The presets, indexed by the value of the events.
+ * @param count The number of presets.
+ */
+void synth_set_presets(const SynthPreset *presets, uint8_t count) {
+  synth_set_presets_ctx(synth_get_default(), presets, count);
+}
+
+/**
+ * @brief The 16-bit fields of a preset, in the order of the binary form.
+ */
+#define PRESET_WORDS (8 + SEND_COUNT)
+
+/**
+ * @brief Gets the 16-bit fields of a preset.
+ *
+ * @param preset The preset.
+ * @param words The fields, PRESET_WORDS values.
+ */
+static void get_words(const SynthPreset *preset, uint16_t *words) {
+  words[0] = preset->attack_ms;
+  words[1] = preset->decay_ms;
+  words[2] = preset->sustain;
+  words[3] = preset->release_ms;
+  words[4] = preset->volume;
+  words[5] = preset->pulse_width;
+  words[6] = preset->filter_cutoff;
+  words[7] = preset->noise_rate;
+  for(uint8_t s = 0; s < SEND_COUNT; s++) {
+    words[8 + s] = preset->sends[s];
+  }
+}
+
+/**
+ * @brief Sets the 16-bit fields of a preset.
+ *
+ * @param preset The preset.
+ * @param words The fields, PRESET_WORDS values.
+ */
+static void set_words(SynthPreset *preset, const uint16_t *words) {
+  preset->attack_ms = words[0];
+  preset->decay_ms = words[1];
+  preset->sustain = words[2];
+  preset->release_ms = words[3];
+  preset->volume = words[4];
+  preset->pulse_width = words[5];
+  preset->filter_cutoff = words[6];
+  preset->noise_rate = words[7];
+  for(uint8_t s = 0; s < SEND_COUNT; s++) {
+    preset->sends[s] = words[8 + s];
+  }
+}
+
+/**
+ * @brief Writes the binary form of a preset.
+ *
+ * @param preset The preset.
+ * @param out The buffer to write, SYNTH_PRESET_SIZE bytes.
+ */
+void synth_preset_encode(const SynthPreset *preset, uint8_t *out) {
+  uint16_t words[PRESET_WORDS];
+  get_words(preset, words);
+  out[0] = SYNTH_PRESET_VERSION;
+  out[1] = 0;
+  out[2] = preset->waveforms;
+  out[3] = preset->noise_mode;
+  for(uint8_t i = 0; i < PRESET_WORDS; i++) {
+    out[4 + 2 * i] = words[i] & 0xff;
+    out[5 + 2 * i] = words[i] >> 8;
+  }
+}
+
+/**
+ * @brief Reads the binary form of a preset.
+ *
+ * @param in The binary form, SYNTH_PRESET_SIZE bytes.
+ * @param preset The preset to fill.
+ *
+ * @return False if the data is not a preset of this version.
+ */
+bool synth_preset_decode(const uint8_t *in, SynthPreset *preset) {
+  if(in[0] != SYNTH_PRESET_VERSION) {
+    return false;
+  }
+  uint16_t words[PRESET_WORDS];
+  for(uint8_t i = 0; i < PRESET_WORDS; i++) {
+    words[i] = in[4 + 2 * i] | (in[5 + 2 * i] << 8);
+  }
+  preset->waveforms = in[2];
+  preset->noise_mode = in[3];
+  set_words(preset, words);
+  return true;
+}
@@ -0,0 +1,117 @@
+#ifndef PRESET_H
+#define PRESET_H
+
+/**
+ * @file preset.h
+ * @brief Header file for the voice preset module.
+ *
+ * A preset holds the sound of a voice: its waveforms, envelope, volume
+ * and effect sends, without the state of the note playing. Presets are
+ * plain constant structures, which stay in flash, and have a fixed
+ * 24-byte binary form for storage in flash sectors or files.
+ *
+ * A preset is applied to a channel with synth_apply_preset() before the
+ * synth starts, or through the event queue while it plays: the render
+ * copies it between two frames, so a program change can not be heard
+ * half applied. The note playing keeps its pitch and the current
+ * envelope phase; the new envelope times apply from the next phase.
+ */
+
+#include "pico/stdlib.h"
+#include "synth.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Version of the binary form, stored in its first byte.
+ */
+#define SYNTH_PRESET_VERSION 1
+
+/**
+ * @brief Size of the binary form of a preset, in bytes.
+ */
+#define SYNTH_PRESET_SIZE 24
+
+/**
+ * @struct SynthPreset
+ * @brief The settings of a voice, with the units of AudioChannel.
+ */
+typedef struct SynthPreset {
+  uint8_t   waveforms;      // bitmask of Waveform
+  uint8_t   noise_mode;     // one of NoiseMode
+  uint16_t  attack_ms;
+  uint16_t  decay_ms;
+  uint16_t  sustain;        // 0xffff is full volume
+  uint16_t  release_ms;
+  uint16_t  volume;
+  uint16_t  pulse_width;    // duty cycle of the square wave, 0 for 50%
+  uint16_t  filter_cutoff;  // filter cutoff frequency (Hz)
+  uint16_t  noise_rate;     // noise sample and hold rate (Hz), 0 to follow the frequency
+  uint16_t  sends[SEND_COUNT]; // levels sent to the master effects
+} SynthPreset;
+
+/**
+ * @brief Applies a preset to a channel.
+ *
+ * Use it before the synth starts, or from the render (EVENT_PRESET).
+ *
+ * @param channel The audio channel.
+ * @param preset The preset.
+ */
+void synth_apply_preset(AudioChannel *channel, const SynthPreset *preset);
+
+/**
+ * @brief Copies the settings of a channel into a preset.
+ *
+ * @param channel The audio channel.
+ * @param preset The preset to fill.
+ */
+void synth_capture_preset(const AudioChannel *channel, SynthPreset *preset);
+
+/**
+ * @brief Sets the presets EVENT_PRESET events select from.
+ *
+ * The presets are not copied and must stay valid, e.g. in flash.
+ *
+ * @param synth The synth instance.
+ * @param presets The presets, indexed by the value of the events.
+ * @param count The number of presets.
+ */
+void synth_set_presets_ctx(Synth *synth, const SynthPreset *presets, uint8_t count);
+
+/**
+ * @brief Sets the presets of the default instance.
+ *
+ * @param presets The presets, indexed by the value of the events.
+ * @param count The number of presets.
+ */
+void synth_set_presets(const SynthPreset *presets, uint8_t count);
+
+/**
+ * @brief Writes the binary form of a preset.
+ *
+ * The fields are stored in the order of SynthPreset, 16-bit values
+ * little-endian, after the version byte and a reserved byte.
+ *
+ * @param preset The preset.
+ * @param out The buffer to write, SYNTH_PRESET_SIZE bytes.
+ */
+void synth_preset_encode(const SynthPreset *preset, uint8_t *out);
+
+/**
+ * @brief Reads the binary form of a preset.
+ *
+ * @param in The binary form, SYNTH_PRESET_SIZE bytes.
+ * @param preset The preset to fill.
+ *
+ * @return False if the data is not a preset of this version.
+ */
+bool synth_preset_decode(const uint8_t *in, SynthPreset *preset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
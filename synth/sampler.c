@@ -0,0 +1,366 @@
+/**
+ * @file sampler.c
+ * @brief Implementation of the sampler module.
+ *
+ * Every voice decodes its sample into a ring of SAMPLER_PREFETCH_SIZE
+ * frames, in playback order: loops are unrolled by the decoder, so the
+ * renderer only ever reads forward. The ring is refilled once per block
+ * with sequential reads, which suit the flash cache; a voice playing
+ * faster than the ring holds a block of is rendered in shorter parts.
+ */
+
+#include "pico/stdlib.h"
+#include "sampler.h"
+#include "synth.h"
+
+/**
+ * @brief The sampler voices.
+ */
+SamplerVoice sampler_voices[SAMPLER_VOICE_COUNT];
+
+/**
+ * @brief The number of sampler voices in use.
+ */
+static uint8_t num_sampler_voices = 0;
+
+/**
+ * @brief Flag indicating whether the interpolation is skipped to save CPU time.
+ */
+static bool economy = false;
+
+/**
+ * @brief Amplitude below which a released voice is considered silent.
+ */
+#define SAMPLER_SILENCE 16
+
+/**
+ * @brief Highest playback rate (Q16).
+ */
+#define SAMPLER_MAX_INCREMENT ((uint32_t)SAMPLER_MAX_RATIO << 16)
+
+#define PREFETCH_MASK (SAMPLER_PREFETCH_SIZE - 1)
+
+/**
+ * @brief IMA-ADPCM quantizer step sizes.
+ */
+static const int16_t SYNTH_RAM_TABLE adpcm_steps[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+  11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+  32767
+};
+
+/**
+ * @brief IMA-ADPCM step index changes.
+ */
+static const int8_t SYNTH_RAM_TABLE adpcm_index_changes[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+/**
+ * @brief Initializes the sampler module.
+ *
+ * @param num_voices The number of sampler voices to use.
+ *
+ * @return A pointer to the sampler voices.
+ */
+SamplerVoice * sampler_init(uint8_t num_voices) {
+  num_sampler_voices = MIN(num_voices, SAMPLER_VOICE_COUNT);
+  for(uint8_t i = 0; i < num_sampler_voices; i++) {
+    sampler_voice_init(&sampler_voices[i], NULL);
+  }
+  return sampler_voices;
+}
+
+/**
+ * @brief Initializes a sampler voice.
+ *
+ * @param voice The voice to initialize.
+ * @param sample The sample played by the voice.
+ */
+void sampler_voice_init(SamplerVoice *voice, const Sample *sample) {
+  voice->sample      = sample;
+  voice->volume      = 0xffff;
+  voice->release_ms  = 0;
+  voice->interpolate = true;
+  voice->active      = false;
+  voice->looping     = false;
+}
+
+/**
+ * @brief Decodes frames of a sample into the prefetch buffer.
+ *
+ * @param voice The voice holding the decoder state.
+ * @param out Where to write the frames.
+ * @param count The number of frames to decode.
+ */
+static void SYNTH_RAM_FUNC(decode)(SamplerVoice *voice, int16_t *out, uint32_t count) {
+  const Sample *sample = voice->sample;
+  uint32_t pos = voice->source_pos;
+
+  switch(sample->format) {
+    case SAMPLE_PCM8: {
+      const int8_t *data = (const int8_t *)sample->data + pos;
+      for(uint32_t i = 0; i < count; i++) { out[i] = data[i] * 256; }
+      break;
+    }
+    case SAMPLE_PCM16: {
+      const int16_t *data = (const int16_t *)sample->data + pos;
+      for(uint32_t i = 0; i < count; i++) { out[i] = data[i]; }
+      break;
+    }
+    case SAMPLE_IMA_ADPCM: {
+      const uint8_t *data = (const uint8_t *)sample->data;
+      int32_t predictor = voice->adpcm_predictor;
+      int32_t index = voice->adpcm_index;
+      for(uint32_t i = 0; i < count; i++, pos++) {
+        uint8_t nibble = (data[pos >> 1] >> ((pos & 1) << 2)) & 0xf;
+        int32_t step = adpcm_steps[index];
+        int32_t diff = step >> 3;
+        if(nibble & 4) { diff += step; }
+        if(nibble & 2) { diff += step >> 1; }
+        if(nibble & 1) { diff += step >> 2; }
+        predictor += (nibble & 8) ? -diff : diff;
+        predictor = MIN(MAX(predictor, -0x8000), 0x7fff);
+        index = MIN(MAX(index + adpcm_index_changes[nibble & 7], 0), 88);
+        out[i] = predictor;
+      }
+      voice->adpcm_predictor = predictor;
+      voice->adpcm_index = index;
+      break;
+    }
+    default:
+      for(uint32_t i = 0; i < count; i++) { out[i] = 0; }
+      break;
+  }
+}
+
+/**
+ * @brief Decodes frames until the prefetch buffer reaches a stream position.
+ *
+ * @param voice The voice to fill.
+ * @param until The stream position to decode up to (excluded).
+ */
+static void SYNTH_RAM_FUNC(prefetch)(SamplerVoice *voice, uint32_t until) {
+  const Sample *sample = voice->sample;
+  while((int32_t)(until - voice->write_pos) > 0) {
+    int16_t *out = &voice->prefetch[voice->write_pos & PREFETCH_MASK];
+    uint32_t count = MIN(until - voice->write_pos,
+                         SAMPLER_PREFETCH_SIZE - (voice->write_pos & PREFETCH_MASK));
+
+    if(voice->ended) {
+      // silence after the end, for the interpolation of the last frame
+      for(uint32_t i = 0; i < count; i++) { out[i] = 0; }
+      voice->write_pos += count;
+      continue;
+    }
+
+    bool loop = voice->looping && sample->loop_end > sample->loop_start;
+    uint32_t boundary = loop ? sample->loop_end : sample->length;
+    if(loop && voice->source_pos < sample->loop_start) {
+      boundary = sample->loop_start; // stop there to save the decoder state
+    } else if(loop && voice->source_pos == sample->loop_start) {
+      voice->loop_predictor = voice->adpcm_predictor;
+      voice->loop_index = voice->adpcm_index;
+    }
+
+    if(voice->source_pos >= boundary) {
+      if(loop && boundary == sample->loop_end) {
+        voice->source_pos = sample->loop_start;
+        voice->adpcm_predictor = voice->loop_predictor;
+        voice->adpcm_index = voice->loop_index;
+      } else if(boundary >= sample->length) {
+        voice->ended = true;
+        voice->end_pos = voice->write_pos;
+      }
+      continue;
+    }
+
+    count = MIN(count, boundary - voice->source_pos);
+    decode(voice, out, count);
+    voice->source_pos += count;
+    voice->write_pos += count;
+  }
+}
+
+/**
+ * @brief Starts playing the sample of a voice.
+ *
+ * The playback rate is capped at SAMPLER_MAX_RATIO times the synth
+ * rate: higher notes play at that rate.
+ *
+ * @param voice The index of the sampler voice.
+ * @param frequency The pitch to play the sample at (Hz), 0 for its root pitch.
+ * @param velocity The velocity of the note, 0xffff is full.
+ */
+void sampler_trigger(uint8_t voice, uint16_t frequency, uint16_t velocity) {
+  if(voice >= num_sampler_voices || !sampler_voices[voice].sample) { return; }
+  SamplerVoice *v = &sampler_voices[voice];
+  const Sample *sample = v->sample;
+
+  uint64_t increment = ((uint64_t)sample->sample_rate << 16) / get_sample_rate();
+  if(frequency && sample->root_frequency) {
+    increment = increment * frequency / sample->root_frequency;
+  }
+  v->increment = MIN(increment, SAMPLER_MAX_INCREMENT);
+
+  v->velocity = velocity;
+  v->amp = 0xffff;
+  v->amp_k = 0x10000;
+  v->read_pos = 0;
+  v->read_frac = 0;
+  v->write_pos = 0;
+  v->end_pos = 0;
+  v->ended = false;
+  v->source_pos = 0;
+  v->adpcm_predictor = 0;
+  v->adpcm_index = 0;
+  v->loop_predictor = 0;
+  v->loop_index = 0;
+  v->looping = true;
+  v->active = true;
+}
+
+/**
+ * @brief Releases a voice: the sample leaves its loop and fades out.
+ *
+ * @param voice The index of the sampler voice.
+ */
+void sampler_release(uint8_t voice) {
+  if(voice >= num_sampler_voices) { return; }
+  SamplerVoice *v = &sampler_voices[voice];
+  v->looping = false;
+  if(v->release_ms) {
+    uint32_t frames = MAX((uint32_t)v->release_ms * get_sample_rate() / 1000, 8);
+    v->amp_k = 65536 - (452710 / frames); // 60dB over the release time
+  }
+}
+
+/**
+ * @brief Renders frames of a voice that the prefetch buffer holds, and
+ * adds them to the mix.
+ */
+static void SYNTH_RAM_FUNC(render_part)(SamplerVoice *v, int32_t *mix, uint32_t frames) {
+  // frames read by this block, plus one for the interpolation
+  uint32_t last = v->read_pos + ((v->read_frac + v->increment * frames) >> 16) + 1;
+  prefetch(v, last + 1);
+
+  const int16_t *ring = v->prefetch;
+  int32_t gain = ((uint32_t)v->volume * v->velocity) >> 16;
+  uint32_t pos = v->read_pos, frac = v->read_frac, increment = v->increment;
+  uint32_t amp = v->amp, amp_k = v->amp_k;
+
+  if(v->interpolate && !economy) {
+    for(uint32_t i = 0; i < frames; i++) {
+      int32_t s0 = ring[pos & PREFETCH_MASK];
+      int32_t s1 = ring[(pos + 1) & PREFETCH_MASK];
+      int32_t sample = s0 + (((s1 - s0) * (int32_t)(frac >> 1)) >> 15);
+      mix[i] += ((sample * (int32_t)amp) >> 16) * gain >> 16;
+      frac += increment;
+      pos += frac >> 16;
+      frac &= 0xffff;
+      amp = (amp * amp_k) >> 16;
+    }
+  } else {
+    for(uint32_t i = 0; i < frames; i++) {
+      int32_t sample = ring[pos & PREFETCH_MASK];
+      mix[i] += ((sample * (int32_t)amp) >> 16) * gain >> 16;
+      frac += increment;
+      pos += frac >> 16;
+      frac &= 0xffff;
+      amp = (amp * amp_k) >> 16;
+    }
+  }
+
+  v->read_pos = pos;
+  v->read_frac = frac;
+  v->amp = amp;
+  if((v->ended && (int32_t)(pos - v->end_pos) >= 0) || amp < SAMPLER_SILENCE) {
+    v->active = false;
+  }
+}
+
+/**
+ * @brief Renders a voice and adds it to the mix.
+ *
+ * The block is split into parts that never read past the prefetched
+ * frames: a single part up to (SAMPLER_PREFETCH_SIZE - 2) / SYNTH_BLOCK_SIZE
+ * times the sample rate.
+ */
+static void SYNTH_RAM_FUNC(render_voice)(SamplerVoice *v, int32_t *mix, uint32_t frames) {
+  uint32_t part = ((uint32_t)(SAMPLER_PREFETCH_SIZE - 2) << 16) / MAX(v->increment, 1);
+  for(uint32_t i = 0; i < frames && v->active; i += part) {
+    render_part(v, mix + i, MIN(part, frames - i));
+  }
+}
+
+/**
+ * @brief Renders the active sampler voices and adds them to the mix.
+ *
+ * @param mix The block to add the voices to.
+ * @param frames The number of frames to render.
+ */
+void SYNTH_RAM_FUNC(sampler_render)(int32_t *mix, uint32_t frames) {
+  for(uint8_t i = 0; i < num_sampler_voices; i++) {
+    if(sampler_voices[i].active) {
+      render_voice(&sampler_voices[i], mix, frames);
+    }
+  }
+}
+
+/**
+ * @brief Moves the playing sampler voices to a new sample rate.
+ *
+ * Called by the synth when its sample rate changes: the playback rate
+ * keeps the pitch, and a release in progress keeps its duration.
+ *
+ * @param old_rate The previous sample rate.
+ */
+void sampler_retarget(uint32_t old_rate) {
+  uint32_t sample_rate = get_sample_rate();
+  for(uint8_t i = 0; i < num_sampler_voices; i++) {
+    SamplerVoice *v = &sampler_voices[i];
+    if(!v->active) { continue; }
+    uint64_t increment = (uint64_t)v->increment * old_rate / sample_rate;
+    v->increment = MIN(increment, SAMPLER_MAX_INCREMENT);
+    if(v->amp_k < 0x10000) {
+      uint64_t distance = (uint64_t)(0x10000 - v->amp_k) * old_rate / sample_rate;
+      v->amp_k = 0x10000 - (uint32_t)MIN(distance, 452710 / 8);
+    }
+  }
+}
+
+/**
+ * @brief Skips the interpolation of all voices to save CPU time.
+ *
+ * @param _economy Flag indicating whether the voices play the nearest frame.
+ */
+void sampler_set_economy(bool _economy) {
+  economy = _economy;
+}
+
+/**
+ * @brief Checks if any sampler voice is playing.
+ *
+ * @return True if a sampler voice is playing, false otherwise.
+ */
+bool SYNTH_RAM_FUNC(sampler_playing)() {
+  for(uint8_t i = 0; i < num_sampler_voices; i++) {
+    if(sampler_voices[i].active) { return true; }
+  }
+  return false;
+}
+
+/**
+ * @brief Counts the sampler voices playing.
+ *
+ * @return The number of active sampler voices.
+ */
+uint8_t sampler_active_count() {
+  uint8_t count = 0;
+  for(uint8_t i = 0; i < num_sampler_voices; i++) {
+    count += sampler_voices[i].active;
+  }
+  return count;
+}
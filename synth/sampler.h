@@ -0,0 +1,93 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+/**
+ * @file sampler.h
+ * @brief Header file for the sampler module.
+ *
+ * Sampler voices play PCM or IMA-ADPCM samples straight from flash, with
+ * loop points, pitch control and linear interpolation. Samples are
+ * decoded a few blocks ahead into a small prefetch buffer, so long
+ * samples never need to be copied to RAM. They are mixed by the synth
+ * renderer alongside the audio channels and the drum voices; like them,
+ * they are part of the master bus of the default synth instance.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SAMPLER_VOICE_COUNT 4 // Number of maximum sampler voices
+#define SAMPLER_PREFETCH_SIZE 256 // Decoded frames per voice, must be a power of two
+#define SAMPLER_MAX_RATIO 16 // Highest playback rate over the synth rate: a rate divider of 4, two octaves up
+
+/**
+ * @enum SampleFormat
+ * @brief The encoding of sample data.
+ */
+enum SampleFormat {
+  SAMPLE_PCM8,      // signed 8-bit
+  SAMPLE_PCM16,     // signed 16-bit
+  SAMPLE_IMA_ADPCM  // 4-bit IMA-ADPCM, low nibble first, decoder starting at 0
+};
+
+/**
+ * @struct Sample
+ * @brief A sample, usually stored in flash.
+ */
+typedef struct Sample {
+  const void *data;         // encoded frames
+  uint8_t   format;         // one of SampleFormat
+  uint32_t  length;         // length in frames
+  uint32_t  loop_start;     // first frame of the loop
+  uint32_t  loop_end;       // frame after the loop, 0 for one-shot samples
+  uint32_t  sample_rate;    // rate the sample was recorded at
+  uint16_t  root_frequency; // pitch of the recording (Hz), 0 to ignore the played note
+} Sample;
+
+/**
+ * @struct SamplerVoice
+ * @brief A sampler voice, its settings and its state.
+ */
+typedef struct SamplerVoice {
+  const Sample *sample;     // sample played by the voice
+  uint16_t  volume;         // voice volume
+  uint16_t  release_ms;     // fade out time once released, 0 to play the sample to its end
+  bool      interpolate;    // linear interpolation between frames
+
+  bool      active;         // false once the sample has ended
+  bool      looping;        // false once released
+  uint16_t  velocity;       // velocity of the current note
+  uint32_t  amp;            // release envelope (Q16)
+  uint32_t  amp_k;          // release decay factor per frame (Q16)
+  uint32_t  increment;      // playback rate (Q16)
+  uint32_t  read_pos;       // position in the decoded stream
+  uint32_t  read_frac;      // fraction of the read position (Q16)
+  uint32_t  write_pos;      // frames decoded since the note started
+  uint32_t  end_pos;        // stream position of the end of the sample
+  bool      ended;          // the end of the sample has been decoded
+  uint32_t  source_pos;     // next frame of the sample to decode
+  int32_t   adpcm_predictor; // ADPCM decoder state
+  int8_t    adpcm_index;
+  int32_t   loop_predictor; // ADPCM decoder state at the loop start
+  int8_t    loop_index;
+  int16_t   prefetch[SAMPLER_PREFETCH_SIZE]; // decoded frames ahead of the read position
+} SamplerVoice;
+
+SamplerVoice * sampler_init(uint8_t num_voices);
+void sampler_voice_init(SamplerVoice *voice, const Sample *sample);
+void sampler_trigger(uint8_t voice, uint16_t frequency, uint16_t velocity);
+void sampler_release(uint8_t voice);
+void sampler_render(int32_t *mix, uint32_t frames);
+void sampler_retarget(uint32_t old_rate);
+bool sampler_playing();
+void sampler_set_economy(bool economy);
+uint8_t sampler_active_count();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,159 @@
+/**
+ * @file simd.c
+ * @brief Implementation of the vector mixing kernels.
+ *
+ * Every kernel processes SIMD_WIDTH frames per iteration and finishes
+ * the block with the scalar loop it replaces. Products the scalar code
+ * takes in 64 bits are taken in 64-bit lanes, and the division by the
+ * number of waveforms is a multiplication by its reciprocal with the
+ * rounding of C division, so the results are identical.
+ */
+
+#include <string.h>
+#include "pico/stdlib.h"
+#include "simd.h"
+
+#if SYNTH_USE_SIMD
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#endif
+
+// The vectors only pass between inlined functions of this file, so the
+// calling convention GCC warns about without AVX does not matter
+#if defined(__GNUC__) && !defined(__clang__)
+  #pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+typedef int32_t  v8i32 __attribute__((vector_size(32)));
+typedef uint32_t v8u32 __attribute__((vector_size(32)));
+typedef int64_t  v4i64 __attribute__((vector_size(32)));
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+/**
+ * @brief Signed division by 1 to 6 as a multiplication (Hacker's Delight, 10-1).
+ *
+ * The quotient is the high half of the product, shifted. For powers of
+ * two, the shift is the whole division.
+ */
+static const struct { int32_t magic; uint8_t shift; } divisors[] = {
+  { 0, 0 },          // unused
+  { 0, 0 },          // 1
+  { 0, 1 },          // 2
+  { 0x55555556, 0 }, // 3
+  { 0, 2 },          // 4
+  { 0x66666667, 1 }, // 5
+  { 0x2aaaaaab, 0 }, // 6
+};
+
+static inline v8i32 load(const int32_t *p) {
+  v8i32 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline void store(int32_t *p, v8i32 v) {
+  memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * @brief Multiplies the even lanes into 64-bit products.
+ */
+static inline v4i64 mul_even(v8i32 a, v8i32 b) {
+#if defined(__AVX2__)
+  return (v4i64)_mm256_mul_epi32((__m256i)a, (__m256i)b);
+#else
+  v4i64 a64 = (v4i64)a, b64 = (v4i64)b;
+  return ((a64 << 32) >> 32) * ((b64 << 32) >> 32);
+#endif
+}
+
+/**
+ * @brief Multiplies in 64 bits and shifts, truncating the result to 32 bits.
+ *
+ * The even and the odd lanes are multiplied apart, as the low halves of
+ * the 64-bit lanes they form in pairs (the host is little-endian). Only
+ * the low 32 bits of each shifted product are kept, so a logical shift
+ * gives them for shifts up to 32.
+ */
+static inline v8i32 mul_shift(v8i32 a, v8i32 b, uint8_t shift) {
+  v4u64 even = (v4u64)mul_even(a, b) >> shift;
+  v4u64 odd = (v4u64)mul_even((v8i32)((v4u64)a >> 32), (v8i32)((v4u64)b >> 32)) >> shift;
+  return (v8i32)((even & 0xffffffff) | (odd << 32));
+}
+
+/**
+ * @brief Divides by the number of waveforms, truncating towards zero.
+ */
+static inline v8i32 divide(v8i32 x, uint8_t divisor) {
+  if(divisor == 1) { return x; }
+  int32_t magic = divisors[divisor].magic;
+  uint8_t shift = divisors[divisor].shift;
+  // the rounding towards zero adds one to negative quotients
+  v8i32 negative = (v8i32)((v8u32)x >> 31);
+  if(magic == 0) {
+    return (x + (negative << shift) - negative) >> shift;
+  }
+  v8i32 m = (v8i32){ 0 } + magic;
+  return (mul_shift(x, m, 32) >> shift) + negative;
+}
+
+uint32_t simd_envelope(int32_t *block, uint32_t frames, uint32_t adsr, int32_t adsr_step,
+                       uint8_t waveform_count, int32_t gain) {
+  uint32_t i = 0;
+  if(waveform_count >= 1 && waveform_count < count_of(divisors)) {
+    v8u32 envelope = (v8u32){ 1, 2, 3, 4, 5, 6, 7, 8 } * (uint32_t)adsr_step + adsr;
+    v8u32 step = (v8u32){ 0 } + (uint32_t)adsr_step * SIMD_WIDTH;
+    v8i32 gains = (v8i32){ 0 } + gain;
+    for(; i + SIMD_WIDTH <= frames; i += SIMD_WIDTH) {
+      v8i32 sample = divide(load(block + i), waveform_count);
+      sample = mul_shift(sample, (v8i32)(envelope >> 8), 16);
+      store(block + i, mul_shift(sample, gains, 16));
+      envelope += step;
+    }
+    adsr += (uint32_t)adsr_step * i;
+  }
+  for(; i < frames; i++) {
+    adsr += adsr_step;
+    int32_t sample = block[i] / waveform_count;
+    sample = (int64_t)sample * ((int32_t)(adsr >> 8)) >> 16;
+    block[i] = (int64_t)sample * gain >> 16;
+  }
+  return adsr;
+}
+
+void simd_add(int32_t *out, const int32_t *in, uint32_t frames) {
+  uint32_t i = 0;
+  for(; i + SIMD_WIDTH <= frames; i += SIMD_WIDTH) {
+    store(out + i, load(out + i) + load(in + i));
+  }
+  for(; i < frames; i++) {
+    out[i] += in[i];
+  }
+}
+
+void simd_add_scaled(int32_t *out, const int32_t *in, int32_t level, uint32_t frames) {
+  uint32_t i = 0;
+  v8u32 levels = (v8u32){ 0 } + (uint32_t)level;
+  for(; i + SIMD_WIDTH <= frames; i += SIMD_WIDTH) {
+    // 32-bit product, wrapping as the scalar one does on every target
+    v8i32 product = (v8i32)((v8u32)load(in + i) * levels);
+    store(out + i, load(out + i) + (product >> 16));
+  }
+  for(; i < frames; i++) {
+    out[i] += (in[i] * level) >> 16;
+  }
+}
+
+void simd_scale(int32_t *block, int32_t volume, uint32_t frames) {
+  uint32_t i = 0;
+  v8i32 volumes = (v8i32){ 0 } + volume;
+  for(; i + SIMD_WIDTH <= frames; i += SIMD_WIDTH) {
+    store(block + i, mul_shift(load(block + i), volumes, 16));
+  }
+  for(; i < frames; i++) {
+    block[i] = (int64_t)block[i] * volume >> 16;
+  }
+}
+
+#endif
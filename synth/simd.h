@@ -0,0 +1,92 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+/**
+ * @file simd.h
+ * @brief Header file for the vector mixing kernels.
+ *
+ * Block versions of the per-frame integer loops of the channel mixer:
+ * the envelope and gain, the sum into the mix and the effect sends, and
+ * the output volume. They are written with the vector extensions of GCC
+ * and Clang, eight 32-bit frames at a time, and give the same results
+ * as the scalar loops bit for bit.
+ *
+ * The 64-bit products of the envelope and the volume need the widening
+ * multiplication of AVX2 to be faster than the scalar loops, so
+ * SYNTH_USE_SIMD defaults to 1 on hosts compiled for AVX2 (-mavx2 or
+ * -march=native). Other GCC and Clang targets, such as NEON, can define
+ * it to 1 as well. On the RP2040, which has no vector unit, the synth
+ * keeps its scalar loops and this module compiles to nothing.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SYNTH_USE_SIMD
+  #if !PICO_ON_DEVICE && defined(__GNUC__) && defined(__AVX2__)
+    #define SYNTH_USE_SIMD 1
+  #else
+    #define SYNTH_USE_SIMD 0
+  #endif
+#endif
+
+/**
+ * @brief Number of frames processed by each vector operation.
+ */
+#define SIMD_WIDTH 8
+
+/**
+ * @brief Applies an envelope and a gain to a block.
+ *
+ * For each frame, the envelope is advanced by its step, the sample is
+ * divided by the number of waveforms mixed into it, scaled by the
+ * envelope (Q24, used as Q16 after >> 8) and by the gain (Q16).
+ *
+ * @param block The samples, replaced by the result.
+ * @param frames The number of frames.
+ * @param adsr The envelope before the first frame.
+ * @param adsr_step The envelope increment per frame.
+ * @param waveform_count The number of waveforms, 1 to 6.
+ * @param gain The gain (Q16).
+ *
+ * @return The envelope after the last frame.
+ */
+uint32_t simd_envelope(int32_t *block, uint32_t frames, uint32_t adsr, int32_t adsr_step,
+                       uint8_t waveform_count, int32_t gain);
+
+/**
+ * @brief Adds a block to another.
+ *
+ * @param out The block to add to.
+ * @param in The block to add.
+ * @param frames The number of frames.
+ */
+void simd_add(int32_t *out, const int32_t *in, uint32_t frames);
+
+/**
+ * @brief Adds a block scaled by a level to another, as the effect sends.
+ *
+ * @param out The block to add to.
+ * @param in The block to add.
+ * @param level The level (Q16, 32-bit product).
+ * @param frames The number of frames.
+ */
+void simd_add_scaled(int32_t *out, const int32_t *in, int32_t level, uint32_t frames);
+
+/**
+ * @brief Scales a block by a volume.
+ *
+ * @param block The samples, replaced by the result.
+ * @param volume The volume (Q16, 64-bit product).
+ * @param frames The number of frames.
+ */
+void simd_scale(int32_t *block, int32_t volume, uint32_t frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,204 +9,838 @@
  */
 
 #include "pico/stdlib.h"
+#include "hardware/clocks.h"
 #include "synth.h"
+#include "drums.h"
+#include "sampler.h"
+#include "effects.h"
+#include "dynamics.h"
+#include "telemetry.h"
+#include "tap.h"
+#include "governor.h"
+#include "simd.h"
+#include "preset.h"
+#include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#if SYNTH_USE_INTERP
+  #include "hardware/interp.h"
+#endif
 
 /**
- * @brief The audio channels.
+ * @brief The value of pi.
  */
-AudioChannel channels[CHANNEL_COUNT];
+const float pi = 3.14159265358979323846f;
+
+static void channel_init(AudioChannel *channel);
 
 /**
- * @brief The value of pi.
+ * @brief The bits of the waveforms that select an oscillator. A channel
+ * with none of them is not rendered, as it would mix zero waveforms.
  */
-const float pi = 3.14159265358979323846f;
+#define WAVEFORM_MASK (NOISE | SQUARE | SAW | TRIANGLE | SINE | WAVE)
+
+/**
+ * @brief The default synth instance, used by the functions without a
+ * Synth parameter. It renders the master bus.
+ */
+static Synth default_synth = {
+  .sample_rate = 44100,
+  .output_rate = 44100,
+  .rate_divider = 1,
+  .volume = 0xffff,
+  .master_bus = true,
+  .output_block = default_synth.output_buffer
+};
+
+/**
+ * @brief The sine waveform sample.
+ */
+const int16_t SYNTH_RAM_TABLE sine_waveform[256] = {-32768,-32758,-32729,-32679,-32610,-32522,-32413,-32286,-32138,-31972,-31786,-31581,-31357,-31114,-30853,-30572,-30274,-29957,-29622,-29269,-28899,-28511,-28106,-27684,-27246,-26791,-26320,-25833,-25330,-24812,-24279,-23732,-23170,-22595,-22006,-21403,-20788,-20160,-19520,-18868,-18205,-17531,-16846,-16151,-15447,-14733,-14010,-13279,-12540,-11793,-11039,-10279,-9512,-8740,-7962,-7180,-6393,-5602,-4808,-4011,-3212,-2411,-1608,-804,0,804,1608,2411,3212,4011,4808,5602,6393,7180,7962,8740,9512,10279,11039,11793,12540,13279,14010,14733,15447,16151,16846,17531,18205,18868,19520,20160,20788,21403,22006,22595,23170,23732,24279,24812,25330,25833,26320,26791,27246,27684,28106,28511,28899,29269,29622,29957,30274,30572,30853,31114,31357,31581,31786,31972,32138,32286,32413,32522,32610,32679,32729,32758,32767,32758,32729,32679,32610,32522,32413,32286,32138,31972,31786,31581,31357,31114,30853,30572,30274,29957,29622,29269,28899,28511,28106,27684,27246,26791,26320,25833,25330,24812,24279,23732,23170,22595,22006,21403,20788,20160,19520,18868,18205,17531,16846,16151,15447,14733,14010,13279,12540,11793,11039,10279,9512,8740,7962,7180,6393,5602,4808,4011,3212,2411,1608,804,0,-804,-1608,-2411,-3212,-4011,-4808,-5602,-6393,-7180,-7962,-8740,-9512,-10279,-11039,-11793,-12540,-13279,-14010,-14733,-15447,-16151,-16846,-17531,-18205,-18868,-19520,-20160,-20788,-21403,-22006,-22595,-23170,-23732,-24279,-24812,-25330,-25833,-26320,-26791,-27246,-27684,-28106,-28511,-28899,-29269,-29622,-29957,-30274,-30572,-30853,-31114,-31357,-31581,-31786,-31972,-32138,-32286,-32413,-32522,-32610,-32679,-32729,-32758};
+
+/**
+ * @brief Checks if audio is currently playing.
+ *
+ * @param synth The synth instance.
+ *
+ * @return True if audio is playing, false otherwise.
+ */
+bool is_audio_playing_ctx(Synth *synth) {
+  if(synth->volume == 0) {
+    return false;
+  }
+
+  bool any_channel_playing = false;
+  for(int c = 0; c < CHANNEL_COUNT; c++) {
+    if(synth->channels[c].volume > 0 && synth->channels[c].adsr_phase != ADSR_OFF) {
+      any_channel_playing = true;
+    }
+  }
+  if(!synth->master_bus) {
+    return any_channel_playing;
+  }
+
+  return any_channel_playing || drums_playing() || sampler_playing() || effects_playing();
+}
+
+/**
+ * @brief Checks if the default instance is playing.
+ *
+ * @return True if audio is playing, false otherwise.
+ */
+bool is_audio_playing() {
+  return is_audio_playing_ctx(&default_synth);
+}
+
+/**
+ * @brief Releases the quietest channel playing, to save CPU time.
+ *
+ * The channel fades out over SYNTH_STEAL_RELEASE_MS, whatever its
+ * release time.
+ *
+ * @param synth The synth instance.
+ *
+ * @return True if a channel was released, false if none is playing.
+ */
+bool synth_steal_voice_ctx(Synth *synth) {
+  uint32_t sample_rate = synth->sample_rate;
+  AudioChannel *quietest = NULL;
+  uint64_t lowest = UINT64_MAX;
+  for(int c = 0; c < CHANNEL_COUNT; c++) {
+    AudioChannel *channel = &synth->channels[c];
+    if(channel->adsr_phase == ADSR_OFF || !channel->waveforms) { continue; }
+    // a channel already fading out quickly is left alone
+    if(channel->adsr_phase == RELEASE &&
+       channel->adsr_end_frame - channel->adsr_frame <= SYNTH_STEAL_RELEASE_MS * sample_rate / 1000) {
+      continue;
+    }
+    uint64_t level = (uint64_t)(channel->adsr >> 8) * channel->volume * channel->velocity;
+    if(level < lowest) {
+      lowest = level;
+      quietest = channel;
+    }
+  }
+  if(!quietest) { return false; }
+
+  quietest->adsr_frame = 0;
+  quietest->adsr_phase = RELEASE;
+  quietest->adsr_end_frame = MAX(SYNTH_STEAL_RELEASE_MS * sample_rate / 1000, 1);
+  quietest->adsr_step = -(int32_t)quietest->adsr / (int32_t)quietest->adsr_end_frame;
+  return true;
+}
+
+/**
+ * @brief Releases the quietest channel of the default instance.
+ *
+ * @return True if a channel was released, false if none is playing.
+ */
+bool synth_steal_voice() {
+  return synth_steal_voice_ctx(&default_synth);
+}
 
 /**
- * @brief The state of the XOR shift PRNG.
+ * @brief Counts the voices playing: channels, drums and sampler voices.
+ *
+ * @param synth The synth instance.
+ *
+ * @return The number of voices playing.
  */
-uint32_t prng_xorshift_state = 0x32B71700;
+uint8_t synth_active_voices_ctx(Synth *synth) {
+  uint8_t count = 0;
+  for(int c = 0; c < CHANNEL_COUNT; c++) {
+    count += synth->channels[c].adsr_phase != ADSR_OFF;
+  }
+  if(!synth->master_bus) {
+    return count;
+  }
+  return count + drums_active_count() + sampler_active_count();
+}
 
 /**
- * @brief The sample rate of the audio output.
+ * @brief Counts the voices playing in the default instance.
+ *
+ * @return The number of voices playing.
  */
-uint32_t sample_rate = 44100;
+uint8_t synth_active_voices() {
+  return synth_active_voices_ctx(&default_synth);
+}
 
 /**
- * @brief Generates the next value in the XOR shift PRNG sequence.
+ * @brief Applies an event to its target channel.
  *
- * @return The next value in the sequence.
+ * Drum and sampler events are ignored by instances without the master bus.
+ *
+ * @param synth The synth instance.
+ * @param event The event to apply.
  */
-uint32_t prng_xorshift_next() {
-  uint32_t x = prng_xorshift_state;
+static void SYNTH_RAM_FUNC(apply_event)(Synth *synth, const SynthEvent *event) {
+  AudioChannel *channel = &synth->channels[event->channel % CHANNEL_COUNT];
+  if(event->type >= EVENT_DRUM && event->type <= EVENT_SAMPLE_OFF && !synth->master_bus) { return; }
+  switch(event->type) {
+    case EVENT_NOTE_ON:
+      channel->frequency = event->value;
+      channel->velocity = event->velocity;
+      trigger_attack(channel);
+      break;
+    case EVENT_NOTE_OFF:
+      // a silent channel has nothing to release
+      if(channel->adsr_phase != ADSR_OFF) {
+        trigger_release(channel);
+      }
+      break;
+    case EVENT_PARAM:
+      synth_set_param(channel, event->param, event->value);
+      break;
+    case EVENT_DRUM:
+      drums_trigger(event->channel, event->velocity);
+      break;
+    case EVENT_SAMPLE_ON:
+      sampler_trigger(event->channel, event->value, event->velocity);
+      break;
+    case EVENT_SAMPLE_OFF:
+      sampler_release(event->channel);
+      break;
+    case EVENT_PRESET:
+      if(event->value < synth->preset_count) {
+        synth_apply_preset(channel, &synth->presets[event->value]);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * @brief Generates the next white noise value.
+ *
+ * A xorshift LFSR, one step per value.
+ *
+ * @param channel The audio channel holding the generator state.
+ *
+ * @return A value with a uniform distribution over the 16-bit range.
+ */
+static inline int32_t noise_white(AudioChannel *channel) {
+  uint32_t x = channel->noise_state;
   x ^= x << 13;
   x ^= x >> 17;
   x ^= x << 5;
-  prng_xorshift_state = x;
-  return x;
+  channel->noise_state = x;
+  return (int16_t)(x >> 16);
 }
 
 /**
- * @brief Generates a random value with a rough approximation of a normal distribution.
+ * @brief Generates the next noise value in the channel's noise mode.
+ *
+ * @param channel The audio channel holding the generator state.
  *
  * @return The generated value.
  */
-int32_t prng_normal() {
-  // rough approximation of a normal distribution
-  uint32_t r0 = prng_xorshift_next();
-  uint32_t r1 = prng_xorshift_next();
-  uint32_t n = ((r0 & 0xffff) + (r1 & 0xffff) + (r0 >> 16) + (r1 >> 16)) / 2;
-  return n - 0xffff;
+static inline int32_t noise_next(AudioChannel *channel) {
+  int32_t white;
+  int32_t *b = channel->noise_filter;
+
+  switch(channel->noise_mode) {
+    case NOISE_PINK:
+      // Paul Kellet's economy pink filter (-3dB/octave), coefficients in Q15.
+      // the input is scaled down to keep the filter state within 32 bits
+      white = noise_white(channel) >> 3;
+      b[0] = ((b[0] * 32691) >> 15) + ((white * 3245) >> 15);
+      b[1] = ((b[1] * 31555) >> 15) + ((white * 9716) >> 15);
+      b[2] = ((b[2] * 18678) >> 15) + ((white * 34494) >> 15);
+      white = (b[0] + b[1] + b[2] + ((white * 6056) >> 15)) * 2;
+      return white < -0x7fff ? -0x7fff : (white > 0x7fff ? 0x7fff : white);
+
+    case NOISE_BROWN:
+      // Leaky integrator (-6dB/octave)
+      b[0] += noise_white(channel) >> 4;
+      b[0] -= b[0] >> 7;
+      white = b[0] * 2;
+      return white < -0x7fff ? -0x7fff : (white > 0x7fff ? 0x7fff : white);
+
+    case NOISE_METALLIC: {
+      // Short 15-bit LFSR, its 93 steps period gives a metallic tone
+      uint32_t x = channel->noise_state & 0x7fff;
+      if(x == 0) { x = 1; }
+      x = (x >> 1) | (((x ^ (x >> 6)) & 1) << 14);
+      channel->noise_state = (channel->noise_state & ~0x7fffu) | x;
+      return (x & 1) ? 0x4000 : -0x4000;
+    }
+
+    default:
+      return noise_white(channel);
+  }
 }
 
+#if SYNTH_USE_INTERP
 /**
- * @brief The volume of the audio output.
+ * @brief Interpolator state of the code the render interrupted.
  */
-uint16_t volume = 0xffff;
+static interp_hw_save_t interp_saved;
 
 /**
- * @brief The sine waveform sample.
+ * @brief Sets up interp1 to address the sine table.
+ *
+ * Lane 0 accumulates the phase (Q16) and returns it unchanged, while
+ * the full result is the table base plus the top byte of the phase,
+ * scaled to 16-bit entries: one pop per frame steps the phase and
+ * gives the address of its sample.
  */
-const int16_t sine_waveform[256] = {-32768,-32758,-32729,-32679,-32610,-32522,-32413,-32286,-32138,-31972,-31786,-31581,-31357,-31114,-30853,-30572,-30274,-29957,-29622,-29269,-28899,-28511,-28106,-27684,-27246,-26791,-26320,-25833,-25330,-24812,-24279,-23732,-23170,-22595,-22006,-21403,-20788,-20160,-19520,-18868,-18205,-17531,-16846,-16151,-15447,-14733,-14010,-13279,-12540,-11793,-11039,-10279,-9512,-8740,-7962,-7180,-6393,-5602,-4808,-4011,-3212,-2411,-1608,-804,0,804,1608,2411,3212,4011,4808,5602,6393,7180,7962,8740,9512,10279,11039,11793,12540,13279,14010,14733,15447,16151,16846,17531,18205,18868,19520,20160,20788,21403,22006,22595,23170,23732,24279,24812,25330,25833,26320,26791,27246,27684,28106,28511,28899,29269,29622,29957,30274,30572,30853,31114,31357,31581,31786,31972,32138,32286,32413,32522,32610,32679,32729,32758,32767,32758,32729,32679,32610,32522,32413,32286,32138,31972,31786,31581,31357,31114,30853,30572,30274,29957,29622,29269,28899,28511,28106,27684,27246,26791,26320,25833,25330,24812,24279,23732,23170,22595,22006,21403,20788,20160,19520,18868,18205,17531,16846,16151,15447,14733,14010,13279,12540,11793,11039,10279,9512,8740,7962,7180,6393,5602,4808,4011,3212,2411,1608,804,0,-804,-1608,-2411,-3212,-4011,-4808,-5602,-6393,-7180,-7962,-8740,-9512,-10279,-11039,-11793,-12540,-13279,-14010,-14733,-15447,-16151,-16846,-17531,-18205,-18868,-19520,-20160,-20788,-21403,-22006,-22595,-23170,-23732,-24279,-24812,-25330,-25833,-26320,-26791,-27246,-27684,-28106,-28511,-28899,-29269,-29622,-29957,-30274,-30572,-30853,-31114,-31357,-31581,-31786,-31972,-32138,-32286,-32413,-32522,-32610,-32679,-32729,-32758};
+static void interp_begin() {
+  interp_save(interp1, &interp_saved);
+  interp_config cfg = interp_default_config();
+  interp_config_set_add_raw(&cfg, true);
+  interp_config_set_shift(&cfg, 7);
+  interp_config_set_mask(&cfg, 1, 8);
+  interp_set_config(interp1, 0, &cfg);
+  cfg = interp_default_config();
+  interp_set_config(interp1, 1, &cfg);
+  interp1->accum[1] = 0;
+  interp1->base[1] = 0;
+  interp1->base[2] = (uintptr_t)sine_waveform;
+}
 
 /**
- * @brief Checks if audio is currently playing.
+ * @brief Gives interp1 back to the code the render interrupted.
+ */
+static void interp_end() {
+  interp_restore(interp1, &interp_saved);
+}
+#else
+static void interp_begin() { ; }
+static void interp_end() { ; }
+#endif
+
+/**
+ * @brief Renders the sine waveform of a channel into a block.
  *
- * @return True if audio is playing, false otherwise.
+ * Both versions read the same table entries, so the output does not
+ * depend on the backend.
+ *
+ * @param osc The block to add the waveform to.
+ * @param frames The number of frames to render.
+ * @param offset The waveform position before the block (Q16).
+ * @param increment The phase increment per frame (Q16).
  */
-bool is_audio_playing() {
-  if(volume == 0) {
-    return false;
+static inline void render_sine(int32_t *osc, uint32_t frames, uint32_t offset, uint32_t increment) {
+#if SYNTH_USE_INTERP
+  interp1->accum[0] = offset + increment;
+  interp1->base[0] = increment;
+  for(uint32_t i = 0; i < frames; i++) {
+    osc[i] += *(const int16_t *)(uintptr_t)interp1->pop[2];
+  }
+#else
+  // the sine_waveform sample contains 256 samples in
+  // total so we'll just use the most significant bits
+  // of the current waveform position to index into it
+  uint32_t o = offset;
+  for(uint32_t i = 0; i < frames; i++) {
+    o = (o + increment) & 0xffff;
+    osc[i] += sine_waveform[o >> 8];
   }
+#endif
+}
 
-  bool any_channel_playing = false;
-  for(int c = 0; c < CHANNEL_COUNT; c++) {
-    if(channels[c].volume > 0 && channels[c].adsr_phase != ADSR_OFF) {
-      any_channel_playing = true;
+/**
+ * @brief Renders the noise of a channel into a block.
+ *
+ * The noise is sampled and held at the channel's noise rate, or at its
+ * frequency when no noise rate is set, up to the sample rate.
+ *
+ * @param channel The audio channel to render.
+ * @param osc The block to add the noise to.
+ * @param frames The number of frames to render.
+ * @param increment The phase increment of the channel frequency (Q16).
+ */
+static void SYNTH_RAM_FUNC(render_noise)(AudioChannel *channel, int32_t *osc, uint32_t frames, uint32_t increment) {
+  if(channel->noise_rate) {
+    increment = ((uint32_t)channel->noise_rate << 16) / channel->synth->sample_rate;
+  }
+  // At or above the sample rate, a new value on every frame
+  increment = MIN(increment, 0xffff);
+  uint32_t offset = channel->noise_offset;
+  int32_t value = channel->noise;
+
+  for(uint32_t i = 0; i < frames; i++) {
+    offset += increment;
+    if(offset & 0x10000) {
+      offset &= 0xffff;
+      value = noise_next(channel);
     }
+    osc[i] += value;
   }
 
-  return any_channel_playing;
+  channel->noise_offset = offset;
+  channel->noise = value;
 }
 
 /**
- * @brief Generates a single audio frame.
+ * @brief Renders a channel and adds it to the mix.
  *
- * @return The generated audio frame.
+ * Each enabled waveform is rendered by its own loop over the block, then
+ * the envelope and the channel volume are applied.
+ *
+ * @param channel The audio channel to render.
+ * @param mix The block to add the channel to.
+ * @param sends The blocks to add the channel effect sends to.
+ * @param frames The number of frames to render.
  */
-int16_t get_audio_frame() {
-  int32_t sample = 0;  // used to combine channel output
+static void SYNTH_RAM_FUNC(render_channel)(AudioChannel *channel, int32_t *mix,
+                           int32_t sends[SEND_COUNT][SYNTH_BLOCK_SIZE], uint32_t frames) {
+  // increment of the waveform position counter. this provides an
+  // Q16 fixed point value representing how far through
+  // the current waveform we are
+  uint32_t increment = ((uint32_t)channel->frequency << 16) / channel->synth->sample_rate;
+  uint32_t offset = channel->waveform_offset;
+  channel->waveform_offset = (offset + increment * frames) & 0xffff;
 
-  for(int c = 0; c < CHANNEL_COUNT; c++) {
+  if(channel->adsr_phase == ADSR_OFF || !(channel->waveforms & WAVEFORM_MASK)) {
+    return;
+  }
 
-    // increment the waveform position counter. this provides an
-    // Q16 fixed point value representing how far through
-    // the current waveform we are
-    channels[c].waveform_offset += ((channels[c].frequency * 256) << 8) / sample_rate;
+  int32_t osc[SYNTH_BLOCK_SIZE];
+  uint8_t waveform_count = 0;
+  for(uint32_t i = 0; i < frames; i++) { osc[i] = 0; }
 
-    if(channels[c].adsr_phase == ADSR_OFF) {
-      continue;
+  if(channel->waveforms & NOISE) {
+    render_noise(channel, osc, frames, increment);
+    waveform_count++;
+  }
+
+  if(channel->waveforms & SAW) {
+    uint32_t o = offset;
+    for(uint32_t i = 0; i < frames; i++) {
+      o = (o + increment) & 0xffff;
+      osc[i] += (int32_t)o - 0x7fff;
     }
+    waveform_count++;
+  }
 
-    if ((channels[c].adsr_frame >= channels[c].adsr_end_frame) && (channels[c].adsr_phase != SUSTAIN)) {
-      switch (channels[c].adsr_phase) {
+  // creates a triangle wave of ^
+  if(channel->waveforms & TRIANGLE) {
+    uint32_t o = offset;
+    for(uint32_t i = 0; i < frames; i++) {
+      o = (o + increment) & 0xffff;
+      if(o < 0x7fff) { // initial quarter up slope
+        osc[i] += (int32_t)(o * 2) - (int32_t)0x7fff;
+      } else { // final quarter up slope
+        osc[i] += (int32_t)0x7fff - (((int32_t)o - (int32_t)0x7fff) * 2);
+      }
+    }
+    waveform_count++;
+  }
+
+  if(channel->waveforms & SQUARE) {
+    uint32_t o = offset;
+    for(uint32_t i = 0; i < frames; i++) {
+      o = (o + increment) & 0xffff;
+      osc[i] += (o < channel->pulse_width) ? 0x7fff : -0x7fff;
+    }
+    waveform_count++;
+  }
+
+  if(channel->waveforms & SINE) {
+    render_sine(osc, frames, offset, increment);
+    waveform_count++;
+  }
+
+  if(channel->waveforms & WAVE) {
+    int16_t wave[SYNTH_BLOCK_SIZE];
+    channel->oscillator(channel, wave, frames, offset, increment);
+    for(uint32_t i = 0; i < frames; i++) {
+      osc[i] += wave[i];
+    }
+    waveform_count++;
+  }
+
+  // apply the envelope and the channel volume, scaled by the note velocity.
+  // the envelope is linear within a phase, so it is processed in segments
+  // that end at the next phase change
+  int32_t gain = (int32_t)(((uint32_t)channel->volume * channel->velocity) >> 16);
+  uint32_t i = 0;
+  while(i < frames) {
+    if((channel->adsr_frame >= channel->adsr_end_frame) && (channel->adsr_phase != SUSTAIN)) {
+      switch(channel->adsr_phase) {
         case ATTACK:
-        trigger_decay(&channels[c]);
-        break;
-      case DECAY:
-        trigger_sustain(&channels[c]);
-        break;
-      case RELEASE:
-        adsr_off(&channels[c]);
+          trigger_decay(channel);
+          break;
+        case DECAY:
+          trigger_sustain(channel);
+          break;
+        case RELEASE:
+          adsr_off(channel);
           break;
         default:
           break;
       }
     }
+    if(channel->adsr_phase == ADSR_OFF) {
+      break;
+    }
 
-    channels[c].adsr += channels[c].adsr_step;
-    channels[c].adsr_frame++;
+    uint32_t segment = frames - i;
+    if(channel->adsr_phase != SUSTAIN) {
+      segment = MIN(segment, channel->adsr_end_frame - channel->adsr_frame);
+    }
+#if SYNTH_USE_SIMD
+    channel->adsr = simd_envelope(osc + i, segment, channel->adsr, channel->adsr_step,
+                                  waveform_count, gain);
+    i += segment;
+#else
+    uint32_t adsr = channel->adsr;
+    int32_t adsr_step = channel->adsr_step;
+    for(uint32_t end = i + segment; i < end; i++) {
+      adsr += adsr_step;
+      int32_t channel_sample = osc[i] / waveform_count;
+      channel_sample = (int64_t)channel_sample * ((int32_t)(adsr >> 8)) >> 16;
+      osc[i] = (int64_t)channel_sample * gain >> 16;
+    }
+    channel->adsr = adsr;
+#endif
+    channel->adsr_frame += segment;
+  }
 
-    if(channels[c].waveform_offset & 0x10000) {
-      // if the waveform offset overflows then generate a new
-      // random noise sample
-      channels[c].noise = prng_normal();
+  // i is now the number of frames rendered before the envelope ended
+  uint32_t rendered = i;
+#if SYNTH_USE_SIMD
+  simd_add(mix, osc, rendered);
+  for(uint8_t s = 0; s < SEND_COUNT; s++) {
+    if(channel->sends[s]) { simd_add_scaled(sends[s], osc, channel->sends[s], rendered); }
+  }
+#else
+  for(i = 0; i < rendered; i++) {
+    mix[i] += osc[i];
+  }
+  for(uint8_t s = 0; s < SEND_COUNT; s++) {
+    int32_t send = channel->sends[s];
+    if(send == 0) { continue; }
+    for(i = 0; i < rendered; i++) {
+      sends[s][i] += (osc[i] * send) >> 16;
     }
+  }
+#endif
+}
 
-    channels[c].waveform_offset &= 0xffff;
+/**
+ * @brief Applies the events that are due, and finds the next one.
+ *
+ * @param synth The synth instance.
+ * @param frames The number of frames about to be rendered.
+ *
+ * @return The number of frames that can be rendered before the next event.
+ */
+static uint32_t SYNTH_RAM_FUNC(apply_events)(Synth *synth, uint32_t frames) {
+  while(synth->event_head != synth->event_tail) {
+    const SynthEvent *event = &synth->event_queue[synth->event_head];
+    int32_t until = (int32_t)(event->frame - synth->frame_count);
+    if(until > 0) {
+      return MIN(frames, (uint32_t)until);
+    }
+    if(until < 0 && synth->master_bus) {
+      TELEMETRY_LATE_EVENT();
+    }
+    apply_event(synth, event);
+    synth->event_head = (synth->event_head + 1) & (SYNTH_EVENT_QUEUE_SIZE - 1);
+  }
+  return frames;
+}
 
-    // check if any waveforms are active for this channels[c]
-    if(channels[c].waveforms) {
-      uint8_t waveform_count = 0;
-      int32_t channel_sample = 0;
+/**
+ * @brief Bytes taken by a frame in each output format.
+ */
+static const uint8_t SYNTH_RAM_TABLE format_frame_bytes[] = { 2, 2, 4, 8 };
 
-      if(channels[c].waveforms & NOISE) {
-        channel_sample += channels[c].noise;
-        waveform_count++;
+/**
+ * @brief Writes a block of the mix in the packing of an output format.
+ *
+ * Inlined with a constant format, each case is its own loop with no
+ * branch on the format inside.
+ *
+ * @param buffer The buffer to write to.
+ * @param mix The mix, already limited to 16 bits.
+ * @param frames The number of frames to write.
+ * @param format The output format, one of SynthFormat.
+ */
+static inline void write_block(void *buffer, const int32_t *mix, uint32_t frames, uint8_t format) {
+  switch(format) {
+    case SYNTH_FORMAT_STEREO8: {
+      // left in the high byte, shifted out first
+      uint16_t *out = (uint16_t *)buffer;
+      for(uint32_t i = 0; i < frames; i++) {
+        out[i] = (uint8_t)(mix[i] >> 8) * 0x0101u;
       }
-
-      if(channels[c].waveforms & SAW) {
-        channel_sample += (int32_t)channels[c].waveform_offset - 0x7fff;
-        waveform_count++;
+      break;
+    }
+    case SYNTH_FORMAT_STEREO16: {
+      uint32_t *out = (uint32_t *)buffer;
+      for(uint32_t i = 0; i < frames; i++) {
+        out[i] = (uint16_t)mix[i] * 0x00010001u;
       }
-
-      // creates a triangle wave of ^
-      if (channels[c].waveforms & TRIANGLE) {
-        if (channels[c].waveform_offset < 0x7fff) { // initial quarter up slope
-          channel_sample += (int32_t)(channels[c].waveform_offset * 2) - (int32_t)0x7fff;
-        }
-        else { // final quarter up slope
-          channel_sample += (int32_t)0x7fff - (((int32_t)channels[c].waveform_offset - (int32_t)0x7fff) * 2);
-        }
-        waveform_count++;
+      break;
+    }
+    case SYNTH_FORMAT_STEREO32: {
+      // 16-bit samples, left-justified in 32-bit slots
+      uint32_t *out = (uint32_t *)buffer;
+      for(uint32_t i = 0; i < frames; i++) {
+        out[2 * i] = out[2 * i + 1] = (uint32_t)mix[i] << 16;
       }
-
-      if (channels[c].waveforms & SQUARE) {
-        channel_sample += (channels[c].waveform_offset < channels[c].pulse_width) ? 0x7fff : -0x7fff;
-        waveform_count++;
+      break;
+    }
+    default: {
+      int16_t *out = (int16_t *)buffer;
+      for(uint32_t i = 0; i < frames; i++) {
+        out[i] = mix[i];
       }
+      break;
+    }
+  }
+}
 
-      if(channels[c].waveforms & SINE) {
-        // the sine_waveform sample contains 256 samples in
-        // total so we'll just use the most significant bits
-        // of the current waveform position to index into it
-        channel_sample += sine_waveform[channels[c].waveform_offset >> 8];
-        waveform_count++;
-      }
+/**
+ * @brief Upsamples a block to the output rate.
+ *
+ * Each output frame is a 4-point Catmull-Rom interpolation of the
+ * rendered frames, with the coefficients of its phase precomputed.
+ *
+ * @param synth The synth instance.
+ * @param out The block to fill, frames * rate_divider frames long.
+ * @param in The rendered frames, limited to 16 bits.
+ * @param frames The number of rendered frames.
+ */
+static void SYNTH_RAM_FUNC(upsample)(Synth *synth, int32_t *out, const int32_t *in, uint32_t frames) {
+  int32_t *history = synth->upsample_history;
+  int32_t h0 = history[0], h1 = history[1], h2 = history[2];
+  uint8_t rate_divider = synth->rate_divider;
+  for(uint32_t i = 0; i < frames; i++) {
+    int32_t x = in[i];
+    for(uint8_t k = 0; k < rate_divider; k++) {
+      const int32_t *c = synth->upsample_coeffs[k];
+      int32_t y = (h0 * c[0] + h1 * c[1] + h2 * c[2] + x * c[3]) >> 14;
+      *out++ = MIN(MAX(y, -0x8000), 0x7fff);
+    }
+    h0 = h1; h1 = h2; h2 = x;
+  }
+  history[0] = h0;
+  history[1] = h1;
+  history[2] = h2;
+}
 
-      if(channels[c].waveforms & WAVE) {
-        channel_sample += channels[c].wave_buffer[channels[c].wave_buf_pos];
-        if (++channels[c].wave_buf_pos == 64) {
-          channels[c].wave_buf_pos = 0;
-          channels[c].wave_buffer_callback(&channels[c]);
-        }
-        waveform_count++;
-      }
+/**
+ * @brief Computes the upsampler coefficients for the current divider.
+ *
+ * For t = k / divider, the Catmull-Rom weights of the four frames
+ * around the output frame are exact in Q14, as the divider is a power
+ * of two.
+ *
+ * @param synth The synth instance.
+ */
+static void upsample_init(Synth *synth) {
+  int32_t d = synth->rate_divider, den = 2 * d * d * d;
+  for(int32_t k = 0; k < d; k++) {
+    int32_t k2 = k * k, k3 = k2 * k;
+    int32_t *c = synth->upsample_coeffs[k];
+    c[0] = (-k3 + 2 * k2 * d - k * d * d) * 16384 / den;
+    c[1] = (3 * k3 - 5 * k2 * d + 2 * d * d * d) * 16384 / den;
+    c[2] = (-3 * k3 + 4 * k2 * d + k * d * d) * 16384 / den;
+    c[3] = (k3 - k2 * d) * 16384 / den;
+  }
+  synth->upsample_history[0] = synth->upsample_history[1] = synth->upsample_history[2] = 0;
+  synth->output_pos = synth->output_length = 0;
+}
+
+/**
+ * @brief Checks if the next block can only be silence.
+ *
+ * Every channel is off and, on the master bus, the drums and samples
+ * are over, the effect returns are below EFFECTS_SILENCE and the
+ * dynamics have settled. The events due are applied before, so a note
+ * breaks the silence on its own frame.
+ *
+ * @param synth The synth instance.
+ *
+ * @return True if the block can be skipped.
+ */
+static bool SYNTH_RAM_FUNC(is_idle)(const Synth *synth) {
+  for(int c = 0; c < CHANNEL_COUNT; c++) {
+    const AudioChannel *channel = &synth->channels[c];
+    if(channel->adsr_phase != ADSR_OFF && channel->waveforms) { return false; }
+  }
+  if(!synth->master_bus) {
+    return true;
+  }
+  return !drums_playing() && !sampler_playing() && !effects_playing() && dynamics_idle();
+}
 
-      channel_sample = channel_sample / waveform_count;
-      channel_sample = (int64_t)channel_sample * ((int32_t)(channels[c].adsr >> 8)) >> 16;
+/**
+ * @brief Renders a block at the internal rate.
+ *
+ * The block ends early at the frame the next event is scheduled for.
+ * Instances without the master bus clip their channels to 16 bits.
+ * While the synth is idle, the block is filled with zeros without
+ * mixing anything, which is what keeps an idle synth cheap.
+ *
+ * @param synth The synth instance.
+ * @param frames The largest number of frames to render.
+ *
+ * @return The number of frames rendered into the mix buffer.
+ */
+static uint32_t SYNTH_RAM_FUNC(render_block)(Synth *synth, uint32_t frames) {
+  uint32_t block = apply_events(synth, frames);
+  int32_t *mix_buffer = synth->mix_buffer;
+
+  for(uint32_t i = 0; i < block; i++) { mix_buffer[i] = 0; }
+  synth->idle = is_idle(synth);
+  if(synth->idle) {
+    // Silence: the channels only move their oscillator phase, and the
+    // buses are left as mixing zeros would leave them
+    for(int c = 0; c < CHANNEL_COUNT; c++) {
+      render_channel(&synth->channels[c], mix_buffer, synth->send_buffer, block);
+    }
+    if(synth->master_bus) {
+      dynamics_skip(block);
+    }
+    synth->frame_count += block;
+    return block;
+  }
+  for(uint8_t s = 0; s < SEND_COUNT; s++) {
+    for(uint32_t i = 0; i < block; i++) { synth->send_buffer[s][i] = 0; }
+  }
+  for(int c = 0; c < CHANNEL_COUNT; c++) {
+    render_channel(&synth->channels[c], mix_buffer, synth->send_buffer, block);
+  }
+  if(synth->master_bus) {
+    drums_render(mix_buffer, block);
+    sampler_render(mix_buffer, block);
+    effects_render(mix_buffer, synth->send_buffer, block);
+  }
 
-      // apply channel volume
-      channel_sample = (int64_t)channel_sample * (int32_t)channels[c].volume >> 16;
+#if SYNTH_USE_SIMD
+  simd_scale(mix_buffer, synth->volume, block);
+#else
+  for(uint32_t i = 0; i < block; i++) {
+    mix_buffer[i] = (int64_t)mix_buffer[i] * (int32_t)synth->volume >> 16;
+  }
+#endif
+  // limit, or clip, the result to 16-bit
+  if(synth->master_bus) {
+    dynamics_process(mix_buffer, block);
+  } else {
+    for(uint32_t i = 0; i < block; i++) {
+      mix_buffer[i] = MIN(MAX(mix_buffer[i], -0x8000), 0x7fff);
+    }
+  }
 
-      // apply channel filter
-      //if (channel.filter_enable) {
-        //float filter_epow = 1 - expf(-(1.0f / 22050.0f) * 2.0f * pi * (int32_t)(channel.filter_cutoff_frequency));
-        //channel_sample += (channel_sample - channel.filter_last_sample) * filter_epow;
-      //}
+  synth->frame_count += block;
+  return block;
+}
 
-      //channel.filter_last_sample = channel_sample;
+/**
+ * @brief Renders audio frames in an output format.
+ *
+ * Frames are rendered in blocks of up to SYNTH_BLOCK_SIZE frames, split
+ * at the frames events are scheduled for. When the internal rate is
+ * lower than the output rate, each block is upsampled. The last pass
+ * over each block writes the frames straight in the packing of the output.
+ *
+ * @param synth The synth instance.
+ * @param buffer The buffer to fill.
+ * @param frames The number of frames to render, at the output rate.
+ * @param format The output format, one of SynthFormat.
+ */
+void SYNTH_RAM_FUNC(synth_render_format_ctx)(Synth *synth, void *buffer, uint32_t frames, uint8_t format) {
+  // The modules of the master bus keep a single state, which only the
+  // default instance may render
+  assert(!synth->master_bus || synth == &default_synth);
+  uint8_t *out = (uint8_t *)buffer;
+  if(format > SYNTH_FORMAT_STEREO32) { format = SYNTH_FORMAT_MONO16; }
+  bool governed = synth->master_bus && governor_is_enabled();
+  uint32_t start_us = governed ? time_us_32() : 0;
+  uint32_t total = frames;
+  uint8_t rate_divider = synth->rate_divider;
+  interp_begin();
+  while(frames > 0) {
+    if(synth->output_pos == synth->output_length) {
+      if(rate_divider == 1) {
+        synth->output_length = render_block(synth, MIN(frames, SYNTH_BLOCK_SIZE));
+        synth->output_block = synth->mix_buffer;
+      } else {
+        uint32_t block = render_block(synth, MIN((frames + rate_divider - 1) / rate_divider,
+                                                 SYNTH_BLOCK_SIZE / rate_divider));
+        const int32_t *history = synth->upsample_history;
+        if(synth->idle && !(history[0] | history[1] | history[2])) {
+          for(uint32_t i = 0; i < block * rate_divider; i++) { synth->output_buffer[i] = 0; }
+        } else {
+          upsample(synth, synth->output_buffer, synth->mix_buffer, block);
+        }
+        synth->output_length = block * rate_divider;
+        synth->output_block = synth->output_buffer;
+      }
+      synth->output_pos = 0;
+    }
 
-      // combine channel sample into the final sample
-      sample += channel_sample;
+    uint32_t block = MIN(frames, synth->output_length - synth->output_pos);
+    const int32_t *mix = synth->output_block + synth->output_pos;
+    switch(format) {
+      case SYNTH_FORMAT_STEREO8:  write_block(out, mix, block, SYNTH_FORMAT_STEREO8); break;
+      case SYNTH_FORMAT_STEREO16: write_block(out, mix, block, SYNTH_FORMAT_STEREO16); break;
+      case SYNTH_FORMAT_STEREO32: write_block(out, mix, block, SYNTH_FORMAT_STEREO32); break;
+      default:                    write_block(out, mix, block, SYNTH_FORMAT_MONO16); break;
+    }
+    if(synth->master_bus) {
+      TAP_WRITE(mix, block);
     }
+
+    synth->output_pos += block;
+    out += block * format_frame_bytes[format];
+    frames -= block;
   }
 
-  sample = (int64_t)sample * (int32_t)volume >> 16;
+  interp_end();
+  if(governed) {
+    governor_update(time_us_32() - start_us, total);
+  }
+}
+
+/**
+ * @brief Renders audio frames of the default instance in an output format.
+ *
+ * @param buffer The buffer to fill.
+ * @param frames The number of frames to render, at the output rate.
+ * @param format The output format, one of SynthFormat.
+ */
+void SYNTH_RAM_FUNC(synth_render_format)(void *buffer, uint32_t frames, uint8_t format) {
+  synth_render_format_ctx(&default_synth, buffer, frames, format);
+}
 
-  // clip result to 16-bit
-  sample = sample <= -0x8000 ? -0x8000 : (sample > 0x7fff ? 0x7fff : sample);
-  return sample;
+/**
+ * @brief Renders audio frames.
+ *
+ * @param synth The synth instance.
+ * @param buffer The buffer to fill with 16-bit mono frames.
+ * @param frames The number of frames to render.
+ */
+void SYNTH_RAM_FUNC(synth_render_ctx)(Synth *synth, int16_t *buffer, uint32_t frames) {
+  synth_render_format_ctx(synth, buffer, frames, SYNTH_FORMAT_MONO16);
+}
+
+/**
+ * @brief Renders audio frames of the default instance.
+ *
+ * @param buffer The buffer to fill with 16-bit mono frames.
+ * @param frames The number of frames to render.
+ */
+void SYNTH_RAM_FUNC(synth_render)(int16_t *buffer, uint32_t frames) {
+  synth_render_format_ctx(&default_synth, buffer, frames, SYNTH_FORMAT_MONO16);
+}
+
+/**
+ * @brief Generates a single audio frame.
+ *
+ * @return The generated audio frame.
+ */
+int16_t get_audio_frame() {
+  int16_t frame;
+  synth_render(&frame, 1);
+  return frame;
 }
 
 /**
@@ -217,19 +851,82 @@ int16_t get_audio_frame() {
 static void noop(AudioChannel *channel){;}
 
 /**
- * @brief Initializes the synth module.
+ * @brief The default oscillator, playing the samples of wave_buffer.
  *
+ * wave_buffer_callback is called every time the 64 samples have been
+ * played, to refill the buffer. New code should use synth_set_oscillator(),
+ * which renders whole blocks without a callback in the middle of them.
+ */
+static void SYNTH_RAM_FUNC(wave_buffer_oscillator)(AudioChannel *channel, int16_t *block,
+                                   uint32_t frames, uint32_t offset, uint32_t increment) {
+  for(uint32_t i = 0; i < frames; i++) {
+    block[i] = channel->wave_buffer[channel->wave_buf_pos];
+    if(++channel->wave_buf_pos == 64) {
+      channel->wave_buf_pos = 0;
+      channel->wave_buffer_callback(channel);
+    }
+  }
+}
+
+/**
+ * @brief Gets the default synth instance.
+ *
+ * @return The instance used by the functions without a Synth parameter.
+ */
+Synth * synth_get_default() {
+  return &default_synth;
+}
+
+/**
+ * @brief Initializes a synth instance.
+ *
+ * Only the default instance renders the master bus (drums, sampler,
+ * effects and dynamics).
+ *
+ * @param synth The synth instance.
  * @param num_voices The number of voices to initialize.
  * @param _sample_rate The sample rate of the audio output.
  *
  * @return A pointer to the initialized audio channels.
  */
-AudioChannel * synth_init(uint8_t num_voices, uint32_t _sample_rate) {
-  sample_rate = _sample_rate;
+AudioChannel * synth_init_ctx(Synth *synth, uint8_t num_voices, uint32_t _sample_rate) {
+  if(synth != &default_synth) {
+    // the default instance keeps the settings made before its initialization
+    memset(synth, 0, sizeof(*synth));
+    synth->rate_divider = 1;
+    synth->volume = 0xffff;
+  }
+  synth->master_bus = (synth == &default_synth);
+  synth->output_rate = _sample_rate;
+  synth->sample_rate = synth->output_rate / synth->rate_divider;
+  synth->output_block = synth->output_buffer;
+  upsample_init(synth);
+  if(synth->master_bus) {
+    dynamics_init();
+  }
+  for(uint8_t c = 0; c < CHANNEL_COUNT; c++) {
+    synth->channels[c].synth = synth;
+    // the channels past num_voices are not rendered: they never play
+    synth->channels[c].adsr_phase = ADSR_OFF;
+  }
   for(uint8_t i = 0; i < num_voices; i++) {
-    channel_init(&channels[i]);
+    channel_init(&synth->channels[i]);
+    // every channel has its own noise sequence
+    synth->channels[i].noise_state = 0x32B71700 + i * 0x9E3779B9;
   }
-  return channels;
+  return synth->channels;
+}
+
+/**
+ * @brief Initializes the synth module.
+ *
+ * @param num_voices The number of voices to initialize.
+ * @param _sample_rate The sample rate of the audio output.
+ *
+ * @return A pointer to the initialized audio channels.
+ */
+AudioChannel * synth_init(uint8_t num_voices, uint32_t _sample_rate) {
+  return synth_init_ctx(&default_synth, num_voices, _sample_rate);
 }
 
 /**
@@ -241,37 +938,71 @@ static void channel_init(AudioChannel *channel) {
   channel->waveforms     = 0;      // bitmask for enabled waveforms
   channel->frequency     = 660;    // frequency of the voice (Hz)
   channel->volume        = 0xffff; // channel volume (default 50%)
+  channel->velocity      = 0xffff; // velocity of the current note
   channel->attack_ms     = 2;      // attack period
   channel->decay_ms      = 6;      // decay period
   channel->sustain       = 0xffff; // sustain volume
   channel->release_ms    = 1;      // release period
   channel->pulse_width   = 0x7fff; // duty cycle of square wave (default 50%)
   channel->noise         = 0;      // current noise value
+  channel->noise_mode    = NOISE_WHITE;
+  channel->noise_rate    = 0;      // follow the channel frequency
+  channel->noise_offset  = 0;
+  channel->noise_state   = 0x32B71700;
+  channel->noise_filter[0] = 0;
+  channel->noise_filter[1] = 0;
+  channel->noise_filter[2] = 0;
   channel->waveform_offset  = 0;   // voice offset (Q8)
   channel->filter_last_sample = 0;
   channel->filter_enable = false;
   channel->filter_cutoff_frequency = 0;
+  channel->sends[SEND_DELAY] = 0;
+  channel->sends[SEND_REVERB] = 0;
   channel->adsr_frame    = 0;      // number of frames into the current ADSR phase
   channel->adsr_end_frame = 0;     // frame target at which the ADSR changes to the next phase
   channel->adsr          = 0;
   channel->adsr_step     = 0;
   channel->adsr_phase    = ADSR_OFF;
   channel->wave_buf_pos  = 0;      //
-  channel->wave_buffer[64];        // buffer for arbitrary waveforms. small as it's filled by user callback
+  memset(channel->wave_buffer, 0, sizeof(channel->wave_buffer)); // buffer for arbitrary waveforms
   channel->user_data     = NULL;
   channel->wave_buffer_callback = noop;
+  channel->oscillator    = wave_buffer_oscillator;
+  channel->oscillator_cost = 0;
 };
 
+/**
+ * @brief Starts a linear phase of the ADSR envelope.
+ *
+ * The length is computed in 64 bits, as ms * sample_rate overflows 32
+ * bits for the longest phases, and the step is truncated towards zero,
+ * so the level can not pass the target. A phase shorter than one frame
+ * jumps to its target, and ends before the next frame is rendered.
+ *
+ * @param channel The audio channel.
+ * @param phase The phase to start.
+ * @param ms The length of the phase in milliseconds.
+ * @param target The level at the end of the phase (Q24).
+ */
+static void start_phase(AudioChannel *channel, enum ADSRPhase phase, uint16_t ms, int32_t target) {
+  channel->adsr_frame = 0;
+  channel->adsr_phase = phase;
+  channel->adsr_end_frame = (uint32_t)((uint64_t)ms * channel->synth->sample_rate / 1000);
+  if(channel->adsr_end_frame == 0) {
+    channel->adsr = target;
+    channel->adsr_step = 0;
+    return;
+  }
+  channel->adsr_step = (target - (int32_t)channel->adsr) / (int32_t)channel->adsr_end_frame;
+}
+
 /**
  * @brief Triggers the attack phase of the ADSR envelope.
  *
  * @param channel The audio channel to trigger the attack phase for.
  */
 void trigger_attack(AudioChannel *channel)  {
-  channel->adsr_frame = 0;
-  channel->adsr_phase = ATTACK;
-  channel->adsr_end_frame = (channel->attack_ms * sample_rate) / 1000;
-  channel->adsr_step = (int32_t)(0xffffff - (int32_t)channel->adsr) / (int32_t)channel->adsr_end_frame;
+  start_phase(channel, ATTACK, channel->attack_ms, 0xffffff);
 }
 
 /**
@@ -280,10 +1011,7 @@ void trigger_attack(AudioChannel *channel)  {
  * @param channel The audio channel to trigger the decay phase for.
  */
 void trigger_decay(AudioChannel *channel) {
-  channel->adsr_frame = 0;
-  channel->adsr_phase = DECAY;
-  channel->adsr_end_frame = (channel->decay_ms * sample_rate) / 1000;
-  channel->adsr_step = (int32_t)((channel->sustain << 8) - (int32_t)channel->adsr) / (int32_t)channel->adsr_end_frame;
+  start_phase(channel, DECAY, channel->decay_ms, channel->sustain << 8);
 }
 
 /**
@@ -304,10 +1032,7 @@ void trigger_sustain(AudioChannel *channel) {
  * @param channel The audio channel to trigger the release phase for.
  */
 void trigger_release(AudioChannel *channel) {
-  channel->adsr_frame = 0;
-  channel->adsr_phase = RELEASE;
-  channel->adsr_end_frame = (channel->release_ms * sample_rate) / 1000;
-  channel->adsr_step = (int32_t)(0 - (int32_t)channel->adsr) / (int32_t)channel->adsr_end_frame;
+  start_phase(channel, RELEASE, channel->release_ms, 0);
 }
 
 /**
@@ -321,29 +1046,393 @@ void adsr_off(AudioChannel *channel) {
   channel->adsr_step = 0;
 }
 
+/**
+ * @brief Queues an event to be applied at a given frame.
+ *
+ * Events are kept sorted by frame; events scheduled for the same frame
+ * are applied in the order they were queued. Events scheduled in the past
+ * are applied before the next rendered frame.
+ *
+ * @param synth The synth instance.
+ * @param event The event to queue. Its frame is an absolute synth frame,
+ *              see synth_get_frame().
+ *
+ * @return True if the event was queued, false if the queue is full.
+ */
+bool synth_queue_event_ctx(Synth *synth, const SynthEvent *event) {
+  uint32_t status = save_and_disable_interrupts();
+
+  uint8_t head = synth->event_head;
+  uint8_t next_tail = (synth->event_tail + 1) & (SYNTH_EVENT_QUEUE_SIZE - 1);
+  if(next_tail == head) {
+    restore_interrupts(status);
+    if(synth->master_bus) {
+      TELEMETRY_DROPPED_EVENT();
+    }
+    return false;
+  }
+
+  // insertion sort from the tail, the sequencer queues events almost
+  // in order so this rarely moves more than a couple of entries
+  SynthEvent *queue = synth->event_queue;
+  uint8_t i = synth->event_tail;
+  while(i != head) {
+    uint8_t prev = (i - 1) & (SYNTH_EVENT_QUEUE_SIZE - 1);
+    if((int32_t)(queue[prev].frame - event->frame) <= 0) { break; }
+    queue[i] = queue[prev];
+    i = prev;
+  }
+  queue[i] = *event;
+  synth->event_tail = next_tail;
+
+  restore_interrupts(status);
+  return true;
+}
+
+/**
+ * @brief Queues an event on the default instance.
+ *
+ * @param event The event to queue.
+ *
+ * @return True if the event was queued, false if the queue is full.
+ */
+bool synth_queue_event(const SynthEvent *event) {
+  return synth_queue_event_ctx(&default_synth, event);
+}
+
+/**
+ * @brief Discards all pending events.
+ *
+ * @param synth The synth instance.
+ */
+void synth_clear_events_ctx(Synth *synth) {
+  uint32_t status = save_and_disable_interrupts();
+  synth->event_head = synth->event_tail;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Discards all pending events of the default instance.
+ */
+void synth_clear_events() {
+  synth_clear_events_ctx(&default_synth);
+}
+
+/**
+ * @brief Gets the number of events waiting to be applied.
+ *
+ * @param synth The synth instance.
+ *
+ * @return The depth of the event queue.
+ */
+uint8_t synth_event_queue_depth_ctx(Synth *synth) {
+  return (synth->event_tail - synth->event_head) & (SYNTH_EVENT_QUEUE_SIZE - 1);
+}
+
+/**
+ * @brief Gets the number of events waiting to be applied by the default instance.
+ *
+ * @return The depth of the event queue.
+ */
+uint8_t synth_event_queue_depth() {
+  return synth_event_queue_depth_ctx(&default_synth);
+}
+
+/**
+ * @brief Gets the number of frames rendered so far.
+ *
+ * @param synth The synth instance.
+ *
+ * @return The index of the next frame to be rendered.
+ */
+uint32_t synth_get_frame_ctx(Synth *synth) {
+  return synth->frame_count;
+}
+
+/**
+ * @brief Gets the number of frames rendered so far by the default instance.
+ *
+ * @return The index of the next frame to be rendered.
+ */
+uint32_t synth_get_frame() {
+  return default_synth.frame_count;
+}
+
+/**
+ * @brief Sets a channel parameter.
+ *
+ * @param channel The audio channel to modify.
+ * @param param The parameter to set, one of SynthParam.
+ * @param value The new value.
+ */
+void synth_set_param(AudioChannel *channel, uint8_t param, uint16_t value) {
+  switch(param) {
+    case PARAM_WAVEFORMS:     channel->waveforms = value; break;
+    case PARAM_VOLUME:        channel->volume = value; break;
+    case PARAM_ATTACK_MS:     channel->attack_ms = value; break;
+    case PARAM_DECAY_MS:      channel->decay_ms = value; break;
+    case PARAM_SUSTAIN:       channel->sustain = value; break;
+    case PARAM_RELEASE_MS:    channel->release_ms = value; break;
+    case PARAM_PULSE_WIDTH:   channel->pulse_width = value; break;
+    case PARAM_FILTER_CUTOFF: channel->filter_cutoff_frequency = value; break;
+    case PARAM_NOISE_MODE:    channel->noise_mode = value; break;
+    case PARAM_NOISE_RATE:    channel->noise_rate = value; break;
+    case PARAM_DELAY_SEND:    channel->sends[SEND_DELAY] = value; break;
+    case PARAM_REVERB_SEND:   channel->sends[SEND_REVERB] = value; break;
+    default: break;
+  }
+}
+
+/**
+ * @brief Gets a channel parameter.
+ *
+ * @param channel The audio channel to read.
+ * @param param The parameter to get, one of SynthParam.
+ *
+ * @return The current value of the parameter.
+ */
+uint16_t synth_get_param(const AudioChannel *channel, uint8_t param) {
+  switch(param) {
+    case PARAM_WAVEFORMS:     return channel->waveforms;
+    case PARAM_VOLUME:        return channel->volume;
+    case PARAM_ATTACK_MS:     return channel->attack_ms;
+    case PARAM_DECAY_MS:      return channel->decay_ms;
+    case PARAM_SUSTAIN:       return channel->sustain;
+    case PARAM_RELEASE_MS:    return channel->release_ms;
+    case PARAM_PULSE_WIDTH:   return channel->pulse_width;
+    case PARAM_FILTER_CUTOFF: return channel->filter_cutoff_frequency;
+    case PARAM_NOISE_MODE:    return channel->noise_mode;
+    case PARAM_NOISE_RATE:    return channel->noise_rate;
+    case PARAM_DELAY_SEND:    return channel->sends[SEND_DELAY];
+    case PARAM_REVERB_SEND:   return channel->sends[SEND_REVERB];
+    default:                  return 0;
+  }
+}
+
+/**
+ * @brief Sets the oscillator rendering the WAVE waveform of a channel.
+ *
+ * The oscillator declares its worst case cost, in CPU cycles per frame.
+ * It is refused if the oscillators of all channels would then take more
+ * than SYNTH_OSCILLATOR_BUDGET percent of the frame time, so a custom
+ * waveform can not make the renderer miss its deadline.
+ *
+ * @param channel The audio channel.
+ * @param oscillator The oscillator, or NULL for the wave_buffer oscillator.
+ * @param cost The worst case cost of the oscillator (cycles per frame).
+ *
+ * @return True if the oscillator was set, false if it is over budget.
+ */
+bool synth_set_oscillator(AudioChannel *channel, SynthOscillator oscillator, uint16_t cost) {
+  if(!oscillator) {
+    oscillator = wave_buffer_oscillator;
+    cost = 0;
+  }
+
+  // the budget is shared by the channels of the instance
+  Synth *synth = channel->synth;
+  uint32_t total = cost;
+  for(uint8_t c = 0; c < CHANNEL_COUNT; c++) {
+    if(&synth->channels[c] != channel) { total += synth->channels[c].oscillator_cost; }
+  }
+  uint32_t budget = clock_get_hz(clk_sys) / synth->sample_rate * SYNTH_OSCILLATOR_BUDGET / 100;
+  if(total > budget) {
+    return false;
+  }
+
+  uint32_t status = save_and_disable_interrupts();
+  channel->oscillator = oscillator;
+  channel->oscillator_cost = cost;
+  restore_interrupts(status);
+  return true;
+}
+
 /**
  * @brief Sets the volume of the audio output.
  *
+ * @param synth The synth instance.
  * @param percent The volume as a percentage (0-100).
  */
-void set_volume(uint8_t percent) {
+void set_volume_ctx(Synth *synth, uint8_t percent) {
    // Clamp the input value to the range of 0-100
     if (percent <= 0) {
-        volume = 0;
+        synth->volume = 0;
         return;
     } else if (percent > 100) {
-        volume = 0xFFFF;
+        synth->volume = 0xFFFF;
         return;
     }
-    volume = percent * 0xFFFF / 100;
+    synth->volume = percent * 0xFFFF / 100;
+}
+
+/**
+ * @brief Sets the volume of the default instance.
+ *
+ * @param percent The volume as a percentage (0-100).
+ */
+void set_volume(uint8_t percent) {
+  set_volume_ctx(&default_synth, percent);
+}
+
+/**
+ * @brief Moves the envelope of a channel to a new sample rate.
+ *
+ * The time left in the current phase is kept, and the step is
+ * recomputed to reach the same level at its end.
+ */
+static void retarget_channel(AudioChannel *channel, uint32_t old_rate) {
+  int32_t target;
+  switch(channel->adsr_phase) {
+    case ATTACK:  target = 0xffffff; break;
+    case DECAY:   target = channel->sustain << 8; break;
+    case RELEASE: target = 0; break;
+    default:      return;
+  }
+  uint32_t left = channel->adsr_end_frame > channel->adsr_frame ?
+                  channel->adsr_end_frame - channel->adsr_frame : 0;
+  left = (uint32_t)((uint64_t)left * channel->synth->sample_rate / old_rate);
+  channel->adsr_frame = 0;
+  channel->adsr_end_frame = left;
+  channel->adsr_step = left ? (target - (int32_t)channel->adsr) / (int32_t)left : 0;
+}
+
+/**
+ * @brief Recomputes everything derived from the sample rate.
+ *
+ * Envelopes in progress, the pending events and the coefficients of the
+ * drums, sampler, effects and dynamics are moved to the new rate, so a
+ * rate change keeps the timing of what is playing.
+ *
+ * @param synth The synth instance.
+ * @param old_rate The rate everything was computed for.
+ */
+static void retarget(Synth *synth, uint32_t old_rate) {
+  uint32_t sample_rate = synth->sample_rate;
+  if(old_rate == sample_rate || old_rate == 0) { return; }
+  uint32_t status = save_and_disable_interrupts();
+  for(uint8_t c = 0; c < CHANNEL_COUNT; c++) {
+    retarget_channel(&synth->channels[c], old_rate);
+  }
+  uint32_t frame_count = synth->frame_count;
+  for(uint8_t i = synth->event_head; i != synth->event_tail; i = (i + 1) & (SYNTH_EVENT_QUEUE_SIZE - 1)) {
+    SynthEvent *event = &synth->event_queue[i];
+    int32_t until = (int32_t)(event->frame - frame_count);
+    if(until > 0) {
+      event->frame = frame_count + (uint32_t)((uint64_t)until * sample_rate / old_rate);
+    }
+  }
+  if(synth->master_bus) {
+    assert(synth == &default_synth);
+    drums_retarget(old_rate);
+    sampler_retarget(old_rate);
+    effects_retarget(old_rate);
+    dynamics_retarget();
+  }
+  restore_interrupts(status);
 }
 
 /**
  * @brief Sets the sample rate of the audio output.
  *
+ * Can be called while playing: see retarget(). The audio output must be
+ * moved to the new rate as well, see sequencer_set_sample_rate().
+ *
+ * @param synth The synth instance.
+ * @param _sample_rate The sample rate to set.
+ */
+void set_sample_rate_ctx(Synth *synth, uint32_t _sample_rate) {
+    uint32_t old_rate = synth->sample_rate;
+    synth->output_rate = _sample_rate;
+    synth->sample_rate = synth->output_rate / synth->rate_divider;
+    retarget(synth, old_rate);
+}
+
+/**
+ * @brief Sets the sample rate of the default instance.
+ *
  * @param _sample_rate The sample rate to set.
  */
 void set_sample_rate(uint32_t _sample_rate) {
-    sample_rate = _sample_rate;
+  set_sample_rate_ctx(&default_synth, _sample_rate);
+}
+
+/**
+ * @brief Sets the ratio between the output rate and the rate the synth renders at.
+ *
+ * Rendering at half or a quarter of the output rate divides the cost of
+ * the voices, the effects and the dynamics, at the price of the
+ * bandwidth above the internal Nyquist frequency. The output is
+ * upsampled with a cubic interpolator.
+ *
+ * @param synth The synth instance.
+ * @param divider 1, 2 or 4.
+ *
+ * @return True if the divider was set, false if it is not supported.
+ */
+bool synth_set_rate_divider_ctx(Synth *synth, uint8_t divider) {
+  if(divider == 0 || divider > SYNTH_RATE_DIVIDER_MAX || (divider & (divider - 1))) {
+    return false;
+  }
+  uint32_t old_rate = synth->sample_rate;
+  uint32_t status = save_and_disable_interrupts();
+  synth->rate_divider = divider;
+  synth->sample_rate = synth->output_rate / synth->rate_divider;
+  upsample_init(synth);
+  restore_interrupts(status);
+  retarget(synth, old_rate);
+  return true;
+}
+
+/**
+ * @brief Sets the rate divider of the default instance.
+ *
+ * @param divider 1, 2 or 4.
+ *
+ * @return True if the divider was set, false if it is not supported.
+ */
+bool synth_set_rate_divider(uint8_t divider) {
+  return synth_set_rate_divider_ctx(&default_synth, divider);
+}
+
+/**
+ * @brief Gets the sample rate the synth renders at.
+ *
+ * All frame counts and per-frame coefficients of the synth are at this
+ * rate, which is the output rate divided by the rate divider.
+ *
+ * @param synth The synth instance.
+ *
+ * @return The sample rate.
+ */
+uint32_t get_sample_rate_ctx(Synth *synth) {
+  return synth->sample_rate;
+}
+
+/**
+ * @brief Gets the sample rate the default instance renders at.
+ *
+ * @return The sample rate.
+ */
+uint32_t get_sample_rate() {
+    return default_synth.sample_rate;
 }
 
+/**
+ * @brief Gets the sample rate of the audio output.
+ *
+ * @param synth The synth instance.
+ *
+ * @return The sample rate.
+ */
+uint32_t get_output_rate_ctx(Synth *synth) {
+  return synth->output_rate;
+}
+
+/**
+ * @brief Gets the sample rate of the output of the default instance.
+ *
+ * @return The sample rate.
+ */
+uint32_t get_output_rate() {
+  return default_synth.output_rate;
+}
\ No newline at end of file
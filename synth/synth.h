@@ -43,6 +43,30 @@ extern "C" {
   // +----+----+----+----+----+----+----+----+----+----+----+----+----+----+----+----+----+--->
 
   #define CHANNEL_COUNT 8 // Number of maximum simultaneous voices
+  #define SYNTH_BLOCK_SIZE 64 // Number of frames rendered at once
+  #define SYNTH_OSCILLATOR_BUDGET 25 // Percentage of the frame time user oscillators may take
+  #define SYNTH_RATE_DIVIDER_MAX 4 // Highest ratio between the output and the internal sample rate
+  #define SYNTH_STEAL_RELEASE_MS 2 // Fade out time of a voice stolen to save CPU time
+
+  // Place the render path, the output stage and their tables in SRAM, where
+  // XIP cache misses can not stall them. Define SYNTH_IN_RAM=0 to leave
+  // them in flash and save the RAM they take.
+  #ifndef SYNTH_IN_RAM
+    #define SYNTH_IN_RAM 1
+  #endif
+  #if SYNTH_IN_RAM
+    #define SYNTH_RAM_FUNC(func_name) __not_in_flash_func(func_name)
+    #define SYNTH_RAM_TABLE __not_in_flash("synth_tables")
+  #else
+    #define SYNTH_RAM_FUNC(func_name) func_name
+    #define SYNTH_RAM_TABLE
+  #endif
+
+  // Render the table oscillators with the hardware interpolator (interp1
+  // of the core rendering), or with the portable C version
+  #ifndef SYNTH_USE_INTERP
+    #define SYNTH_USE_INTERP PICO_ON_DEVICE
+  #endif
 
   enum Waveform {
     NOISE     = 128,
@@ -53,6 +77,14 @@ extern "C" {
     WAVE      = 1
   };
 
+  // Spectrum of the NOISE waveform
+  enum NoiseMode {
+    NOISE_WHITE,
+    NOISE_PINK,     // -3dB/octave
+    NOISE_BROWN,    // -6dB/octave
+    NOISE_METALLIC  // short LFSR sequence, for cymbals and hats
+  };
+
   enum ADSRPhase {
     ATTACK,
     DECAY,
@@ -61,10 +93,79 @@ extern "C" {
     ADSR_OFF
   };
 
+  // Channel parameters that can be changed through the event queue
+  // (e.g. by sequencer parameter locks)
+  enum SynthParam {
+    PARAM_NONE,
+    PARAM_WAVEFORMS,
+    PARAM_VOLUME,
+    PARAM_ATTACK_MS,
+    PARAM_DECAY_MS,
+    PARAM_SUSTAIN,
+    PARAM_RELEASE_MS,
+    PARAM_PULSE_WIDTH,
+    PARAM_FILTER_CUTOFF,
+    PARAM_NOISE_MODE,
+    PARAM_NOISE_RATE,
+    PARAM_DELAY_SEND,
+    PARAM_REVERB_SEND,
+    PARAM_COUNT
+  };
+
+  // Packing of the rendered frames. Stereo formats carry the mono mix
+  // on both channels, with the left channel in the high bits.
+  enum SynthFormat {
+    SYNTH_FORMAT_MONO16,    // int16_t per frame
+    SYNTH_FORMAT_STEREO8,   // uint16_t per frame, 8-bit samples (I2S 8 bits)
+    SYNTH_FORMAT_STEREO16,  // uint32_t per frame, 16-bit samples (I2S 16 bits)
+    SYNTH_FORMAT_STEREO32   // two uint32_t per frame, 32-bit samples (I2S 24 or 32 bits)
+  };
+
+  // Effects of the master bus the channels send to
+  enum SynthSend {
+    SEND_DELAY,
+    SEND_REVERB,
+    SEND_COUNT
+  };
+
+  enum SynthEventType {
+    EVENT_NOTE_ON,
+    EVENT_NOTE_OFF,
+    EVENT_PARAM,
+    EVENT_DRUM,     // triggers the drum voice given by channel
+    EVENT_SAMPLE_ON,  // plays the sampler voice given by channel, at the pitch given by value
+    EVENT_SAMPLE_OFF, // releases the sampler voice given by channel
+    EVENT_PRESET      // applies the preset given by value, see synth_set_presets()
+  };
+
+  #define SYNTH_EVENT_QUEUE_SIZE 64 // Must be a power of two
+
+  // Events are applied by the renderer right before the frame they are
+  // scheduled for, so note and parameter changes are sample-accurate
+  typedef struct SynthEvent {
+    uint32_t  frame;      // synth frame at which the event is applied
+    uint8_t   type;       // one of SynthEventType
+    uint8_t   channel;    // index of the target channel
+    uint8_t   param;      // one of SynthParam (EVENT_PARAM only)
+    uint16_t  value;      // frequency (EVENT_NOTE_ON) or parameter value (EVENT_PARAM)
+    uint16_t  velocity;   // note velocity, 0xffff is full (EVENT_NOTE_ON only)
+  } SynthEvent;
+
+  struct AudioChannel;
+  struct SynthPreset;
+
+  // User oscillator rendering the WAVE waveform of a channel. It writes
+  // frames samples (at most SYNTH_BLOCK_SIZE) to block, once per block.
+  // offset and increment are the channel waveform position and its
+  // increment per frame (Q16), for oscillators following the channel pitch.
+  typedef void (*SynthOscillator)(struct AudioChannel *channel, int16_t *block,
+                                  uint32_t frames, uint32_t offset, uint32_t increment);
+
   typedef struct AudioChannel {
   uint8_t   waveforms;      // bitmask for enabled waveforms
   uint16_t  frequency;    // frequency of the voice (Hz)
   uint16_t  volume; // channel volume (default 50%)
+  uint16_t  velocity; // velocity of the current note, scales the channel volume
 
   uint16_t  attack_ms;      // attack period
   uint16_t  decay_ms;      // decay period
@@ -72,6 +173,11 @@ extern "C" {
   uint16_t  release_ms;      // release period
   uint16_t  pulse_width; // duty cycle of square wave (default 50%)
   int16_t   noise;      // current noise value
+  uint8_t   noise_mode;   // one of NoiseMode
+  uint16_t  noise_rate;   // sample and hold rate of the noise (Hz), 0 to follow the frequency
+  uint32_t  noise_offset; // noise sample and hold position (Q16)
+  uint32_t  noise_state;  // noise generator state
+  int32_t   noise_filter[3]; // colored noise filter state
 
   uint32_t  waveform_offset;   // voice offset (Q8)
 
@@ -79,6 +185,8 @@ extern "C" {
   bool      filter_enable;
   uint16_t  filter_cutoff_frequency;
 
+  uint16_t  sends[SEND_COUNT]; // level sent to each master effect
+
   uint32_t  adsr_frame;      // number of frames into the current ADSR phase
   uint32_t  adsr_end_frame;     // frame target at which the ADSR changes to the next phase
   uint32_t  adsr;
@@ -91,22 +199,94 @@ extern "C" {
   void      *user_data;
   void      (*wave_buffer_callback)(struct AudioChannel *channel);
 
+  SynthOscillator oscillator; // renders the WAVE waveform
+  uint16_t  oscillator_cost;  // declared worst case cost of the oscillator (cycles per frame)
+
+  struct Synth *synth;      // the synth instance the channel belongs to
+
 } AudioChannel;
 
+  // A synth instance. The functions without a Synth parameter use the
+  // default instance, which also renders the drums, the sampler, the
+  // effects and the dynamics; other instances, set up with
+  // synth_init_ctx(), render their own channels only, and can run on
+  // the other core or feed another output. The modules of the master
+  // bus, the governor, the telemetry and the tap keep a single state,
+  // tied to the default instance.
+  typedef struct Synth {
+  AudioChannel channels[CHANNEL_COUNT];
+  uint32_t  sample_rate;    // sample rate the synth renders at
+  uint32_t  output_rate;    // sample rate of the output, a multiple of sample_rate
+  uint8_t   rate_divider;   // ratio between the output and the rendering rate
+  uint16_t  volume;         // volume of the output
+  bool      master_bus;     // renders the drums, sampler, effects and dynamics
+  volatile uint32_t frame_count; // frames rendered since the synth was initialized
+  bool      idle;           // the last block was silence, rendered without mixing
+
+  SynthEvent event_queue[SYNTH_EVENT_QUEUE_SIZE]; // pending events, sorted by frame
+  volatile uint8_t event_head;
+  volatile uint8_t event_tail;
+
+  int32_t   upsample_history[3];  // last three rendered frames
+  int32_t   upsample_coeffs[SYNTH_RATE_DIVIDER_MAX][4]; // interpolation coefficients of each output phase (Q14)
+  int32_t   output_buffer[SYNTH_BLOCK_SIZE]; // upsampled frames not yet written
+  const int32_t *output_block;
+  uint32_t  output_pos;
+  uint32_t  output_length;
+
+  int32_t   mix_buffer[SYNTH_BLOCK_SIZE];  // mix of the block being rendered
+  int32_t   send_buffer[SEND_COUNT][SYNTH_BLOCK_SIZE]; // effect sends of the block being rendered
+
+  const struct SynthPreset *presets; // presets selected by EVENT_PRESET
+  uint8_t   preset_count;
+
+} Synth;
+
 
 AudioChannel * synth_init(uint8_t num_voices, uint32_t _sample_rate);
-static void channel_init(AudioChannel *channel);
 void trigger_attack(AudioChannel *channel);
 void trigger_decay(AudioChannel *channel);
 void trigger_sustain(AudioChannel *channel);
 void trigger_release(AudioChannel *channel);
 void adsr_off(AudioChannel *channel);
 
+void synth_render(int16_t *buffer, uint32_t frames);
+void synth_render_format(void *buffer, uint32_t frames, uint8_t format);
 int16_t get_audio_frame();
 bool is_audio_playing();
+uint8_t synth_active_voices();
+bool synth_steal_voice();
+
+bool synth_queue_event(const SynthEvent *event);
+void synth_clear_events();
+uint32_t synth_get_frame();
+uint8_t synth_event_queue_depth();
+void synth_set_param(AudioChannel *channel, uint8_t param, uint16_t value);
+uint16_t synth_get_param(const AudioChannel *channel, uint8_t param);
+bool synth_set_oscillator(AudioChannel *channel, SynthOscillator oscillator, uint16_t cost);
 
 void set_volume(uint8_t percent);
 void set_sample_rate(uint32_t _sample_rate);
+uint32_t get_sample_rate();
+uint32_t get_output_rate();
+bool synth_set_rate_divider(uint8_t divider);
+
+Synth * synth_get_default();
+AudioChannel * synth_init_ctx(Synth *synth, uint8_t num_voices, uint32_t _sample_rate);
+void synth_render_ctx(Synth *synth, int16_t *buffer, uint32_t frames);
+void synth_render_format_ctx(Synth *synth, void *buffer, uint32_t frames, uint8_t format);
+bool is_audio_playing_ctx(Synth *synth);
+uint8_t synth_active_voices_ctx(Synth *synth);
+bool synth_steal_voice_ctx(Synth *synth);
+bool synth_queue_event_ctx(Synth *synth, const SynthEvent *event);
+void synth_clear_events_ctx(Synth *synth);
+uint32_t synth_get_frame_ctx(Synth *synth);
+uint8_t synth_event_queue_depth_ctx(Synth *synth);
+void set_volume_ctx(Synth *synth, uint8_t percent);
+void set_sample_rate_ctx(Synth *synth, uint32_t _sample_rate);
+uint32_t get_sample_rate_ctx(Synth *synth);
+uint32_t get_output_rate_ctx(Synth *synth);
+bool synth_set_rate_divider_ctx(Synth *synth, uint8_t divider);
 
 #ifdef __cplusplus
 }
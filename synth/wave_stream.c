@@ -0,0 +1,126 @@
+/**
+ * @file wave_stream.c
+ * @brief Implementation of the wave stream module.
+ */
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+#include "wave_stream.h"
+
+/**
+ * @brief The streams filled by the second core.
+ */
+static WaveStream *core1_streams[WAVE_STREAM_MAX];
+static uint8_t num_core1_streams = 0;
+
+/**
+ * @brief Initializes a wave stream.
+ *
+ * Both buffers are filled before returning, so the stream can be played
+ * right away. Attach it to a channel with
+ * synth_set_oscillator(channel, wave_stream_oscillator, cost) and
+ * channel->user_data = stream.
+ *
+ * @param stream The stream to initialize.
+ * @param generator The function filling the buffers.
+ * @param user_data Data available to the generator.
+ */
+void wave_stream_init(WaveStream *stream,
+                      void (*generator)(WaveStream *stream, int16_t *buffer, uint32_t frames),
+                      void *user_data) {
+  stream->generator   = generator;
+  stream->user_data   = user_data;
+  stream->play_buffer = 0;
+  stream->play_pos    = 0;
+  stream->fill_buffer = 0;
+  stream->underruns   = 0;
+  stream->filled[0]   = false;
+  stream->filled[1]   = false;
+  while(wave_stream_fill(stream));
+}
+
+/**
+ * @brief Fills the next buffer of a stream if it has been played.
+ *
+ * Call it from the second core, or from the main loop.
+ *
+ * @param stream The stream to fill.
+ *
+ * @return True if a buffer was filled, false if both are still full.
+ */
+bool wave_stream_fill(WaveStream *stream) {
+  uint8_t b = stream->fill_buffer;
+  if(stream->filled[b]) {
+    return false;
+  }
+  stream->generator(stream, stream->buffers[b], WAVE_STREAM_SIZE);
+  __dmb(); // the samples are written before the buffer is handed over
+  stream->filled[b] = true;
+  stream->fill_buffer = b ^ 1;
+  return true;
+}
+
+/**
+ * @brief Oscillator playing the wave stream found in channel->user_data.
+ *
+ * Frames with no samples available are silent, and counted as underruns.
+ */
+void SYNTH_RAM_FUNC(wave_stream_oscillator)(AudioChannel *channel, int16_t *block,
+                            uint32_t frames, uint32_t offset, uint32_t increment) {
+  WaveStream *stream = (WaveStream *)channel->user_data;
+  uint32_t i = 0;
+  while(i < frames) {
+    uint8_t b = stream->play_buffer;
+    if(!stream->filled[b]) {
+      stream->underruns++;
+      for(; i < frames; i++) { block[i] = 0; }
+      return;
+    }
+    uint32_t count = MIN(frames - i, WAVE_STREAM_SIZE - stream->play_pos);
+    const int16_t *samples = &stream->buffers[b][stream->play_pos];
+    for(uint32_t j = 0; j < count; j++) { block[i + j] = samples[j]; }
+    i += count;
+    stream->play_pos += count;
+    if(stream->play_pos == WAVE_STREAM_SIZE) {
+      // hand the buffer back to the generator, and wake up the second core
+      stream->play_pos = 0;
+      stream->play_buffer = b ^ 1;
+      __dmb();
+      stream->filled[b] = false;
+      __sev();
+    }
+  }
+}
+
+/**
+ * @brief Second core loop, filling the streams and sleeping until a buffer is played.
+ */
+static void core1_entry() {
+  while(true) {
+    bool filled = false;
+    for(uint8_t i = 0; i < num_core1_streams; i++) {
+      filled |= wave_stream_fill(core1_streams[i]);
+    }
+    if(!filled) {
+      __wfe();
+    }
+  }
+}
+
+/**
+ * @brief Fills streams on the second core.
+ *
+ * The second core is dedicated to the streams from then on. Programs
+ * using it for something else can call wave_stream_fill() from there.
+ *
+ * @param streams The streams to fill, already initialized.
+ * @param count The number of streams, up to WAVE_STREAM_MAX.
+ */
+void wave_stream_core1_start(WaveStream **streams, uint8_t count) {
+  num_core1_streams = MIN(count, WAVE_STREAM_MAX);
+  for(uint8_t i = 0; i < num_core1_streams; i++) {
+    core1_streams[i] = streams[i];
+  }
+  multicore_launch_core1(core1_entry);
+}
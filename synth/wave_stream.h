@@ -0,0 +1,55 @@
+#ifndef WAVE_STREAM_H
+#define WAVE_STREAM_H
+
+/**
+ * @file wave_stream.h
+ * @brief Header file for the wave stream module.
+ *
+ * A wave stream is a double-buffered WAVE oscillator: a generator fills
+ * one buffer ahead of time, typically on the second core, while the
+ * renderer plays the other one. The renderer never calls the generator,
+ * so an expensive waveform can not make it miss its deadline.
+ */
+
+#include "pico/stdlib.h"
+#include "synth.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WAVE_STREAM_SIZE 256 // Frames per buffer
+#define WAVE_STREAM_MAX 4 // Number of streams filled by wave_stream_core1_start()
+
+/**
+ * @struct WaveStream
+ * @brief A double-buffered stream of samples, and its generator.
+ */
+typedef struct WaveStream {
+  int16_t   buffers[2][WAVE_STREAM_SIZE];
+  volatile bool filled[2];  // set by the generator, cleared once the buffer is played
+  uint8_t   play_buffer;    // buffer being played
+  uint16_t  play_pos;       // position in the buffer being played
+  uint8_t   fill_buffer;    // next buffer to fill
+  uint32_t  underruns;      // number of blocks the renderer found no samples for
+
+  /**
+   * @brief Generator filling a buffer of WAVE_STREAM_SIZE samples.
+   */
+  void      (*generator)(struct WaveStream *stream, int16_t *buffer, uint32_t frames);
+  void      *user_data;
+} WaveStream;
+
+void wave_stream_init(WaveStream *stream,
+                      void (*generator)(WaveStream *stream, int16_t *buffer, uint32_t frames),
+                      void *user_data);
+bool wave_stream_fill(WaveStream *stream);
+void wave_stream_oscillator(AudioChannel *channel, int16_t *block,
+                            uint32_t frames, uint32_t offset, uint32_t increment);
+void wave_stream_core1_start(WaveStream **streams, uint8_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,8 +7,18 @@
  */
 
 #include "synth.h"
+#include "drums.h"
+#include "sampler.h"
+#include "effects.h"
+#include "dynamics.h"
+#include "wave_stream.h"
+#include "governor.h"
+#include "preset.h"
 #include "sequencer.h"
 #include "pitches.h"
+#include "clock_sync.h"
+#include "telemetry.h"
+#include "tap.h"
 
 #if defined USE_AUDIO_PWM && defined USE_AUDIO_I2S
   #error "You need to define exactly one audio output"
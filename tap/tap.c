@@ -0,0 +1,197 @@
+/**
+ * @file tap.c
+ * @brief Implementation of the audio tap module.
+ *
+ * The ring has a single writer, the renderer, and a single reader, the
+ * main loop, so it needs no lock: each side only moves its own counter,
+ * after a barrier that makes the frames visible before the counter.
+ * The counters run freely and are masked into the ring.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "tap.h"
+#include "synth.h"
+
+#if SYNTH_TAP
+
+/**
+ * @brief The ring buffer, and the frames written to and read from it.
+ */
+static int16_t *ring = NULL;
+static uint32_t ring_size = 0;
+static volatile uint32_t head = 0;
+static volatile uint32_t tail = 0;
+static TapStats stats;
+
+/**
+ * @brief The sink of tap_task().
+ */
+static TapSink sink = NULL;
+static void *sink_data = NULL;
+
+/**
+ * @brief Starts copying the output into a ring buffer.
+ *
+ * @param buffer The ring buffer, kept by the application.
+ * @param frames The size of the buffer, rounded down to a power of two.
+ */
+void tap_start(int16_t *buffer, uint32_t frames) {
+  uint32_t size = 1;
+  while(size <= frames / 2) { size <<= 1; }
+  uint32_t status = save_and_disable_interrupts();
+  ring = buffer;
+  ring_size = (buffer && frames) ? size : 0;
+  head = 0;
+  tail = 0;
+  memset(&stats, 0, sizeof(stats));
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Stops the tap.
+ */
+void tap_stop() {
+  uint32_t status = save_and_disable_interrupts();
+  ring_size = 0;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Copies a block of the output into the ring.
+ *
+ * @param mix The block, limited to 16 bits.
+ * @param frames The number of frames.
+ */
+void SYNTH_RAM_FUNC(tap_write)(const int32_t *mix, uint32_t frames) {
+  uint32_t size = ring_size;
+  if(size == 0) {
+    return;
+  }
+  uint32_t h = head;
+  uint32_t used = h - tail;
+  if(size - used < frames) {
+    stats.dropped += frames;
+    stats.drops++;
+    return;
+  }
+  for(uint32_t i = 0; i < frames; i++) {
+    ring[(h + i) & (size - 1)] = mix[i];
+  }
+  __dmb(); // the frames are written before they are handed over
+  head = h + frames;
+  stats.frames += frames;
+  stats.fill_max = MAX(stats.fill_max, used + frames);
+}
+
+/**
+ * @brief Gets the frames waiting in the ring, without copying them.
+ *
+ * @param frames Set to the first frame.
+ *
+ * @return The number of consecutive frames, up to the end of the ring.
+ */
+uint32_t tap_read(const int16_t **frames) {
+  uint32_t size = ring_size;
+  if(size == 0) {
+    return 0;
+  }
+  uint32_t t = tail;
+  uint32_t count = head - t;
+  __dmb(); // the frames are read after the counter
+  uint32_t index = t & (size - 1);
+  *frames = &ring[index];
+  return MIN(count, size - index);
+}
+
+/**
+ * @brief Gives frames got with tap_read() back to the ring.
+ *
+ * @param frames The number of frames.
+ */
+void tap_consume(uint32_t frames) {
+  __dmb(); // the frames are read before they are handed back
+  tail += frames;
+}
+
+/**
+ * @brief Sets the sink tap_task() streams to.
+ *
+ * @param _sink The sink, NULL to leave the frames to tap_read().
+ * @param user_data Data passed to the sink.
+ */
+void tap_set_sink(TapSink _sink, void *user_data) {
+  sink = _sink;
+  sink_data = user_data;
+}
+
+/**
+ * @brief Gets the counters since the tap was started.
+ *
+ * @param _stats The structure to fill.
+ */
+void tap_get_stats(TapStats *_stats) {
+  uint32_t status = save_and_disable_interrupts();
+  *_stats = stats;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Streams the waiting frames to the sink.
+ *
+ * Up to TAP_TASK_MAX_FRAMES per call, in two parts when they wrap
+ * around the end of the ring.
+ */
+void tap_task() {
+  if(sink == NULL) {
+    return;
+  }
+  uint32_t budget = TAP_TASK_MAX_FRAMES;
+  while(budget > 0) {
+    const int16_t *frames;
+    uint32_t count = MIN(tap_read(&frames), budget);
+    if(count == 0) {
+      return;
+    }
+    uint32_t taken = sink(frames, count, sink_data);
+    tap_consume(taken);
+    if(taken < count) {
+      return;
+    }
+    budget -= count;
+  }
+}
+
+#else
+
+void tap_start(int16_t *buffer, uint32_t frames) { ; }
+void tap_stop() { ; }
+void tap_write(const int32_t *mix, uint32_t frames) { ; }
+uint32_t tap_read(const int16_t **frames) { return 0; }
+void tap_consume(uint32_t frames) { ; }
+void tap_set_sink(TapSink _sink, void *user_data) { ; }
+void tap_get_stats(TapStats *_stats) { memset(_stats, 0, sizeof(*_stats)); }
+void tap_task() { ; }
+
+#endif
+
+/**
+ * @brief Sink writing the raw frames to stdio.
+ *
+ * The frames are written in blocks, so that stdio over USB sends full
+ * packets, and flushed for the buffering of stdout not to delay them.
+ */
+uint32_t tap_sink_stdio(const int16_t *frames, uint32_t count, void *user_data) {
+  uint32_t written = fwrite(frames, sizeof(int16_t), count, stdout);
+  fflush(stdout);
+  return written;
+}
+
+/**
+ * @brief Sink writing the raw frames to the file of user_data.
+ */
+uint32_t tap_sink_file(const int16_t *frames, uint32_t count, void *user_data) {
+  return fwrite(frames, sizeof(int16_t), count, (FILE *)user_data);
+}
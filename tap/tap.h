@@ -0,0 +1,143 @@
+#ifndef TAP_H
+#define TAP_H
+
+/**
+ * @file tap.h
+ * @brief Header file for the audio tap module.
+ *
+ * Copies the output of the default synth, after the master mix and the
+ * dynamics, into a ring buffer that a task in the main loop hands to a
+ * sink: stdio, which is the USB CDC serial port when the application
+ * enables stdio over USB, or a file on the host build. The frames are
+ * raw 16-bit mono PCM, little-endian, at the output rate.
+ *
+ * The renderer never waits for the tap: a block that does not fit in
+ * the ring is dropped whole and counted, so the cost of the tap is one
+ * copy of each block. The sink reads the frames in place in the ring.
+ *
+ * The tap is compiled in with SYNTH_TAP=1 in the compile definitions.
+ * Without it, the hook compiles to nothing and the functions do nothing.
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SYNTH_TAP
+  #define SYNTH_TAP 0
+#endif
+
+/**
+ * @brief Largest number of frames tap_task() gives the sink per call,
+ * so that a slow sink keeps the main loop going.
+ */
+#define TAP_TASK_MAX_FRAMES 512
+
+/**
+ * @struct TapStats
+ * @brief The counters since the tap was started.
+ */
+typedef struct TapStats {
+  uint32_t frames;          // frames written to the ring
+  uint32_t dropped;         // frames dropped, the ring being full
+  uint32_t drops;           // blocks dropped
+  uint32_t fill_max;        // most frames waiting in the ring
+} TapStats;
+
+/**
+ * @brief A sink the tap streams to.
+ *
+ * @param frames The frames, in the ring.
+ * @param count The number of frames.
+ * @param user_data The data given to tap_set_sink().
+ *
+ * @return The number of frames taken, fewer to be called again later
+ * with the rest.
+ */
+typedef uint32_t (*TapSink)(const int16_t *frames, uint32_t count, void *user_data);
+
+#if SYNTH_TAP
+  #define TAP_WRITE(mix, frames)          tap_write(mix, frames)
+#else
+  #define TAP_WRITE(mix, frames)          ((void)0)
+#endif
+
+/**
+ * @brief Starts copying the output into a ring buffer.
+ *
+ * @param buffer The ring buffer, kept by the application.
+ * @param frames The size of the buffer, rounded down to a power of two.
+ */
+void tap_start(int16_t *buffer, uint32_t frames);
+
+/**
+ * @brief Stops the tap. Call it from the context of tap_task().
+ */
+void tap_stop();
+
+/**
+ * @brief Copies a block of the output into the ring. Use TAP_WRITE().
+ *
+ * @param mix The block, limited to 16 bits.
+ * @param frames The number of frames.
+ */
+void tap_write(const int32_t *mix, uint32_t frames);
+
+/**
+ * @brief Gets the frames waiting in the ring, without copying them.
+ *
+ * @param frames Set to the first frame.
+ *
+ * @return The number of consecutive frames, up to the end of the ring.
+ */
+uint32_t tap_read(const int16_t **frames);
+
+/**
+ * @brief Gives frames got with tap_read() back to the ring.
+ *
+ * @param frames The number of frames.
+ */
+void tap_consume(uint32_t frames);
+
+/**
+ * @brief Sets the sink tap_task() streams to.
+ *
+ * @param sink The sink, NULL to leave the frames to tap_read().
+ * @param user_data Data passed to the sink.
+ */
+void tap_set_sink(TapSink sink, void *user_data);
+
+/**
+ * @brief Sink writing the raw frames to stdio.
+ *
+ * On the device, turn off the line feed translation of the stdio
+ * driver first, e.g. stdio_set_translate_crlf(&stdio_usb, false), or
+ * every 0x0a byte is sent as 0x0d 0x0a.
+ */
+uint32_t tap_sink_stdio(const int16_t *frames, uint32_t count, void *user_data);
+
+/**
+ * @brief Sink writing the raw frames to a file, the FILE * of user_data.
+ */
+uint32_t tap_sink_file(const int16_t *frames, uint32_t count, void *user_data);
+
+/**
+ * @brief Gets the counters since the tap was started.
+ *
+ * @param stats The structure to fill.
+ */
+void tap_get_stats(TapStats *stats);
+
+/**
+ * @brief Streams the waiting frames to the sink. Call it from the main loop.
+ */
+void tap_task();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * @file telemetry.c
+ * @brief Implementation of the telemetry module.
+ *
+ * The render hooks run in the audio interrupts, so they only store
+ * counters; snapshots are taken with the interrupts disabled, and
+ * printing is left to the main loop.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "telemetry.h"
+#include "synth.h"
+#include "clock_sync.h"
+#include "governor.h"
+
+#if SYNTH_TELEMETRY
+
+/**
+ * @brief Smoothing of the averages (1/16 of the difference per buffer).
+ */
+#define AVERAGE_SHIFT 4
+
+/**
+ * @brief The measurements. Averages are kept in Q8.
+ */
+static TelemetrySnapshot stats;
+static uint32_t render_avg_q8 = 0;
+static uint32_t load_avg_q8 = 0;
+static uint32_t render_start_us = 0;
+
+/**
+ * @brief Report stream state.
+ */
+static uint32_t stream_interval_ms = 0;
+static absolute_time_t next_report;
+
+/**
+ * @brief Marks the start of a buffer render.
+ */
+void telemetry_render_begin() {
+  render_start_us = time_us_32();
+}
+
+/**
+ * @brief Marks the end of a buffer render.
+ *
+ * @param frames The number of frames rendered, at the output rate.
+ */
+void telemetry_render_end(uint32_t frames) {
+  uint32_t elapsed = time_us_32() - render_start_us;
+  uint32_t period = (uint32_t)((uint64_t)frames * 1000000 / get_output_rate());
+  uint32_t load = period ? MIN((uint64_t)elapsed * 1000 / period, 0xffff) : 0;
+
+  // The first buffer sets the averages
+  if(stats.buffers++ == 0) {
+    render_avg_q8 = elapsed << 8;
+    load_avg_q8 = load << 8;
+  } else {
+    render_avg_q8 += ((int32_t)(elapsed << 8) - (int32_t)render_avg_q8) >> AVERAGE_SHIFT;
+    load_avg_q8 += ((int32_t)(load << 8) - (int32_t)load_avg_q8) >> AVERAGE_SHIFT;
+  }
+  stats.render_us = elapsed;
+  stats.render_max_us = MAX(stats.render_max_us, elapsed);
+  stats.load_x10 = load;
+  stats.load_max_x10 = MAX(stats.load_max_x10, load);
+
+  stats.voices = synth_active_voices();
+  stats.voices_max = MAX(stats.voices_max, stats.voices);
+  stats.queue_depth = synth_event_queue_depth();
+  stats.queue_max = MAX(stats.queue_max, stats.queue_depth);
+}
+
+/**
+ * @brief Counts a buffer that was not rendered in time.
+ */
+void telemetry_underrun() {
+  stats.underruns++;
+}
+
+/**
+ * @brief Counts an event rendered late.
+ */
+void telemetry_late_event() {
+  stats.late_events++;
+}
+
+/**
+ * @brief Counts an event the full queue refused.
+ */
+void telemetry_dropped_event() {
+  stats.dropped_events++;
+}
+
+/**
+ * @brief Gets the measurements since the last reset.
+ *
+ * @param snapshot The structure to fill.
+ */
+void telemetry_get(TelemetrySnapshot *snapshot) {
+  uint32_t status = save_and_disable_interrupts();
+  *snapshot = stats;
+  snapshot->render_avg_us = render_avg_q8 >> 8;
+  snapshot->load_avg_x10 = load_avg_q8 >> 8;
+  restore_interrupts(status);
+
+  ClockSyncStats clock;
+  clock_sync_get_stats(&clock);
+  snapshot->drift_us = clock.drift_us;
+  snapshot->quality = governor_get_level();
+}
+
+/**
+ * @brief Restarts the measurements.
+ */
+void telemetry_reset() {
+  uint32_t status = save_and_disable_interrupts();
+  memset(&stats, 0, sizeof(stats));
+  render_avg_q8 = 0;
+  load_avg_q8 = 0;
+  restore_interrupts(status);
+}
+
+/**
+ * @brief Prints the measurements on one line of stdio.
+ */
+void telemetry_print() {
+  TelemetrySnapshot s;
+  telemetry_get(&s);
+  printf("load %u.%u%% avg %u.%u%% max %u.%u%% | render %luus avg %luus max %luus | "
+         "voices %u max %u | queue %u max %u | underruns %lu late %lu dropped %lu | drift %ldus | quality %u\n",
+         s.load_x10 / 10, s.load_x10 % 10, s.load_avg_x10 / 10, s.load_avg_x10 % 10,
+         s.load_max_x10 / 10, s.load_max_x10 % 10,
+         (unsigned long)s.render_us, (unsigned long)s.render_avg_us, (unsigned long)s.render_max_us,
+         s.voices, s.voices_max, s.queue_depth, s.queue_max,
+         (unsigned long)s.underruns, (unsigned long)s.late_events, (unsigned long)s.dropped_events,
+         (long)s.drift_us, s.quality);
+}
+
+/**
+ * @brief Prints the measurements every interval, from the main loop.
+ *
+ * @param interval_ms The time between two reports, 0 to stop them.
+ */
+void telemetry_stream(uint32_t interval_ms) {
+  stream_interval_ms = interval_ms;
+  next_report = make_timeout_time_ms(interval_ms);
+}
+
+/**
+ * @brief Prints the report when it is due.
+ */
+void telemetry_task() {
+  if(stream_interval_ms == 0 || absolute_time_diff_us(get_absolute_time(), next_report) > 0) {
+    return;
+  }
+  next_report = delayed_by_ms(next_report, stream_interval_ms);
+  telemetry_print();
+}
+
+#else
+
+void telemetry_render_begin() { ; }
+void telemetry_render_end(uint32_t frames) { ; }
+void telemetry_underrun() { ; }
+void telemetry_late_event() { ; }
+void telemetry_dropped_event() { ; }
+void telemetry_get(TelemetrySnapshot *snapshot) { memset(snapshot, 0, sizeof(*snapshot)); }
+void telemetry_reset() { ; }
+void telemetry_print() { ; }
+void telemetry_stream(uint32_t interval_ms) { ; }
+void telemetry_task() { ; }
+
+#endif
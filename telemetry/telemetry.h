@@ -0,0 +1,128 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/**
+ * @file telemetry.h
+ * @brief Header file for the telemetry module.
+ *
+ * Measures how long the audio buffers take to render against the time
+ * they play for, and reports it with the voice count, the event queue
+ * depth, underruns, late and dropped events and the sequencer drift.
+ * It follows the default synth instance and the default sequencer,
+ * which drives the audio output; other instances are not counted.
+ *
+ * The measurements are compiled in with SYNTH_TELEMETRY=1 in the
+ * compile definitions. Without it, the hooks compile to nothing and the
+ * functions report zeros.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SYNTH_TELEMETRY
+  #define SYNTH_TELEMETRY 0
+#endif
+
+/**
+ * @struct TelemetrySnapshot
+ * @brief The measurements since the last reset.
+ *
+ * Loads are in tenths of percent of the time a buffer plays for.
+ */
+typedef struct TelemetrySnapshot {
+  uint32_t buffers;         // buffers rendered
+  uint32_t render_us;       // render time of the last buffer
+  uint32_t render_avg_us;   // average render time
+  uint32_t render_max_us;   // longest render time
+  uint16_t load_x10;        // load of the last buffer
+  uint16_t load_avg_x10;    // average load
+  uint16_t load_max_x10;    // highest load
+  uint8_t  voices;          // voices playing at the end of the last buffer
+  uint8_t  voices_max;      // most voices playing at once
+  uint8_t  queue_depth;     // events pending at the end of the last buffer
+  uint8_t  queue_max;       // most events pending at once
+  uint32_t underruns;       // buffers not rendered in time
+  uint32_t late_events;     // events rendered after the frame they were scheduled for
+  uint32_t dropped_events;  // events not queued, the event queue being full
+  int32_t  drift_us;        // how far the sequencer is behind the external clock
+  uint8_t  quality;         // quality level set by the governor, one of GovernorLevel
+} TelemetrySnapshot;
+
+#if SYNTH_TELEMETRY
+  #define TELEMETRY_RENDER_BEGIN()        telemetry_render_begin()
+  #define TELEMETRY_RENDER_END(frames)    telemetry_render_end(frames)
+  #define TELEMETRY_UNDERRUN()            telemetry_underrun()
+  #define TELEMETRY_LATE_EVENT()          telemetry_late_event()
+  #define TELEMETRY_DROPPED_EVENT()       telemetry_dropped_event()
+#else
+  #define TELEMETRY_RENDER_BEGIN()        ((void)0)
+  #define TELEMETRY_RENDER_END(frames)    ((void)0)
+  #define TELEMETRY_UNDERRUN()            ((void)0)
+  #define TELEMETRY_LATE_EVENT()          ((void)0)
+  #define TELEMETRY_DROPPED_EVENT()       ((void)0)
+#endif
+
+/**
+ * @brief Marks the start of a buffer render. Use TELEMETRY_RENDER_BEGIN().
+ */
+void telemetry_render_begin();
+
+/**
+ * @brief Marks the end of a buffer render. Use TELEMETRY_RENDER_END().
+ *
+ * @param frames The number of frames rendered, at the output rate.
+ */
+void telemetry_render_end(uint32_t frames);
+
+/**
+ * @brief Counts a buffer that was not rendered in time. Use TELEMETRY_UNDERRUN().
+ */
+void telemetry_underrun();
+
+/**
+ * @brief Counts an event rendered late. Use TELEMETRY_LATE_EVENT().
+ */
+void telemetry_late_event();
+
+/**
+ * @brief Counts an event the full queue refused. Use TELEMETRY_DROPPED_EVENT().
+ */
+void telemetry_dropped_event();
+
+/**
+ * @brief Gets the measurements since the last reset.
+ *
+ * @param snapshot The structure to fill.
+ */
+void telemetry_get(TelemetrySnapshot *snapshot);
+
+/**
+ * @brief Restarts the measurements.
+ */
+void telemetry_reset();
+
+/**
+ * @brief Prints the measurements on one line of stdio.
+ */
+void telemetry_print();
+
+/**
+ * @brief Prints the measurements every interval, from the main loop.
+ *
+ * @param interval_ms The time between two reports, 0 to stop them.
+ */
+void telemetry_stream(uint32_t interval_ms);
+
+/**
+ * @brief Prints the report when it is due. Call it from the main loop.
+ */
+void telemetry_task();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,530 @@
+/**
+ * @file batch_render.c
+ * @brief Renders many sequences offline, on all the cores of the host.
+ *
+ * Each render is an independent synth instance and sequencer, so the
+ * renders run in parallel without sharing any state. The worker threads
+ * take the next render from a shared counter until none is left, so a
+ * long render does not hold the others back.
+ *
+ * Usage: batch_render [-j threads] [-o dir] [-s seconds] [-n] [song ...]
+ *
+ * Without songs, a sweep of the built-in pattern is rendered over tempos,
+ * waveforms and rate dividers. A song is a text file of lines:
+ *
+ *   bpm 128                 tempo (default 120)
+ *   steps 16                length of the tracks (default 16)
+ *   seconds 30              length of the render (default -s)
+ *   rate 44100 2            output rate and rate divider (default 44100 1)
+ *   voice SQUARE|SAW 10 100 50 200 12000
+ *                           a new track: waveforms, attack, decay (ms),
+ *                           sustain (percent), release (ms) and volume
+ *   notes C3 . . - DS3 . 440 -
+ *                           notes of the last track: a note name of
+ *                           pitches.h, a frequency in Hz, . to hold or
+ *                           - to release
+ *
+ * Text after # is ignored. Each render writes a 16-bit mono WAV file and
+ * prints the peak, RMS and the number of samples clipped by the output
+ * clamp; the totals give the throughput as a multiple of realtime.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "pico/stdlib.h"
+#include "synth.h"
+#include "preset.h"
+#include "sequencer.h"
+#include "pitches.h"
+
+#define BATCH_MAX_STEPS 256
+#define BATCH_MAX_THREADS 256
+#define BATCH_DEFAULT_RATE 44100
+#define BATCH_DEFAULT_SECONDS 10
+
+/**
+ * @brief A render and its results.
+ */
+typedef struct BatchJob {
+  char        name[64];
+  uint16_t    bpm;
+  uint16_t    steps;
+  uint32_t    seconds;
+  uint32_t    rate;
+  uint8_t     divider;
+  uint8_t     num_voices;
+  SynthPreset voices[CHANNEL_COUNT];
+  int16_t     notes[CHANNEL_COUNT][BATCH_MAX_STEPS]; // one row of steps notes per voice
+
+  uint64_t    frames;     // frames rendered
+  int32_t     peak;       // highest absolute sample
+  double      sum_squares;
+  uint64_t    clipped;    // samples held at full scale by the output clamp
+  double      elapsed_s;  // time the render took
+  bool        failed;
+} BatchJob;
+
+/**
+ * @brief The work shared by the threads.
+ */
+static BatchJob *jobs = NULL;
+static uint32_t job_count = 0;
+static atomic_uint next_job;
+static const char *output_dir = ".";
+static bool write_files = true;
+
+/**
+ * @brief The pitches of pitches.h, a semitone apart from B0.
+ */
+static const int16_t pitches[] = {
+  B0, C1, CS1, D1, DS1, E1, F1, FS1, G1, GS1, A1, AS1,
+  B1, C2, CS2, D2, DS2, E2, F2, FS2, G2, GS2, A2, AS2,
+  B2, C3, CS3, D3, DS3, E3, F3, FS3, G3, GS3, A3, AS3,
+  B3, C4, CS4, D4, DS4, E4, F4, FS4, G4, GS4, A4, AS4,
+  B4, C5, CS5, D5, DS5, E5, F5, FS5, G5, GS5, A5, AS5,
+  B5, C6, CS6, D6, DS6, E6, F6, FS6, G6, GS6, A6, AS6,
+  B6, C7, CS7, D7, DS7, E7, F7, FS7, G7, GS7, A7, AS7,
+  B7, C8, CS8, D8, DS8,
+};
+
+/**
+ * @brief The waveform names of song files.
+ */
+static const struct { const char *name; uint8_t waveform; } waveform_names[] = {
+  { "NOISE", NOISE }, { "SQUARE", SQUARE }, { "SAW", SAW },
+  { "TRIANGLE", TRIANGLE }, { "SINE", SINE },
+};
+
+/**
+ * @brief The built-in pattern: arp, pad and bass, 32 steps.
+ */
+static const int16_t demo_notes[3][32] = {
+  { AS3, -1,  D4, -1,  F4, -1, AS4, -1, AS3, -1,  D4, -1,  F4, -1, AS4, -1,
+     G3, -1, AS3, -1,  D4, -1,  F4, -1,  G3, -1, AS3, -1,  D4, -1,  F4, -1 },
+  {  F3,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    AS2,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0 },
+  { AS2,  0, -1,  0, AS3,  0, -1, AS2,  0, AS2,  0, AS2, AS3,  0, -1,  0,
+    DS2,  0, -1,  0, DS3,  0, -1, DS2,  0, DS2,  0, DS2, DS3,  0, -1,  0 },
+};
+
+static const SynthPreset demo_voices[3] = {
+  { .waveforms = TRIANGLE | SQUARE, .attack_ms = 16, .decay_ms = 168, .sustain = 0xafff, .release_ms = 168, .volume = 10000 },
+  { .waveforms = SINE | SQUARE, .attack_ms = 56, .decay_ms = 2000, .sustain = 0, .release_ms = 0x8080, .volume = 10000 },
+  { .waveforms = SQUARE, .attack_ms = 10, .decay_ms = 100, .sustain = 0, .release_ms = 500, .volume = 12000 },
+};
+
+/**
+ * @brief The waveforms given to the arp in the sweep.
+ */
+static const struct { const char *name; uint8_t waveforms; } demo_waveforms[] = {
+  { "sine", SINE }, { "triangle", TRIANGLE }, { "saw", SAW }, { "square", SQUARE },
+  { "trisquare", TRIANGLE | SQUARE }, { "sinesaw", SINE | SAW },
+};
+
+static const uint8_t demo_dividers[] = { 1, 2, 4 };
+
+/**
+ * @brief Gets the time of a monotonic clock.
+ *
+ * @return The time in seconds.
+ */
+static double now_s(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Writes a little-endian value.
+ *
+ * @param out The buffer to write to.
+ * @param value The value.
+ * @param bytes The size of the value.
+ */
+static void put_le(uint8_t *out, uint32_t value, uint8_t bytes) {
+  for(uint8_t i = 0; i < bytes; i++) { out[i] = value >> (8 * i); }
+}
+
+/**
+ * @brief Writes the header of a 16-bit mono WAV file.
+ *
+ * @param file The file, at its start.
+ * @param rate The sample rate.
+ * @param frames The number of frames of the file.
+ *
+ * @return True if the header was written.
+ */
+static bool write_wav_header(FILE *file, uint32_t rate, uint64_t frames) {
+  uint8_t h[44];
+  uint32_t data_bytes = (uint32_t)MIN(frames * 2, 0xffffffffu - 36);
+  memcpy(h, "RIFF", 4);      put_le(h + 4, 36 + data_bytes, 4);
+  memcpy(h + 8, "WAVEfmt ", 8);
+  put_le(h + 16, 16, 4);     // fmt chunk size
+  put_le(h + 20, 1, 2);      // PCM
+  put_le(h + 22, 1, 2);      // channels
+  put_le(h + 24, rate, 4);
+  put_le(h + 28, rate * 2, 4);
+  put_le(h + 32, 2, 2);      // block align
+  put_le(h + 34, 16, 2);     // bits per sample
+  memcpy(h + 36, "data", 4); put_le(h + 40, data_bytes, 4);
+  return fwrite(h, sizeof(h), 1, file) == 1;
+}
+
+/**
+ * @brief Renders a job into its WAV file and measures it.
+ *
+ * @param job The job.
+ */
+static void render_job(BatchJob *job) {
+  double start = now_s();
+  Synth *synth = calloc(1, sizeof(Synth));
+  Sequencer *seq = calloc(1, sizeof(Sequencer));
+  FILE *file = NULL;
+  if(!synth || !seq) {
+    job->failed = true;
+    goto done;
+  }
+
+  if(write_files) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s.wav", output_dir, job->name);
+    file = fopen(path, "wb");
+    if(!file || !write_wav_header(file, job->rate, 0)) {
+      fprintf(stderr, "%s: %s\n", path, strerror(errno));
+      job->failed = true;
+      goto done;
+    }
+  }
+
+  AudioChannel *voices = synth_init_ctx(synth, job->num_voices, job->rate);
+  synth_set_rate_divider_ctx(synth, job->divider);
+  for(uint8_t i = 0; i < job->num_voices; i++) {
+    synth_apply_preset(&voices[i], &job->voices[i]);
+  }
+
+  // The notes rows are BATCH_MAX_STEPS apart, the sequencer wants them packed
+  static _Thread_local int16_t notes[CHANNEL_COUNT * BATCH_MAX_STEPS];
+  for(uint8_t i = 0; i < job->num_voices; i++) {
+    memcpy(notes + i * job->steps, job->notes[i], job->steps * sizeof(int16_t));
+  }
+  sequencer_init_ctx(seq, synth, job->num_voices, notes, job->steps);
+  sequencer_set_tempo_ctx(seq, job->bpm);
+  sequencer_start_ctx(seq, true);
+
+  int16_t block[SYNTH_BLOCK_SIZE];
+  uint64_t total = (uint64_t)job->seconds * job->rate;
+  while(job->frames < total) {
+    uint32_t frames = (uint32_t)MIN(total - job->frames, SYNTH_BLOCK_SIZE);
+    sequencer_task_ctx(seq);
+    synth_render_ctx(synth, block, frames);
+
+    for(uint32_t i = 0; i < frames; i++) {
+      int32_t x = block[i];
+      job->peak = MAX(job->peak, abs(x));
+      job->sum_squares += (double)x * x;
+      if(x == 0x7fff || x == -0x8000) { job->clipped++; }
+    }
+    if(file && fwrite(block, sizeof(int16_t), frames, file) != frames) {
+      job->failed = true;
+      break;
+    }
+    job->frames += frames;
+  }
+
+  if(file && !job->failed) {
+    job->failed = fseek(file, 0, SEEK_SET) != 0 || !write_wav_header(file, job->rate, job->frames);
+  }
+
+done:
+  if(file && fclose(file) != 0) { job->failed = true; }
+  free(synth);
+  free(seq);
+  job->elapsed_s = now_s() - start;
+}
+
+/**
+ * @brief Renders jobs until there are none left.
+ *
+ * @param arg Unused.
+ *
+ * @return NULL.
+ */
+static void * worker(void *arg) {
+  uint32_t i;
+  while((i = atomic_fetch_add(&next_job, 1)) < job_count) {
+    render_job(&jobs[i]);
+  }
+  return NULL;
+}
+
+/**
+ * @brief Adds an empty job to the list.
+ *
+ * @return The job, with the default settings.
+ */
+static BatchJob * add_job(void) {
+  BatchJob *grown = realloc(jobs, (job_count + 1) * sizeof(BatchJob));
+  if(!grown) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  jobs = grown;
+  BatchJob *job = &jobs[job_count++];
+  memset(job, 0, sizeof(*job));
+  job->bpm = 120;
+  job->steps = 16;
+  job->rate = BATCH_DEFAULT_RATE;
+  job->divider = 1;
+  return job;
+}
+
+/**
+ * @brief Adds the sweep of the built-in pattern.
+ *
+ * @param seconds The length of each render.
+ */
+static void add_demo_jobs(uint32_t seconds) {
+  for(uint16_t bpm = 90; bpm <= 180; bpm += 10) {
+    for(uint8_t w = 0; w < count_of(demo_waveforms); w++) {
+      for(uint8_t d = 0; d < count_of(demo_dividers); d++) {
+        BatchJob *job = add_job();
+        snprintf(job->name, sizeof(job->name), "demo_%ubpm_%s_div%u",
+                 bpm, demo_waveforms[w].name, demo_dividers[d]);
+        job->bpm = bpm;
+        job->steps = count_of(demo_notes[0]);
+        job->seconds = seconds;
+        job->divider = demo_dividers[d];
+        job->num_voices = count_of(demo_voices);
+        for(uint8_t i = 0; i < job->num_voices; i++) {
+          job->voices[i] = demo_voices[i];
+          memcpy(job->notes[i], demo_notes[i], sizeof(demo_notes[i]));
+        }
+        job->voices[0].waveforms = demo_waveforms[w].waveforms;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Parses a note of a song file.
+ *
+ * @param token The note: a name of pitches.h such as CS4, a frequency, . or -.
+ * @param note The note, in the format of the sequencer.
+ *
+ * @return True if the note is valid.
+ */
+static bool parse_note(const char *token, int16_t *note) {
+  static const int8_t semitones[] = { 9, 11, 0, 2, 4, 5, 7 }; // A to G
+  if(strcmp(token, ".") == 0) { *note = 0; return true; }
+  if(strcmp(token, "-") == 0) { *note = -1; return true; }
+
+  char *end;
+  if(isdigit((unsigned char)token[0])) {
+    long hz = strtol(token, &end, 10);
+    if(*end || hz < 1 || hz > 0x7fff) { return false; }
+    *note = hz;
+    return true;
+  }
+
+  char letter = toupper((unsigned char)token[0]);
+  if(letter < 'A' || letter > 'G') { return false; }
+  int semitone = semitones[letter - 'A'];
+  token++;
+  if(*token == 'S' || *token == 's') {
+    semitone++;
+    token++;
+  }
+  long octave = strtol(token, &end, 10);
+  if(end == token || *end) { return false; }
+  long index = octave * 12 + semitone - 11; // B0 is the first pitch
+  if(index < 0 || index >= (long)count_of(pitches)) { return false; }
+  *note = pitches[index];
+  return true;
+}
+
+/**
+ * @brief Parses the waveforms of a voice line.
+ *
+ * @param token The waveform names, separated by |.
+ * @param waveforms The waveforms bitmask.
+ *
+ * @return True if every name is known.
+ */
+static bool parse_waveforms(char *token, uint8_t *waveforms) {
+  *waveforms = 0;
+  for(char *name = strtok(token, "|"); name; name = strtok(NULL, "|")) {
+    uint8_t i = 0;
+    while(i < count_of(waveform_names) && strcmp(name, waveform_names[i].name) != 0) { i++; }
+    if(i == count_of(waveform_names)) { return false; }
+    *waveforms |= waveform_names[i].waveform;
+  }
+  return *waveforms != 0;
+}
+
+/**
+ * @brief Adds a job from a song file.
+ *
+ * @param path The song file.
+ * @param seconds The length of the render, unless the song sets it.
+ *
+ * @return True if the song was read.
+ */
+static bool add_song_job(const char *path, uint32_t seconds) {
+  FILE *file = fopen(path, "r");
+  if(!file) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  BatchJob *job = add_job();
+  const char *base = strrchr(path, '/');
+  base = base ? base + 1 : path;
+  snprintf(job->name, sizeof(job->name), "%.*s", (int)strcspn(base, "."), base);
+  job->seconds = seconds;
+
+  char line[4096];
+  uint16_t line_number = 0;
+  uint16_t filled[CHANNEL_COUNT] = { 0 };
+  bool ok = true;
+  while(ok && fgets(line, sizeof(line), file)) {
+    line_number++;
+    line[strcspn(line, "#\r\n")] = '\0';
+    char *save;
+    char *key = strtok_r(line, " \t", &save);
+    if(!key) { continue; }
+
+    char *args[6] = { NULL };
+    uint8_t count = 0;
+    if(strcmp(key, "notes") != 0) {
+      while(count < count_of(args) && (args[count] = strtok_r(NULL, " \t", &save))) { count++; }
+    }
+
+    if(strcmp(key, "bpm") == 0 && count == 1) {
+      job->bpm = atoi(args[0]);
+      ok = job->bpm > 0;
+    } else if(strcmp(key, "steps") == 0 && count == 1) {
+      job->steps = atoi(args[0]);
+      ok = job->steps > 0 && job->steps <= BATCH_MAX_STEPS;
+    } else if(strcmp(key, "seconds") == 0 && count == 1) {
+      job->seconds = atoi(args[0]);
+    } else if(strcmp(key, "rate") == 0 && (count == 1 || count == 2)) {
+      job->rate = atoi(args[0]);
+      job->divider = count == 2 ? atoi(args[1]) : 1;
+      ok = job->rate >= 8000 && job->rate <= 96000 && (job->divider == 1 || job->divider == 2 || job->divider == 4);
+    } else if(strcmp(key, "voice") == 0 && count == 6 && job->num_voices < CHANNEL_COUNT) {
+      SynthPreset *v = &job->voices[job->num_voices++];
+      ok = parse_waveforms(args[0], &v->waveforms);
+      v->attack_ms  = atoi(args[1]);
+      v->decay_ms   = atoi(args[2]);
+      v->sustain    = MIN(atoi(args[3]), 100) * 0xffff / 100;
+      v->release_ms = atoi(args[4]);
+      v->volume     = atoi(args[5]);
+    } else if(strcmp(key, "notes") == 0 && job->num_voices > 0) {
+      uint8_t v = job->num_voices - 1;
+      for(char *token = strtok_r(NULL, " \t", &save); ok && token; token = strtok_r(NULL, " \t", &save)) {
+        ok = filled[v] < BATCH_MAX_STEPS && parse_note(token, &job->notes[v][filled[v]++]);
+      }
+    } else {
+      ok = false;
+    }
+  }
+  fclose(file);
+
+  if(ok && job->num_voices == 0) {
+    fprintf(stderr, "%s: no voice\n", path);
+    job_count--;
+    return false;
+  }
+  if(!ok) {
+    fprintf(stderr, "%s:%u: invalid line\n", path, line_number);
+    job_count--;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Converts a level to dB relative to full scale.
+ *
+ * @param level The level, 32768 being full scale.
+ *
+ * @return The level in dBFS.
+ */
+static double dbfs(double level) {
+  return level > 0 ? 20 * log10(level / 32768.0) : -INFINITY;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr, "usage: %s [-j threads] [-o dir] [-s seconds] [-n] [song ...]\n", program);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  uint32_t seconds = BATCH_DEFAULT_SECONDS;
+  int option;
+  while((option = getopt(argc, argv, "j:o:s:n")) != -1) {
+    switch(option) {
+      case 'j': threads = atol(optarg); break;
+      case 'o': output_dir = optarg; break;
+      case 's': seconds = atoi(optarg); break;
+      case 'n': write_files = false; break;
+      default:  usage(argv[0]);
+    }
+  }
+  threads = MIN(MAX(threads, 1), BATCH_MAX_THREADS);
+
+  if(optind == argc) {
+    add_demo_jobs(seconds);
+  }
+  bool ok = true;
+  for(int i = optind; i < argc; i++) {
+    ok &= add_song_job(argv[i], seconds);
+  }
+  if(job_count == 0) { return 1; }
+  if(write_files) { mkdir(output_dir, 0777); }
+
+  double start = now_s();
+  pthread_t workers[BATCH_MAX_THREADS];
+  threads = MIN(threads, (long)job_count);
+  atomic_init(&next_job, 0);
+  for(long i = 0; i < threads; i++) {
+    if(pthread_create(&workers[i], NULL, worker, NULL) != 0) {
+      threads = i;
+      break;
+    }
+  }
+  if(threads == 0) { worker(NULL); }
+  for(long i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+  double elapsed = now_s() - start;
+
+  double audio_s = 0, cpu_s = 0;
+  for(uint32_t i = 0; i < job_count; i++) {
+    const BatchJob *job = &jobs[i];
+    double length = (double)job->frames / job->rate;
+    double rms = job->frames ? sqrt(job->sum_squares / job->frames) : 0;
+    printf("%-40s %6.1fs peak %6.1f dBFS rms %6.1f dBFS clipped %8llu %7.1fx%s\n",
+           job->name, length, dbfs(job->peak), dbfs(rms), (unsigned long long)job->clipped,
+           job->elapsed_s > 0 ? length / job->elapsed_s : 0, job->failed ? " FAILED" : "");
+    audio_s += length;
+    cpu_s += job->elapsed_s;
+    ok &= !job->failed;
+  }
+  printf("%u renders, %.1fs of audio in %.2fs on %ld threads: %.1fx realtime (%.1fx per thread)\n",
+         job_count, audio_s, elapsed, MAX(threads, 1L),
+         elapsed > 0 ? audio_s / elapsed : 0, cpu_s > 0 ? audio_s / cpu_s : 0);
+
+  free(jobs);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,30 @@
+#ifndef HOST_HARDWARE_CLOCKS_H
+#define HOST_HARDWARE_CLOCKS_H
+
+/**
+ * @file clocks.h
+ * @brief Stand-in for the Pico SDK header in host builds.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum clock_index {
+  clk_sys = 5
+};
+
+/**
+ * @brief The system clock of a stock RP2040, used for the oscillator budget.
+ */
+#define HOST_CLK_SYS_HZ 125000000
+
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
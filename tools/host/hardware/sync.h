@@ -0,0 +1,24 @@
+#ifndef HOST_HARDWARE_SYNC_H
+#define HOST_HARDWARE_SYNC_H
+
+/**
+ * @file sync.h
+ * @brief Stand-in for the Pico SDK header in host builds.
+ */
+
+#include "pico/stdlib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Memory barrier, a full fence between threads of the host.
+ */
+static inline void __dmb(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
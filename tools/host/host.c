@@ -0,0 +1,39 @@
+/**
+ * @file host.c
+ * @brief The Pico SDK functions used by the synth, for host builds.
+ */
+
+#include <time.h>
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+
+uint32_t save_and_disable_interrupts(void) { return 0; }
+void restore_interrupts(uint32_t status) { ; }
+
+uint64_t time_us_64(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+uint32_t time_us_32(void) { return (uint32_t)time_us_64(); }
+absolute_time_t get_absolute_time(void) { return time_us_64(); }
+absolute_time_t make_timeout_time_ms(uint32_t ms) { return time_us_64() + (uint64_t)ms * 1000; }
+absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms) { return t + (uint64_t)ms * 1000; }
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t)(to - from); }
+
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out) {
+  out->user_data = user_data;
+  return true;
+}
+bool cancel_repeating_timer(repeating_timer_t *timer) { return true; }
+
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data, bool fire_if_past) { return 0; }
+bool cancel_alarm(alarm_id_t alarm_id) { return false; }
+
+void gpio_init(uint gpio) { ; }
+void gpio_set_dir(uint gpio, bool out) { ; }
+void gpio_put(uint gpio, bool value) { ; }
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback) { ; }
+
+uint32_t clock_get_hz(enum clock_index clk_index) { return HOST_CLK_SYS_HZ; }
@@ -0,0 +1,82 @@
+#ifndef HOST_PICO_STDLIB_H
+#define HOST_PICO_STDLIB_H
+
+/**
+ * @file stdlib.h
+ * @brief Stand-in for the Pico SDK header in host builds.
+ *
+ * Provides the types and the few SDK functions the synth and the
+ * sequencer use, so they compile unchanged on a desktop machine. Each
+ * synth instance is used by one thread, so the interrupt functions do
+ * nothing, and the timers, alarms and GPIOs are never started.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PICO_ON_DEVICE 0
+
+typedef unsigned int uint;
+
+#ifndef MIN
+  #define MIN(a, b) ((b) > (a) ? (a) : (b))
+#endif
+#ifndef MAX
+  #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#define count_of(a) (sizeof(a) / sizeof((a)[0]))
+
+#define __isr
+#define __not_in_flash(group)
+#define __not_in_flash_func(func_name) func_name
+#define __time_critical_func(func_name) func_name
+
+static inline void tight_loop_contents(void) { ; }
+
+// Interrupts
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+
+// Time
+typedef uint64_t absolute_time_t;
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+absolute_time_t get_absolute_time(void);
+absolute_time_t make_timeout_time_ms(uint32_t ms);
+absolute_time_t delayed_by_ms(absolute_time_t t, uint32_t ms);
+int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to);
+
+// Timers and alarms
+typedef struct repeating_timer {
+  void *user_data;
+} repeating_timer_t;
+typedef bool (*repeating_timer_callback_t)(repeating_timer_t *timer);
+bool add_repeating_timer_ms(int32_t delay_ms, repeating_timer_callback_t callback, void *user_data, repeating_timer_t *out);
+bool cancel_repeating_timer(repeating_timer_t *timer);
+
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void *user_data);
+alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data, bool fire_if_past);
+bool cancel_alarm(alarm_id_t alarm_id);
+
+// GPIO
+#define GPIO_IN  false
+#define GPIO_OUT true
+#define GPIO_IRQ_EDGE_FALL 0x4u
+#define GPIO_IRQ_EDGE_RISE 0x8u
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t event_mask);
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t event_mask, bool enabled, gpio_irq_callback_t callback);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
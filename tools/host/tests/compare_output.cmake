@@ -0,0 +1,25 @@
+# Runs two programs and fails unless both succeed with the same output.
+#
+# Usage: cmake -DFIRST=program -DSECOND=program -P compare_output.cmake
+#
+# The programs print their mixer to stderr: when both use the scalar
+# loops, there is nothing to compare and the test is skipped.
+
+foreach(PROGRAM FIRST SECOND)
+    execute_process(COMMAND ${${PROGRAM}}
+            RESULT_VARIABLE ${PROGRAM}_RESULT
+            OUTPUT_VARIABLE ${PROGRAM}_OUTPUT
+            ERROR_VARIABLE ${PROGRAM}_MIXER)
+    if (NOT ${PROGRAM}_RESULT EQUAL 0)
+        message(FATAL_ERROR "${${PROGRAM}} failed (${${PROGRAM}_RESULT}):\n${${PROGRAM}_OUTPUT}${${PROGRAM}_MIXER}")
+    endif()
+    message(STATUS "${${PROGRAM}}: ${${PROGRAM}_OUTPUT}${${PROGRAM}_MIXER}")
+endforeach()
+
+if (NOT FIRST_OUTPUT STREQUAL SECOND_OUTPUT)
+    message(FATAL_ERROR "The outputs differ:\n${FIRST}: ${FIRST_OUTPUT}${SECOND}: ${SECOND_OUTPUT}")
+endif()
+
+if (NOT FIRST_MIXER MATCHES "vector" AND NOT SECOND_MIXER MATCHES "vector")
+    message(STATUS "No vector kernels in this build, nothing to compare")
+endif()
@@ -0,0 +1,88 @@
+/**
+ * @file effects_test.c
+ * @brief Renders the delay and the reverb with buffers of every small size.
+ *
+ * For each storage format and each buffer size up to a few hundred
+ * bytes, the delay and the reverb get a buffer of that size followed by
+ * guard bytes, and a note with both sends is rendered through them. The
+ * render must not fault and the guard bytes must be left untouched, so
+ * the lines never run past the buffer they were given.
+ *
+ * Usage: effects_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "synth.h"
+#include "effects.h"
+
+#define TEST_MAX_BYTES 600
+#define TEST_GUARD_BYTES 64
+#define TEST_GUARD 0xa5
+#define TEST_FRAMES 300
+
+static uint32_t failures = 0;
+
+/**
+ * @brief Checks the guard bytes after a buffer.
+ */
+static void check_guard(const uint8_t *buffer, uint32_t bytes, const char *what, uint8_t storage) {
+  for(uint32_t i = 0; i < TEST_GUARD_BYTES; i++) {
+    if(buffer[bytes + i] != TEST_GUARD) {
+      printf("%s, storage %u, %lu bytes: written past the buffer\n",
+             what, storage, (unsigned long)bytes);
+      failures++;
+      return;
+    }
+  }
+}
+
+int main() {
+  static const uint8_t storages[] = {EFFECTS_16BIT, EFFECTS_8BIT, EFFECTS_COMPANDED};
+  static int16_t output[TEST_FRAMES];
+  AudioChannel *voices = synth_init(1, 44100);
+  voices[0].waveforms = SAW;
+  voices[0].sustain = 0xffff;
+  voices[0].volume = 20000;
+  voices[0].sends[SEND_DELAY] = 0x8000;
+  voices[0].sends[SEND_REVERB] = 0x8000;
+  effects_set_delay_steps(1);
+
+  uint32_t renders = 0;
+  for(uint8_t s = 0; s < sizeof(storages); s++) {
+    for(uint32_t bytes = 0; bytes <= TEST_MAX_BYTES; bytes++) {
+      // Separate allocations, so that a sanitizer catches the overruns
+      // the guard bytes would miss
+      uint8_t *delay = malloc(bytes + TEST_GUARD_BYTES);
+      uint8_t *reverb = malloc(bytes + TEST_GUARD_BYTES);
+      memset(delay, TEST_GUARD, bytes + TEST_GUARD_BYTES);
+      memset(reverb, TEST_GUARD, bytes + TEST_GUARD_BYTES);
+      memset(delay, 0, bytes);
+      memset(reverb, 0, bytes);
+      effects_init_delay(delay, bytes, storages[s]);
+      effects_init_reverb(reverb, bytes, storages[s]);
+
+      SynthEvent note = {
+        .frame = synth_get_frame(),
+        .type = EVENT_NOTE_ON,
+        .channel = 0,
+        .value = 440,
+        .velocity = 0xffff
+      };
+      synth_queue_event(&note);
+      synth_render(output, TEST_FRAMES);
+      renders++;
+
+      check_guard(delay, bytes, "delay", storages[s]);
+      check_guard(reverb, bytes, "reverb", storages[s]);
+      effects_init_delay(NULL, 0, storages[s]);
+      effects_init_reverb(NULL, 0, storages[s]);
+      free(delay);
+      free(reverb);
+    }
+  }
+  printf("%lu renders, %lu failures\n", (unsigned long)renders, (unsigned long)failures);
+  return failures ? 1 : 0;
+}
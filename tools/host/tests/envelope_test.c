@@ -0,0 +1,335 @@
+/**
+ * @file envelope_test.c
+ * @brief Checks the envelope and the oscillators against a reference model.
+ *
+ * Random channel settings are rendered by a synth instance without the
+ * master bus, whose output is only the sum of its channels scaled by
+ * the volume and clipped, next to a model of the channels computed
+ * frame by frame in 64 bits. The settings cover the whole range of the
+ * channel fields: envelope times of 0 to 65535 ms, sustain, volume,
+ * velocity, frequency and pulse width, waveform masks including the
+ * bits that select no oscillator, and rates of 8 to 96 kHz.
+ *
+ * A synth just initialized must have no voice playing. After each
+ * render, the state of every channel must match the model, the level
+ * must stay within [0, 1] (Q24) and no phase may run past its end. The output must match the model frame by frame, unless a channel
+ * mixes the noise or the sine, whose tables the model does not repeat.
+ *
+ * Usage: envelope_test [iterations] [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "synth.h"
+
+#define TEST_VOICES 2
+#define TEST_FRAMES 12000
+#define TEST_MAX_BLOCK 300
+#define TEST_MAX_EVENTS 4
+#define TEST_MAX_FAILURES 10
+
+/**
+ * @brief The waveforms the model renders exactly.
+ */
+#define MODEL_WAVEFORMS (SQUARE | SAW | TRIANGLE)
+
+/**
+ * @brief The waveforms that select an oscillator.
+ */
+#define OSCILLATOR_WAVEFORMS (NOISE | SQUARE | SAW | TRIANGLE | SINE | WAVE)
+
+/**
+ * @brief The model of a channel.
+ */
+typedef struct ModelChannel {
+  enum ADSRPhase phase;
+  int64_t  level;     // envelope level (Q24)
+  int64_t  step;      // envelope increment per frame
+  uint32_t frame;     // frames into the phase
+  uint32_t end;       // length of the phase
+  uint32_t offset;    // oscillator position (Q16)
+} ModelChannel;
+
+/**
+ * @brief An event queued during a render.
+ */
+typedef struct TestEvent {
+  uint32_t frame;
+  uint8_t  type;
+  uint8_t  channel;
+  uint16_t value;
+  uint16_t velocity;
+} TestEvent;
+
+static const uint32_t rates[] = {8000, 11025, 22050, 32000, 44100, 48000, 88200, 96000};
+
+static uint32_t random_state;
+static uint32_t failures = 0;
+
+/**
+ * @brief Gets the next number of a xorshift generator.
+ */
+static uint32_t random_next() {
+  random_state ^= random_state << 13;
+  random_state ^= random_state >> 17;
+  random_state ^= random_state << 5;
+  return random_state;
+}
+
+/**
+ * @brief Gets a random envelope time, biased towards the short ones so
+ * that the phases end within a render.
+ */
+static uint16_t random_ms() {
+  switch(random_next() % 4) {
+    case 0:  return random_next() % 3;
+    case 1:  return random_next() % 50;
+    case 2:  return random_next() % 2000;
+    default: return random_next();
+  }
+}
+
+/**
+ * @brief Gets a random waveform mask.
+ */
+static uint8_t random_waveforms() {
+  switch(random_next() % 8) {
+    case 0:  return (random_next() & 0x06);                 // no oscillator
+    case 1:  return (random_next() & (NOISE | SINE | 0x06)) | SAW;
+    default: return (random_next() & (MODEL_WAVEFORMS | 0x06)) | SQUARE;
+  }
+}
+
+/**
+ * @brief Reports a failure, the first ones in full.
+ */
+static void fail(uint32_t iteration, const char *what, uint8_t c, int64_t expected, int64_t got) {
+  if(failures++ < TEST_MAX_FAILURES) {
+    printf("iteration %lu channel %u: %s is %lld, expected %lld\n",
+           (unsigned long)iteration, c, what, (long long)got, (long long)expected);
+  }
+}
+
+/**
+ * @brief Starts a phase of the model: the level goes from where it is
+ * to the target in ms milliseconds, by the same step on every frame.
+ */
+static void model_start(ModelChannel *m, enum ADSRPhase phase, uint16_t ms, int64_t target, uint32_t rate) {
+  m->phase = phase;
+  m->frame = 0;
+  m->end = (uint32_t)((uint64_t)ms * rate / 1000);
+  if(m->end == 0) {
+    m->level = target;
+    m->step = 0;
+  } else {
+    m->step = (target - m->level) / (int64_t)m->end;
+  }
+}
+
+/**
+ * @brief Applies an event to the model.
+ */
+static void model_event(ModelChannel *m, AudioChannel *channel, const TestEvent *event, uint32_t rate) {
+  if(event->type == EVENT_NOTE_ON) {
+    model_start(m, ATTACK, channel->attack_ms, 0xffffff, rate);
+  } else if(m->phase != ADSR_OFF) {
+    model_start(m, RELEASE, channel->release_ms, 0, rate);
+  }
+}
+
+/**
+ * @brief Renders a frame of a channel with the model.
+ *
+ * @param m The model of the channel.
+ * @param channel The channel, for its settings.
+ * @param frequency The frequency of the note.
+ * @param velocity The velocity of the note.
+ * @param rate The sample rate.
+ *
+ * @return The frame, before the volume of the synth.
+ */
+static int64_t model_frame(ModelChannel *m, const AudioChannel *channel, uint16_t frequency,
+                           uint16_t velocity, uint32_t rate) {
+  uint32_t increment = (uint32_t)(((uint64_t)frequency << 16) / rate);
+  m->offset = (m->offset + increment) & 0xffff;
+  if(m->phase == ADSR_OFF || !(channel->waveforms & OSCILLATOR_WAVEFORMS)) {
+    return 0;
+  }
+
+  while(m->phase != SUSTAIN && m->frame >= m->end) {
+    switch(m->phase) {
+      case ATTACK:
+        model_start(m, DECAY, channel->decay_ms, (int64_t)channel->sustain << 8, rate);
+        break;
+      case DECAY:
+        m->phase = SUSTAIN;
+        m->frame = 0;
+        m->end = 0;
+        m->step = 0;
+        break;
+      default:
+        m->phase = ADSR_OFF;
+        m->frame = 0;
+        m->step = 0;
+        return 0;
+    }
+  }
+  m->level += m->step;
+  m->frame++;
+
+  int64_t o = m->offset;
+  int64_t sample = 0;
+  int64_t count = 0;
+  if(channel->waveforms & SAW) {
+    sample += o - 0x7fff;
+    count++;
+  }
+  if(channel->waveforms & TRIANGLE) {
+    sample += o < 0x7fff ? o * 2 - 0x7fff : 0x7fff - (o - 0x7fff) * 2;
+    count++;
+  }
+  if(channel->waveforms & SQUARE) {
+    sample += o < channel->pulse_width ? 0x7fff : -0x7fff;
+    count++;
+  }
+  if(count == 0) {
+    return 0;
+  }
+  int64_t gain = ((int64_t)channel->volume * velocity) >> 16;
+  sample = sample / count;
+  sample = (sample * (m->level >> 8)) >> 16;
+  return (sample * gain) >> 16;
+}
+
+/**
+ * @brief Renders a set of random settings with the synth and the model.
+ *
+ * @param iteration The number of the set, for the reports.
+ *
+ * @return The number of phases the model went through.
+ */
+static uint32_t run(uint32_t iteration) {
+  static Synth synth;
+  static int16_t buffer[TEST_MAX_BLOCK];
+  uint32_t rate = rates[random_next() % (sizeof(rates) / sizeof(rates[0]))];
+  AudioChannel *channels = synth_init_ctx(&synth, TEST_VOICES, rate);
+  set_volume_ctx(&synth, 1 + random_next() % 100);
+  if(synth_active_voices_ctx(&synth) != 0) {
+    fail(iteration, "active voices", 0, 0, synth_active_voices_ctx(&synth));
+  }
+
+  ModelChannel model[TEST_VOICES] = {0};
+  uint16_t frequency[TEST_VOICES];
+  uint16_t velocity[TEST_VOICES];
+  bool exact = true;
+  for(uint8_t c = 0; c < TEST_VOICES; c++) {
+    AudioChannel *channel = &channels[c];
+    channel->waveforms = random_waveforms();
+    channel->attack_ms = random_ms();
+    channel->decay_ms = random_ms();
+    channel->release_ms = random_ms();
+    channel->sustain = random_next();
+    channel->volume = random_next();
+    channel->pulse_width = random_next();
+    exact = exact && !(channel->waveforms & (NOISE | SINE));
+    model[c].phase = channel->adsr_phase;
+    model[c].level = channel->adsr;
+    model[c].offset = channel->waveform_offset;
+    frequency[c] = channel->frequency;
+    velocity[c] = channel->velocity;
+  }
+
+  uint32_t phases = 0;
+  uint32_t now = 0;
+  while(now < TEST_FRAMES) {
+    uint32_t frames = 1 + random_next() % TEST_MAX_BLOCK;
+
+    // Notes on and off at random frames of the render, in the order the
+    // synth applies them
+    TestEvent events[TEST_MAX_EVENTS];
+    uint8_t event_count = random_next() % (TEST_MAX_EVENTS + 1);
+    for(uint8_t e = 0; e < event_count; e++) {
+      TestEvent event = {
+        .frame = now + random_next() % frames,
+        .type = (random_next() % 3) ? EVENT_NOTE_ON : EVENT_NOTE_OFF,
+        .channel = random_next() % TEST_VOICES,
+        .value = random_next(),
+        .velocity = random_next()
+      };
+      SynthEvent synth_event = {
+        .frame = event.frame,
+        .type = event.type,
+        .channel = event.channel,
+        .value = event.value,
+        .velocity = event.velocity
+      };
+      synth_queue_event_ctx(&synth, &synth_event);
+      uint8_t i = e;
+      while(i > 0 && events[i - 1].frame > event.frame) {
+        events[i] = events[i - 1];
+        i--;
+      }
+      events[i] = event;
+    }
+
+    synth_render_ctx(&synth, buffer, frames);
+
+    uint8_t next = 0;
+    for(uint32_t i = 0; i < frames; i++) {
+      for(; next < event_count && events[next].frame == now + i; next++) {
+        const TestEvent *event = &events[next];
+        if(event->type == EVENT_NOTE_ON) {
+          frequency[event->channel] = event->value;
+          velocity[event->channel] = event->velocity;
+        }
+        model_event(&model[event->channel], &channels[event->channel], event, rate);
+      }
+      int64_t mix = 0;
+      for(uint8_t c = 0; c < TEST_VOICES; c++) {
+        enum ADSRPhase phase = model[c].phase;
+        mix += model_frame(&model[c], &channels[c], frequency[c], velocity[c], rate);
+        phases += model[c].phase != phase;
+      }
+      mix = (mix * synth.volume) >> 16;
+      mix = MIN(MAX(mix, -0x8000), 0x7fff);
+      if(exact && buffer[i] != mix) {
+        if(failures++ < TEST_MAX_FAILURES) {
+          printf("iteration %lu frame %lu: output is %d, expected %d\n",
+                 (unsigned long)iteration, (unsigned long)(now + i), buffer[i], (int)mix);
+        }
+        exact = false; // one report per render
+      }
+    }
+    now += frames;
+
+    for(uint8_t c = 0; c < TEST_VOICES; c++) {
+      const AudioChannel *channel = &channels[c];
+      const ModelChannel *m = &model[c];
+      if(channel->adsr_phase != m->phase) { fail(iteration, "phase", c, m->phase, channel->adsr_phase); }
+      if(m->level < 0 || m->level > 0xffffff) { fail(iteration, "model level", c, 0xffffff, m->level); }
+      if(channel->adsr > 0xffffff) { fail(iteration, "level", c, 0xffffff, channel->adsr); }
+      if(channel->adsr != (uint32_t)m->level) { fail(iteration, "level", c, m->level, channel->adsr); }
+      if(channel->waveform_offset != m->offset) { fail(iteration, "offset", c, m->offset, channel->waveform_offset); }
+      if(channel->adsr_phase != SUSTAIN && channel->adsr_phase != ADSR_OFF &&
+         channel->adsr_frame > channel->adsr_end_frame) {
+        fail(iteration, "phase frame", c, channel->adsr_end_frame, channel->adsr_frame);
+      }
+    }
+  }
+  return phases;
+}
+
+int main(int argc, char **argv) {
+  uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 400;
+  random_state = argc > 2 ? strtoul(argv[2], NULL, 0) : 0x2545f491;
+  if(random_state == 0) { random_state = 1; }
+
+  uint32_t phases = 0;
+  for(uint32_t i = 0; i < iterations; i++) {
+    phases += run(i);
+  }
+  printf("%lu renders, %lu phases, %lu failures\n",
+         (unsigned long)iterations, (unsigned long)phases, (unsigned long)failures);
+  return failures ? 1 : 0;
+}
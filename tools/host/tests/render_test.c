@@ -0,0 +1,100 @@
+/**
+ * @file render_test.c
+ * @brief Renders a sequence through the whole master bus and prints a hash of it.
+ *
+ * The sequence plays every waveform, drums, the delay and the reverb,
+ * and changes the sample rate and the rate divider halfway, in blocks
+ * of varying length and in two output formats. The test is built with
+ * the vector kernels and with the scalar loops, and both must print the
+ * same hash. The mixer the test was built with is printed to stderr.
+ *
+ * Usage: render_test
+ */
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "synth.h"
+#include "drums.h"
+#include "effects.h"
+#include "sequencer.h"
+#include "pitches.h"
+#include "simd.h"
+
+#define TEST_BLOCKS 1500
+
+static uint8_t delay_buffer[8000];
+static uint8_t reverb_buffer[6000];
+
+static const int16_t notes[3][16] = {
+  {AS3, -1, D4, -1, F4, -1, AS4, -1, AS3, -1, D4, -1, F4, -1, AS4, -1},
+  {F3, 0, 0, 0, 0, 0, 0, 0, AS2, 0, 0, 0, 0, 0, 0, 0},
+  {F2, 0, F2, 0, 0, F2, 0, 0, F2, 0, F2, 0, 0, F2, 0, 0}
+};
+static const int16_t kick[16] = {1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1};
+
+int main() {
+  AudioChannel *voices = synth_init(3, 44100);
+  DrumVoice *drums = drums_init(2);
+  sequencer_init(5, (const int16_t *)notes, 16);
+  sequencer_set_track_notes(3, kick, 16, 1);
+  sequencer_set_track_drum(3, 0);
+  sequencer_set_track_notes(4, kick, 16, 2);
+  sequencer_set_track_drum(4, 1);
+
+  voices[0].waveforms = TRIANGLE | SQUARE;
+  voices[0].attack_ms = 16;
+  voices[0].decay_ms = 168;
+  voices[0].sustain = 0xafff;
+  voices[0].release_ms = 168;
+  voices[0].volume = 10000;
+  voices[0].sends[SEND_DELAY] = 0x6000;
+  voices[1].waveforms = SINE | NOISE;
+  voices[1].attack_ms = 56;
+  voices[1].decay_ms = 2000;
+  voices[1].sustain = 0;
+  voices[1].release_ms = 300;
+  voices[1].volume = 10000;
+  voices[1].sends[SEND_REVERB] = 0x8000;
+  voices[2].waveforms = SAW | TRIANGLE | SQUARE;
+  voices[2].attack_ms = 10;
+  voices[2].decay_ms = 100;
+  voices[2].release_ms = 500;
+  voices[2].volume = 12000;
+  drum_init(&drums[0], DRUM_KICK);
+  drums[0].volume = 30000;
+  drum_init(&drums[1], DRUM_SNARE);
+  drums[1].volume = 12000;
+
+  effects_init_delay(delay_buffer, sizeof(delay_buffer), EFFECTS_8BIT);
+  effects_set_delay_steps(3);
+  effects_init_reverb(reverb_buffer, sizeof(reverb_buffer), EFFECTS_COMPANDED);
+  set_volume(70);
+  sequencer_set_tempo(140);
+  sequencer_start(true);
+
+  // FNV-1a over the bytes of the output
+  uint32_t hash = 2166136261u;
+  static uint32_t buffer[300];
+  for(uint32_t n = 0; n < TEST_BLOCKS; n++) {
+    if(n == 500) {
+      sequencer_set_sample_rate(44100, 2);
+      sequencer_start(true);
+    }
+    if(n == 1000) {
+      sequencer_set_sample_rate(32000, 1);
+      sequencer_start(true);
+    }
+    sequencer_task();
+    uint32_t frames = 200 + (n % 7) * 13;
+    uint8_t format = (n % 2) ? SYNTH_FORMAT_STEREO16 : SYNTH_FORMAT_MONO16;
+    synth_render_format(buffer, frames, format);
+    const uint8_t *bytes = (const uint8_t *)buffer;
+    for(uint32_t i = 0; i < frames * ((n % 2) ? 4 : 2); i++) {
+      hash ^= bytes[i];
+      hash *= 16777619u;
+    }
+  }
+  printf("hash %08lx frame %lu\n", (unsigned long)hash, (unsigned long)synth_get_frame());
+  fprintf(stderr, "mixer: %s\n", SYNTH_USE_SIMD ? "vector kernels" : "scalar loops");
+  return 0;
+}